@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -9,40 +10,375 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
 #include "../TCP_Server/tcp_utils.h"
+#include "../TCP_Server/frame.h"
+#include "../TCP_Server/hash.h"
+#include "../TCP_Server/compress.h"
 
-#define BUFF_SIZE (1 << 14)
+/* Undoes COMPRESSED frames, once the server agreed to deflate */
+struct frame_inflater *inflater = NULL;
 
 void show_menu()
 {
     printf("\nMenu:\n");
-    printf("1. Log in\n");
-    printf("2. Post message\n");
-    printf("3. Log out\n");
-    printf("4. Exit\n");
+    printf("1. Register\n");
+    printf("2. Log in\n");
+    printf("3. Send message\n");
+    printf("4. Read offline messages\n");
+    printf("5. Log out\n");
+    printf("6. Upload file\n");
+    printf("7. Download file\n");
+    printf("8. Exit\n");
     printf("Choose an option: ");
 }
 
-int main(int argc, char *argv[])
+/* Read one line from stdin without the newline. Returns 0 on success, -1 on EOF */
+int read_line(const char *prompt, char *buf, size_t size)
+{
+    printf("%s", prompt);
+    if (fgets(buf, size, stdin) == NULL)
+        return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* Print OFFLINE_MESSAGES_DATA: count|sender_id|sender_name|content|timestamp|... */
+void print_offline_messages(char *payload)
 {
-    if (argc != 3)
+    char *save = NULL;
+    char *field = strtok_r(payload, "|", &save);
+    int count = field ? atoi(field) : 0;
+
+    printf("Server: %d offline message(s)\n", count);
+    for (int i = 0; i < count; i++)
     {
-        printf("Invalid arguments\n");
-        printf("Valid example: ./client 127.0.0.1 5550\n");
+        char *sender_id = strtok_r(NULL, "|", &save);
+        char *sender_name = strtok_r(NULL, "|", &save);
+        char *content = strtok_r(NULL, "|", &save);
+        char *timestamp = strtok_r(NULL, "|", &save);
+        if (timestamp == NULL)
+            break;
+        time_t t = (time_t)atoll(timestamp);
+        char when[32];
+        strftime(when, sizeof(when), "%d/%m/%Y %H:%M:%S", localtime(&t));
+        printf("  [%s] %s (#%s): %s\n", when, sender_name, sender_id, content);
+    }
+}
+
+/* Print a piece of a long message: message_id|sender_id|sender_name|timestamp|more|data */
+void print_chunk(const struct frame *frame)
+{
+    static long long current; /* Message whose pieces are being printed */
+    char *save = NULL;
+    char *id = strtok_r(frame->payload, "|", &save);
+    char *sender_id = strtok_r(NULL, "|", &save);
+    char *sender_name = strtok_r(NULL, "|", &save);
+    char *timestamp = strtok_r(NULL, "|", &save);
+    char *more = strtok_r(NULL, "|", &save);
+    if (more == NULL)
+        return;
+
+    char *data = more + strlen(more) + 1;
+    size_t len = frame->length - (data - frame->payload);
+    if (atoll(id) != current)
+    {
+        current = atoll(id);
+        time_t t = (time_t)atoll(timestamp);
+        char when[32];
+        strftime(when, sizeof(when), "%d/%m/%Y %H:%M:%S", localtime(&t));
+        printf("\n[%s] %s (#%s): ", when, sender_name, sender_id);
+    }
+    fwrite(data, 1, len, stdout);
+    if (strcmp(more, "0") == 0)
+    {
+        printf("\n");
+        current = 0;
+    }
+}
+
+/* Handle a frame the server sent on its own. Returns 1 if it was one, 0 for a response */
+int handle_push(int sock, const struct frame *frame)
+{
+    if (frame->type == MSG_PING)
+    {
+        send_frame(sock, CMD_PONG, NULL, 0);
+        return 1;
+    }
+    if (frame->type == MSG_GROUP_MESSAGE_RECEIVED)
+    {
+        printf("\nGroup message: %s\n", frame->payload);
+        return 1;
+    }
+    if (frame->type == MSG_MESSAGE_CHUNK_RECEIVED)
+    {
+        print_chunk(frame);
         return 1;
     }
+    return 0;
+}
+
+/* recv_frame(), with a COMPRESSED frame turned back into the one it stands for. Returns as recv_frame() */
+int recv_plain_frame(int sock, struct ring_buffer *rb, struct frame *frame, char *buff)
+{
+    static char plain[BUFF_SIZE];
+    uint16_t type;
 
-    char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
+    int ret = recv_frame(sock, rb, frame, buff, BUFF_SIZE);
+    if (ret != 1 || frame->type != MSG_COMPRESSED)
+        return ret;
+    int len = inflater ? inflater_frame(inflater, frame->payload, frame->length, &type, plain, BUFF_SIZE - 1) : -1;
+    if (len < 0)
+    {
+        printf("Corrupt compressed frame\n");
+        return -1;
+    }
+    memcpy(buff, plain, len);
+    buff[len] = '\0';
+    frame->type = type;
+    frame->length = len;
+    frame->payload = buff;
+    return 1;
+}
 
+/* Wait for the user to type, answering heartbeats meanwhile. Returns 0 on input, -1 if the server is gone */
+int wait_for_input(int sock, struct ring_buffer *rb, char *buff)
+{
+    struct frame frame;
+
+    while (1)
+    {
+        if (rb_used(rb) == 0)
+        {
+            struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {sock, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1)
+                return -1;
+            if (fds[0].revents & (POLLIN | POLLHUP))
+                return 0;
+        }
+        if (recv_plain_frame(sock, rb, &frame, buff) != 1)
+            return -1;
+        if (!handle_push(sock, &frame))
+            printf("\nServer: %s\n", frame.payload);
+    }
+}
+
+/* Wait for the response to a request, handling anything the server sent before it. Returns 1 on success */
+int recv_response(int sock, struct ring_buffer *rb, struct frame *frame, char *buff)
+{
+    int ret;
+    while ((ret = recv_plain_frame(sock, rb, frame, buff)) == 1 && handle_push(sock, frame))
+        ;
+    return ret;
+}
+
+/*
+ * Send a message too long for one frame in MESSAGE_CHUNK_MAX pieces, each
+ * acknowledged before the next
+ * Returns: 1 with the last response in frame, -1 if the connection failed
+ */
+int send_long_message(int sock, struct ring_buffer *rb, struct frame *frame, char *buff,
+                      const char *receiver, const char *message, size_t len)
+{
+    char chunk[FRAME_MAX_PAYLOAD];
+
+    for (size_t off = 0; off < len;)
+    {
+        size_t n = len - off < MESSAGE_CHUNK_MAX ? len - off : MESSAGE_CHUNK_MAX;
+        int head = snprintf(chunk, sizeof(chunk), "%s|%d|", receiver, off + n < len);
+        memcpy(chunk + head, message + off, n);
+        if (send_frame(sock, CMD_SEND_MESSAGE_CHUNK, chunk, head + n) == -1 ||
+            recv_response(sock, rb, frame, buff) != 1)
+            return -1;
+        off += n;
+        if (strncmp(frame->payload, "200|", 4) != 0)
+            break;
+    }
+    return 1;
+}
+
+/* Hash a whole file the way the server files it. Returns 0 on success, -1 on error */
+int hash_file(int fd, uint64_t *fast, unsigned char strong[HASH_STRONG_SIZE])
+{
+    struct content_hash hash;
+    char buf[64 << 10];
+    off_t off = 0;
+    ssize_t n;
+
+    content_hash_init(&hash);
+    while ((n = pread(fd, buf, sizeof(buf), off)) > 0)
+    {
+        content_hash_update(&hash, buf, n);
+        off += n;
+    }
+    content_hash_final(&hash, fast, strong);
+    return n == 0 ? 0 : -1;
+}
+
+/*
+ * Upload a file under its base name in FILE_PIECE_SIZE pieces, resuming
+ * where the copy on the server stops; content the server has already is
+ * not sent at all
+ * Returns: 1 with the last response in frame, 0 if the file cannot be read,
+ * -1 if the connection failed
+ */
+int upload_file(int sock, struct ring_buffer *rb, struct frame *frame, char *buff, const char *path)
+{
+    char payload[FILE_NAME_SIZE + 128], hex[HASH_STRONG_HEX];
+    unsigned char strong[HASH_STRONG_SIZE];
+    uint64_t fast;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || hash_file(fd, &fast, strong) == -1)
+    {
+        perror("Cannot read the file");
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    hash_strong_to_hex(strong, hex);
+    snprintf(payload, sizeof(payload), "%s|%lld|%016llx|%s", name, (long long)st.st_size,
+             (unsigned long long)fast, hex);
+    if (send_frame(sock, CMD_UPLOAD_FILE, payload, strlen(payload)) == -1 ||
+        recv_response(sock, rb, frame, buff) != 1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* 200|offset: go on from there; 201|size: the server has it all */
+    int ret = 1;
+    while (ret == 1 && strncmp(frame->payload, "200|", 4) == 0)
+    {
+        off_t off = atoll(frame->payload + 4);
+        size_t n = st.st_size - off < FILE_PIECE_SIZE ? st.st_size - off : FILE_PIECE_SIZE;
+        printf("Uploaded %lld of %lld bytes\n", (long long)off, (long long)st.st_size);
+        snprintf(payload, sizeof(payload), "%lld|%zu", (long long)off, n);
+        if (send_frame(sock, CMD_FILE_DATA, payload, strlen(payload)) == -1)
+            ret = -1;
+        /* The piece follows the frame as it is */
+        while (ret == 1 && n > 0)
+        {
+            ssize_t sent = sendfile(sock, fd, &off, n);
+            if (sent <= 0)
+                ret = -1;
+            else
+                n -= sent;
+        }
+        if (ret == 1 && recv_response(sock, rb, frame, buff) != 1)
+            ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+/*
+ * Download a file into the current directory, resuming a partial copy there
+ * Returns: 1 with the response in frame, 0 if the copy cannot be written,
+ * -1 if the connection failed
+ */
+int download_file(int sock, struct ring_buffer *rb, struct frame *frame, char *buff,
+                  const char *owner, const char *name)
+{
+    char payload[FILE_NAME_SIZE + 48];
+    struct stat st;
+    int fd = open(name, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror("Cannot write the file");
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+
+    off_t off = st.st_size;
+    snprintf(payload, sizeof(payload), "%s|%s|%lld", owner, name, (long long)off);
+    if (send_frame(sock, CMD_DOWNLOAD_FILE, payload, strlen(payload)) == -1 ||
+        recv_response(sock, rb, frame, buff) != 1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (strncmp(frame->payload, "200|", 4) != 0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    /* 200|size: the bytes from off on follow, other frames in between */
+    off_t size = atoll(frame->payload + 4);
+    while (off < size)
+    {
+        if (recv_plain_frame(sock, rb, frame, buff) != 1)
+        {
+            close(fd);
+            return -1;
+        }
+        if (frame->type != MSG_FILE_DATA)
+        {
+            if (!handle_push(sock, frame))
+                printf("\nServer: %s\n", frame->payload);
+            continue;
+        }
+        if (pwrite(fd, frame->payload, frame->length, off) != (ssize_t)frame->length)
+        {
+            perror("Cannot write the file");
+            close(fd);
+            return -1;
+        }
+        off += frame->length;
+    }
+    close(fd);
+    snprintf(frame->payload, BUFF_SIZE, "Downloaded %s (%lld bytes)", name, (long long)size);
+    return 1;
+}
+
+/* Agree on the connection's options with a server that offers them. Returns 0 on success, -1 on error */
+int say_hello(int sock, struct ring_buffer *rb, char *buff)
+{
+    char payload[64];
+    struct frame frame;
+
+    /* This client reads frames into BUFF_SIZE bytes, speaks no other encoding
+     * and would rather have large responses deflated */
+    snprintf(payload, sizeof(payload), "%d|%d|%s|%s,%s", PROTO_VERSION, FRAME_MAX_PAYLOAD,
+             codec_names[CODEC_FRAME], compress_names[COMPRESS_DEFLATE], compress_names[COMPRESS_NONE]);
+    if (send_frame(sock, CMD_HELLO, payload, strlen(payload)) == -1 ||
+        recv_frame(sock, rb, &frame, buff, BUFF_SIZE) != 1)
+    {
+        printf("Failed to agree on the protocol\n");
+        return -1;
+    }
+    if (strncmp(frame.payload, "200|", 4) != 0)
+    {
+        printf("Server: %s\n", frame.payload);
+        return -1;
+    }
+    /* 200|version|max_frame|codec|compress|heartbeat */
+    char *compress = frame.payload;
+    for (int i = 0; i < 4 && compress != NULL; i++)
+        compress = strchr(compress + 1, '|');
+    if (compress != NULL && strncmp(compress + 1, compress_names[COMPRESS_DEFLATE],
+                                    strlen(compress_names[COMPRESS_DEFLATE])) == 0)
+        inflater = inflater_new();
+    return 0;
+}
+
+/* Connect to the server over TCP. Returns the socket, -1 on error */
+int connect_tcp(const char *server_ip, int server_port)
+{
     int client_sock;
-    char buff[BUFF_SIZE];
     struct sockaddr_in server_addr;
 
     if ((client_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
     {
         perror("socket() error");
-        return 1;
+        return -1;
     }
 
     memset(&server_addr, 0, sizeof(struct sockaddr_in));
@@ -52,21 +388,96 @@ int main(int argc, char *argv[])
     if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0)
     {
         printf("Invalid address: %s\n", server_ip);
-        return 1;
+        close(client_sock);
+        return -1;
     }
 
     printf("Connecting to %s:%d...\n", server_ip, server_port);
     if (connect(client_sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) < 0)
     {
         perror("connect() error");
+        close(client_sock);
+        return -1;
+    }
+    return client_sock;
+}
+
+/* Connect to a server on this host through its Unix socket. Returns the socket, -1 on error */
+int connect_unix(const char *path)
+{
+    int client_sock;
+    struct sockaddr_un server_addr;
+
+    if (strlen(path) >= sizeof(server_addr.sun_path))
+    {
+        printf("Socket path too long: %s\n", path);
+        return -1;
+    }
+    if ((client_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        perror("socket() error");
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strcpy(server_addr.sun_path, path);
+
+    printf("Connecting to %s...\n", path);
+    if (connect(client_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("connect() error");
+        close(client_sock);
+        return -1;
+    }
+    return client_sock;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3)
+    {
+        printf("Invalid arguments\n");
+        printf("Valid example: ./client 127.0.0.1 5550\n");
+        printf("           or: ./client /tmp/chat.sock\n");
+        return 1;
+    }
+
+    int client_sock;
+    char buff[BUFF_SIZE];
+    struct ring_buffer recv_ring; /* Bytes received past the last response */
+
+    if (rb_init(&recv_ring, BUFF_SIZE) == -1)
+    {
+        perror("malloc() error");
         return 1;
     }
 
+    client_sock = argc == 2 ? connect_unix(argv[1]) : connect_tcp(argv[1], atoi(argv[2]));
+    if (client_sock == -1)
+        return 1;
+
     // Receive connection success message
-    int recv_len = recv_until_delimiter(client_sock, buff, BUFF_SIZE);
-    if (recv_len > 0)
+    int recv_len = recv_until_delimiter(client_sock, &recv_ring, buff, BUFF_SIZE);
+    if (recv_len > 4 && strncmp(buff, "100", 3) == 0)
     {
+        /* Capabilities follow the text; older servers offer none */
+        char *offer = strstr(buff, " version=");
+        if (offer != NULL)
+            *offer = '\0';
         printf("Server: %s\n", buff + 4);
+        if (offer != NULL && say_hello(client_sock, &recv_ring, buff) == -1)
+        {
+            close(client_sock);
+            return 1;
+        }
+    }
+    else if (recv_len > 4)
+    {
+        // Turned away (e.g. 503 when the server is busy)
+        printf("Server: %s\n", buff + 4);
+        close(client_sock);
+        return 1;
     }
     else
     {
@@ -78,6 +489,12 @@ int main(int argc, char *argv[])
     while (1)
     {
         show_menu();
+        fflush(stdout);
+        if (wait_for_input(client_sock, &recv_ring, buff) == -1)
+        {
+            printf("\nDisconnected from server\n");
+            break;
+        }
         int choice;
         if (scanf("%d", &choice) != 1)
         {
@@ -89,44 +506,97 @@ int main(int argc, char *argv[])
         while (getchar() != '\n')
             ;
 
-        char request[BUFF_SIZE];
-        memset(request, 0, BUFF_SIZE);
+        char payload[BUFF_SIZE];
+        uint16_t type;
+        struct frame frame;
 
-        if (choice == 1)
-        { // Log in
-            printf("Enter username: ");
-            char username[256];
-            if (fgets(username, sizeof(username), stdin))
+        if (choice == 1 || choice == 2)
+        { // Register / Log in
+            char username[USERNAME_SIZE], password[PASSWORD_SIZE];
+            if (read_line("Enter username: ", username, sizeof(username)) == -1 ||
+                read_line("Enter password: ", password, sizeof(password)) == -1)
             {
-                username[strcspn(username, "\n")] = '\0'; // remove newline
-                sprintf(request, "USER %s\r\n", username);
+                printf("Error reading credentials\n");
+                continue;
             }
-            else
+            snprintf(payload, sizeof(payload), "%s|%s", username, password);
+            type = choice == 1 ? CMD_REGISTER : CMD_LOGIN;
+        }
+        else if (choice == 3)
+        { // Send message
+            char receiver[16];
+            char *message = NULL;
+            size_t size = 0;
+            ssize_t len;
+            if (read_line("Enter receiver id: ", receiver, sizeof(receiver)) == -1)
             {
-                printf("Error reading username\n");
+                printf("Error reading message\n");
                 continue;
             }
-        }
-        else if (choice == 2)
-        { // Post message
             printf("Enter message: ");
-            char message[BUFF_SIZE - 10];
-            if (fgets(message, sizeof(message), stdin))
+            if ((len = getline(&message, &size, stdin)) == -1)
             {
-                message[strcspn(message, "\n")] = '\0';
-                sprintf(request, "POST %s\r\n", message);
+                free(message);
+                printf("Error reading message\n");
+                continue;
             }
-            else
+            message[strcspn(message, "\n")] = '\0';
+            len = strlen(message);
+
+            /* Long messages (pasted logs, code) go in chunks */
+            if (len > MESSAGE_CHUNK_MAX)
             {
-                printf("Error reading message\n");
+                int ret = send_long_message(client_sock, &recv_ring, &frame, buff, receiver, message, len);
+                free(message);
+                if (ret != 1)
+                {
+                    printf("Failed to receive response\n");
+                    break;
+                }
+                printf("Server: %s\n", frame.payload);
                 continue;
             }
+            snprintf(payload, sizeof(payload), "%s|%s", receiver, message);
+            free(message);
+            type = CMD_SEND_MESSAGE;
         }
-        else if (choice == 3)
+        else if (choice == 4)
+        { // Read offline messages
+            payload[0] = '\0';
+            type = CMD_GET_OFFLINE_MESSAGES;
+        }
+        else if (choice == 5)
         { // Log out
-            strcpy(request, "BYE\r\n");
+            payload[0] = '\0';
+            type = CMD_LOGOUT;
         }
-        else if (choice == 4)
+        else if (choice == 6 || choice == 7)
+        { // Upload / Download file
+            char path[512], owner[16];
+            int ret;
+            if (choice == 6)
+            {
+                if (read_line("Enter file path: ", path, sizeof(path)) == -1)
+                    continue;
+                ret = upload_file(client_sock, &recv_ring, &frame, buff, path);
+            }
+            else
+            {
+                if (read_line("Enter owner id: ", owner, sizeof(owner)) == -1 ||
+                    read_line("Enter file name: ", path, sizeof(path)) == -1)
+                    continue;
+                ret = download_file(client_sock, &recv_ring, &frame, buff, owner, path);
+            }
+            if (ret == -1)
+            {
+                printf("Failed to receive response\n");
+                break;
+            }
+            if (ret == 1)
+                printf("Server: %s\n", frame.payload);
+            continue;
+        }
+        else if (choice == 8)
         { // Exit
             break;
         }
@@ -137,25 +607,25 @@ int main(int argc, char *argv[])
         }
 
         // Send request
-        if (send_all(client_sock, request, strlen(request)) == -1)
+        if (send_frame(client_sock, type, payload, strlen(payload)) == -1)
         {
             perror("send error");
             break;
         }
 
-        // Receive response
-        recv_len = recv_until_delimiter(client_sock, buff, BUFF_SIZE);
-        if (recv_len > 0)
-        {
-            printf("Server: %s\n", buff + 4);
-        }
-        else
+        // Receive response, handling anything the server sent before it
+        if (recv_response(client_sock, &recv_ring, &frame, buff) != 1)
         {
             printf("Failed to receive response\n");
             break;
         }
+        if (frame.type == MSG_OFFLINE_MESSAGES_DATA)
+            print_offline_messages(frame.payload);
+        else
+            printf("Server: %s\n", frame.payload);
     }
 
     close(client_sock);
+    rb_free(&recv_ring);
     return 0;
 }
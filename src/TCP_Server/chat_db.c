@@ -0,0 +1,816 @@
+#include "chat_db.h"
+#include <crypt.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* One connection per storage worker thread (see db_async.h), opened on its
+ * first query: SQLite handles are not shared */
+static __thread sqlite3 *db = NULL;
+
+/**
+ * Open the database for the calling thread and make sure the tables exist
+ * @return: the connection, NULL on error
+ */
+static sqlite3 *db_get(void)
+{
+    if (db != NULL)
+        return db;
+
+    if (sqlite3_open(CHAT_DB, &db) != SQLITE_OK)
+    {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = NULL;
+        return NULL;
+    }
+    /* Reactors on other threads write through their own connections */
+    sqlite3_busy_timeout(db, 1000);
+
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(db,
+                          "CREATE TABLE IF NOT EXISTS accounts (id INTEGER PRIMARY KEY, username TEXT, password TEXT);"
+                          /* An index rather than a column constraint, so databases made before it get it too */
+                          "CREATE UNIQUE INDEX IF NOT EXISTS accounts_username ON accounts(username);"
+                          "CREATE TABLE IF NOT EXISTS groups ("
+                          "group_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                          "group_name TEXT NOT NULL, "
+                          "created_by INTEGER NOT NULL, "
+                          "created_at INTEGER NOT NULL, "
+                          "FOREIGN KEY(created_by) REFERENCES accounts(id)"
+                          ");"
+                          "CREATE TABLE IF NOT EXISTS group_members ("
+                          "group_id INTEGER NOT NULL, "
+                          "user_id INTEGER NOT NULL, "
+                          "role TEXT NOT NULL DEFAULT 'member', "
+                          "joined_at INTEGER NOT NULL, "
+                          "PRIMARY KEY(group_id, user_id), "
+                          "FOREIGN KEY(group_id) REFERENCES groups(group_id), "
+                          "FOREIGN KEY(user_id) REFERENCES accounts(id)"
+                          ");"
+                          "CREATE TABLE IF NOT EXISTS messages ("
+                          "message_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                          "sender_id INTEGER NOT NULL, "
+                          "receiver_id INTEGER, "
+                          "group_id INTEGER, "
+                          "content TEXT NOT NULL, "
+                          "timestamp INTEGER NOT NULL, "
+                          "read_status TEXT DEFAULT 'unread', "
+                          "is_offline INTEGER DEFAULT 0, "
+                          "FOREIGN KEY(sender_id) REFERENCES accounts(id), "
+                          "FOREIGN KEY(receiver_id) REFERENCES accounts(id), "
+                          "FOREIGN KEY(group_id) REFERENCES groups(group_id)"
+                          ");"
+                          "CREATE TABLE IF NOT EXISTS message_chunks ("
+                          "message_id INTEGER NOT NULL, "
+                          "seq INTEGER NOT NULL, "
+                          "data BLOB NOT NULL, "
+                          "PRIMARY KEY(message_id, seq), "
+                          "FOREIGN KEY(message_id) REFERENCES messages(message_id)"
+                          ");"
+                          "CREATE TABLE IF NOT EXISTS blobs ("
+                          "blob_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                          "fast INTEGER NOT NULL, "
+                          "strong BLOB NOT NULL, "
+                          "size INTEGER NOT NULL, "
+                          "refs INTEGER NOT NULL DEFAULT 0"
+                          ");"
+                          "CREATE INDEX IF NOT EXISTS blobs_fast ON blobs(fast);"
+                          "CREATE TABLE IF NOT EXISTS files ("
+                          "owner_id INTEGER NOT NULL, "
+                          "name TEXT NOT NULL, "
+                          "blob_id INTEGER NOT NULL, "
+                          "PRIMARY KEY(owner_id, name), "
+                          "FOREIGN KEY(owner_id) REFERENCES accounts(id), "
+                          "FOREIGN KEY(blob_id) REFERENCES blobs(blob_id)"
+                          ")",
+                          NULL, 0, &err_msg);
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_close(db);
+        db = NULL;
+    }
+    return db;
+}
+
+/**
+ * Prepare a statement on this thread's connection
+ * @return: the statement, NULL on error
+ */
+static sqlite3_stmt *db_prepare(const char *sql)
+{
+    sqlite3_stmt *stmt;
+    sqlite3 *conn = db_get();
+
+    if (conn == NULL)
+        return NULL;
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+        return NULL;
+    }
+    return stmt;
+}
+
+/* Passwords are stored as yescrypt hashes (crypt(3)), salted per account */
+#define PASSWORD_HASH_PREFIX "$y$"
+
+/* Hashed against when the username is unknown, so the reply takes as long */
+#define PASSWORD_DUMMY_SETTING "$y$j9T$BP7gNfAMyBtqBc8hOCmeG/"
+
+/* crypt_rn() scratch space (32 KiB), kept per storage worker rather than on its stack */
+static __thread struct crypt_data crypt_state;
+
+/**
+ * Hash a password with a new random salt
+ * @param out: CRYPT_OUTPUT_SIZE bytes
+ * @return: 0 on success, -1 on error
+ */
+static int password_hash(const char *password, char *out)
+{
+    char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+
+    if (crypt_gensalt_rn(PASSWORD_HASH_PREFIX, 0, NULL, 0, salt, sizeof(salt)) == NULL)
+        return -1;
+    const char *hash = crypt_rn(password, salt, &crypt_state, sizeof(crypt_state));
+    if (hash == NULL || hash[0] == '*')
+        return -1;
+    snprintf(out, CRYPT_OUTPUT_SIZE, "%s", hash);
+    return 0;
+}
+
+/* Compare two strings in a time that depends on their lengths only */
+static int equal_ct(const char *a, const char *b)
+{
+    size_t la = strlen(a), lb = strlen(b);
+    size_t n = la < lb ? la : lb;
+    unsigned char diff = la != lb;
+
+    for (size_t i = 0; i < n; i++)
+        diff |= (unsigned char)(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+/**
+ * Check a password against what an account stores: its hash, or for an
+ * account made before passwords were hashed, the password itself
+ * @return: 1 if it matches, 0 if not
+ */
+static int password_check(const char *password, const char *stored)
+{
+    if (stored[0] != '$')
+        return equal_ct(password, stored);
+    const char *hash = crypt_rn(password, stored, &crypt_state, sizeof(crypt_state));
+    return hash != NULL && hash[0] != '*' && equal_ct(hash, stored);
+}
+
+/**
+ * A single INSERT: the unique index on username settles two workers
+ * registering the same name at once
+ */
+int db_register(const char *username, const char *password, int *user_id)
+{
+    char hash[CRYPT_OUTPUT_SIZE];
+
+    if (password_hash(password, hash) == -1)
+    {
+        fprintf(stderr, "Password hashing failed\n");
+        return DB_ERROR;
+    }
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO accounts (username, password) VALUES (?, ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ((rc & 0xff) == SQLITE_CONSTRAINT)
+        return DB_CONFLICT;
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+
+    *user_id = (int)sqlite3_last_insert_rowid(db);
+    return DB_OK;
+}
+
+int db_login(const char *username, const char *password, int *user_id)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT id, password FROM accounts WHERE username = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+    int ret = DB_NOT_FOUND;
+    int legacy = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *stored = (const char *)sqlite3_column_text(stmt, 1);
+        if (stored != NULL && password_check(password, stored))
+        {
+            *user_id = sqlite3_column_int(stmt, 0);
+            legacy = stored[0] != '$';
+            ret = DB_OK;
+        }
+        else
+        {
+            ret = DB_BAD_PASSWORD;
+        }
+    }
+    else
+    {
+        password_check(password, PASSWORD_DUMMY_SETTING);
+    }
+    sqlite3_finalize(stmt);
+
+    /* A cleartext password left from before hashing is replaced on its first use */
+    char hash[CRYPT_OUTPUT_SIZE];
+    if (legacy && password_hash(password, hash) == 0)
+    {
+        stmt = db_prepare("UPDATE accounts SET password = ? WHERE id = ?");
+        if (stmt != NULL)
+        {
+            sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 2, *user_id);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+    }
+    return ret;
+}
+
+int db_get_username(int user_id, char *username, size_t size)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT username FROM accounts WHERE id = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, user_id);
+
+    int ret = DB_NOT_FOUND;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+        snprintf(username, size, "%s", name ? name : "");
+        ret = DB_OK;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int db_store_message(int sender_id, int receiver_id, const char *content, size_t len, int is_offline)
+{
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO messages (sender_id, receiver_id, group_id, content, timestamp, is_offline) "
+                                    "VALUES (?, ?, NULL, ?, ?, ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, sender_id);
+    sqlite3_bind_int(stmt, 2, receiver_id);
+    sqlite3_bind_text(stmt, 3, content, (int)len, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)time(NULL));
+    sqlite3_bind_int(stmt, 5, is_offline);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    return DB_OK;
+}
+
+/* Bytes of the content and sender name of m, as the offline batches count them */
+#define OFFLINE_ENTRY_LEN "(length(CAST(m.content AS BLOB)) + length(CAST(coalesce(a.username, '') AS BLOB)))"
+
+int db_take_offline_messages(int user_id, size_t max_len, db_message_cb cb, void *arg)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT m.message_id, m.sender_id, a.username, m.content, m.timestamp "
+                                    "FROM messages m LEFT JOIN accounts a ON a.id = m.sender_id "
+                                    "WHERE m.receiver_id = ? AND m.is_offline = 1 "
+                                    "AND NOT EXISTS (SELECT 1 FROM message_chunks c WHERE c.message_id = m.message_id) "
+                                    "AND " OFFLINE_ENTRY_LEN " <= ? "
+                                    "ORDER BY m.message_id");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)max_len);
+
+    int count = 0;
+    sqlite3_int64 last_id = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *name = (const char *)sqlite3_column_text(stmt, 2);
+        const char *content = (const char *)sqlite3_column_text(stmt, 3);
+        if (cb(arg, sqlite3_column_int(stmt, 1), name ? name : "", content ? content : "",
+               sqlite3_column_int64(stmt, 4)) != 0)
+            break;
+        last_id = sqlite3_column_int64(stmt, 0);
+        count++;
+    }
+    sqlite3_finalize(stmt);
+
+    if (count > 0)
+    {
+        stmt = db_prepare("UPDATE messages SET is_offline = 0 WHERE message_id IN ("
+                          "SELECT m.message_id FROM messages m LEFT JOIN accounts a ON a.id = m.sender_id "
+                          "WHERE m.receiver_id = ? AND m.is_offline = 1 AND m.message_id <= ? "
+                          "AND NOT EXISTS (SELECT 1 FROM message_chunks c WHERE c.message_id = m.message_id) "
+                          "AND " OFFLINE_ENTRY_LEN " <= ?)");
+        if (stmt == NULL)
+            return DB_ERROR;
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_int64(stmt, 2, last_id);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)max_len);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+    }
+    return count;
+}
+
+/**
+ * Run a statement taking one message id and nothing else
+ * @return: DB_OK, DB_ERROR
+ */
+static int db_exec_message(const char *sql, long long message_id)
+{
+    sqlite3_stmt *stmt = db_prepare(sql);
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int64(stmt, 1, message_id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+int db_begin_message_stream(int sender_id, int receiver_id, long long *message_id, long long *timestamp)
+{
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO messages (sender_id, receiver_id, group_id, content, timestamp, is_offline) "
+                                    "VALUES (?, ?, NULL, '', ?, 2)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    *timestamp = time(NULL);
+    sqlite3_bind_int(stmt, 1, sender_id);
+    sqlite3_bind_int(stmt, 2, receiver_id);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)*timestamp);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    *message_id = sqlite3_last_insert_rowid(db);
+    return DB_OK;
+}
+
+int db_store_message_chunk(long long message_id, unsigned seq, const char *data, size_t len)
+{
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO message_chunks (message_id, seq, data) VALUES (?, ?, ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int64(stmt, 1, message_id);
+    sqlite3_bind_int(stmt, 2, (int)seq);
+    sqlite3_bind_blob(stmt, 3, data, (int)len, SQLITE_STATIC);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    return DB_OK;
+}
+
+int db_end_message_stream(long long message_id, int is_offline)
+{
+    return db_exec_message(is_offline ? "UPDATE messages SET is_offline = 1 WHERE message_id = ?"
+                                      : "UPDATE messages SET is_offline = 0 WHERE message_id = ?",
+                           message_id);
+}
+
+int db_drop_message_stream(long long message_id)
+{
+    if (db_exec_message("DELETE FROM message_chunks WHERE message_id = ?", message_id) != DB_OK)
+        return DB_ERROR;
+    return db_exec_message("DELETE FROM messages WHERE message_id = ?", message_id);
+}
+
+/**
+ * A message too long for a batch is replayed as one chunk, read from its content
+ */
+int db_next_offline_stream(int user_id, size_t max_len, struct db_stream *stream)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT m.message_id, m.sender_id, a.username, m.timestamp, "
+                                    "(SELECT COUNT(*) FROM message_chunks c WHERE c.message_id = m.message_id) AS n "
+                                    "FROM messages m LEFT JOIN accounts a ON a.id = m.sender_id "
+                                    "WHERE m.receiver_id = ? AND m.is_offline = 1 "
+                                    "AND (n > 0 OR " OFFLINE_ENTRY_LEN " > ?) "
+                                    "ORDER BY m.message_id LIMIT 1");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)max_len);
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+    {
+        const char *name = (const char *)sqlite3_column_text(stmt, 2);
+        stream->message_id = sqlite3_column_int64(stmt, 0);
+        stream->sender_id = sqlite3_column_int(stmt, 1);
+        snprintf(stream->sender_name, sizeof(stream->sender_name), "%s", name ? name : "");
+        stream->timestamp = sqlite3_column_int64(stmt, 3);
+        stream->n_chunks = (unsigned)sqlite3_column_int(stmt, 4);
+        if (stream->n_chunks == 0)
+            stream->n_chunks = 1;
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW ? DB_OK : rc == SQLITE_DONE ? DB_NOT_FOUND : DB_ERROR;
+}
+
+/**
+ * substr() on a blob counts bytes, so only the requested piece is copied out;
+ * chunk 0 of a message stored whole is its content
+ */
+int db_read_message_chunk(long long message_id, unsigned seq, size_t offset, char *buf, size_t size,
+                          size_t *len, size_t *chunk_len)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT substr(data, ?, ?), length(data) FROM message_chunks "
+                                    "WHERE message_id = ?3 AND seq = ?4 "
+                                    "UNION ALL "
+                                    "SELECT substr(CAST(content AS BLOB), ?1, ?2), length(CAST(content AS BLOB)) "
+                                    "FROM messages WHERE message_id = ?3 AND ?4 = 0 "
+                                    "AND NOT EXISTS (SELECT 1 FROM message_chunks c WHERE c.message_id = ?3)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)offset + 1);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)size);
+    sqlite3_bind_int64(stmt, 3, message_id);
+    sqlite3_bind_int(stmt, 4, (int)seq);
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+    {
+        const void *data = sqlite3_column_blob(stmt, 0);
+        *len = (size_t)sqlite3_column_bytes(stmt, 0);
+        *chunk_len = (size_t)sqlite3_column_int64(stmt, 1);
+        if (*len > size)
+            *len = size;
+        if (*len > 0)
+            memcpy(buf, data, *len);
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW ? DB_OK : rc == SQLITE_DONE ? DB_NOT_FOUND : DB_ERROR;
+}
+
+int db_mark_delivered(long long message_id)
+{
+    return db_exec_message("UPDATE messages SET is_offline = 0 WHERE message_id = ?", message_id);
+}
+
+int db_create_group(const char *name, int creator_id, int *group_id)
+{
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO groups (group_name, created_by, created_at) VALUES (?, ?, ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, creator_id);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    *group_id = (int)sqlite3_last_insert_rowid(db);
+
+    stmt = db_prepare("INSERT INTO group_members (group_id, user_id, role, joined_at) VALUES (?, ?, 'admin', ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, *group_id);
+    sqlite3_bind_int(stmt, 2, creator_id);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? DB_OK : DB_ERROR;
+}
+
+int db_get_group(int group_id, char *name, size_t size)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT group_name FROM groups WHERE group_id = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, group_id);
+
+    int ret = DB_NOT_FOUND;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *text = (const char *)sqlite3_column_text(stmt, 0);
+        snprintf(name, size, "%s", text ? text : "");
+        ret = DB_OK;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int db_get_group_role(int group_id, int user_id, int *is_admin)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT role FROM group_members WHERE group_id = ? AND user_id = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, group_id);
+    sqlite3_bind_int(stmt, 2, user_id);
+
+    int ret = DB_NOT_FOUND;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *role = (const char *)sqlite3_column_text(stmt, 0);
+        *is_admin = role != NULL && strcmp(role, "admin") == 0;
+        ret = DB_OK;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int db_add_group_member(int group_id, int user_id)
+{
+    sqlite3_stmt *stmt = db_prepare("INSERT OR IGNORE INTO group_members (group_id, user_id, role, joined_at) "
+                                    "VALUES (?, ?, 'member', ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, group_id);
+    sqlite3_bind_int(stmt, 2, user_id);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    return sqlite3_changes(db) > 0 ? DB_OK : DB_CONFLICT;
+}
+
+int db_remove_group_member(int group_id, int user_id)
+{
+    sqlite3_stmt *stmt = db_prepare("DELETE FROM group_members WHERE group_id = ? AND user_id = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, group_id);
+    sqlite3_bind_int(stmt, 2, user_id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+        return DB_ERROR;
+    return sqlite3_changes(db) > 0 ? DB_OK : DB_NOT_FOUND;
+}
+
+int db_get_group_members(int group_id, db_member_cb cb, void *arg)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT user_id FROM group_members WHERE group_id = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, group_id);
+
+    int count = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        count++;
+        if (cb(arg, sqlite3_column_int(stmt, 0)) != 0)
+            break;
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+/**
+ * One row per receiver, all in a single transaction so a large group costs
+ * one commit rather than one per member
+ */
+int db_store_group_message(int sender_id, int group_id, const int *receivers, size_t n,
+                           const char *content, size_t len)
+{
+    sqlite3 *conn = db_get();
+    if (conn == NULL || sqlite3_exec(conn, "BEGIN", NULL, 0, NULL) != SQLITE_OK)
+        return DB_ERROR;
+
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO messages (sender_id, receiver_id, group_id, content, timestamp, is_offline) "
+                                    "VALUES (?, ?, ?, ?, ?, ?)");
+    if (stmt == NULL)
+    {
+        sqlite3_exec(conn, "ROLLBACK", NULL, 0, NULL);
+        return DB_ERROR;
+    }
+    sqlite3_bind_int(stmt, 1, sender_id);
+    sqlite3_bind_int(stmt, 3, group_id);
+    sqlite3_bind_text(stmt, 4, content, (int)len, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)time(NULL));
+
+    /* The history row first, whoever was online, then one per offline receiver */
+    sqlite3_bind_null(stmt, 2);
+    sqlite3_bind_int(stmt, 6, 0);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 6, 1);
+    for (size_t i = 0; i < n && rc == SQLITE_DONE; i++)
+    {
+        sqlite3_bind_int(stmt, 2, receivers[i]);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(conn));
+        sqlite3_exec(conn, "ROLLBACK", NULL, 0, NULL);
+        return DB_ERROR;
+    }
+    return sqlite3_exec(conn, "COMMIT", NULL, 0, NULL) == SQLITE_OK ? DB_OK : DB_ERROR;
+}
+
+int db_begin(void)
+{
+    sqlite3 *conn = db_get();
+    /* IMMEDIATE takes the write lock now rather than on the first write,
+     * so what is read in the transaction stays true until the commit */
+    if (conn == NULL || sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, 0, NULL) != SQLITE_OK)
+        return DB_ERROR;
+    return DB_OK;
+}
+
+int db_commit(void)
+{
+    if (sqlite3_exec(db, "COMMIT", NULL, 0, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Commit failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    return DB_OK;
+}
+
+void db_rollback(void)
+{
+    if (db != NULL)
+        sqlite3_exec(db, "ROLLBACK", NULL, 0, NULL);
+}
+
+int db_find_blob(int owner_id, uint64_t fast, const unsigned char strong[HASH_STRONG_SIZE], uint64_t size,
+                 long long *blob_id)
+{
+    /* The index narrows it down to the few blobs with this fast hash */
+    sqlite3_stmt *stmt = db_prepare("SELECT blob_id, strong FROM blobs WHERE fast = ?1 AND size = ?2 AND "
+                                    "(?3 = 0 OR blob_id IN (SELECT blob_id FROM files WHERE owner_id = ?3))");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)fast);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)size);
+    sqlite3_bind_int(stmt, 3, owner_id);
+
+    int rc, found = DB_NOT_FOUND;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        if (sqlite3_column_bytes(stmt, 1) == HASH_STRONG_SIZE &&
+            memcmp(sqlite3_column_blob(stmt, 1), strong, HASH_STRONG_SIZE) == 0)
+        {
+            *blob_id = sqlite3_column_int64(stmt, 0);
+            found = DB_OK;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? found : DB_ERROR;
+}
+
+int db_add_blob(uint64_t fast, const unsigned char strong[HASH_STRONG_SIZE], uint64_t size, long long *blob_id)
+{
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO blobs (fast, strong, size, refs) VALUES (?, ?, ?, 0)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)fast);
+    sqlite3_bind_blob(stmt, 2, strong, HASH_STRONG_SIZE, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)size);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+    *blob_id = sqlite3_last_insert_rowid(db);
+    return DB_OK;
+}
+
+/**
+ * Add delta to a blob's references, deleting it when none are left
+ * @return: DB_OK (*freed set, fast, strong and size filled in if so), DB_ERROR
+ */
+static int db_ref_blob(long long blob_id, int delta, int *freed, uint64_t *fast,
+                       unsigned char strong[HASH_STRONG_SIZE], uint64_t *size)
+{
+    *freed = 0;
+    sqlite3_stmt *stmt =
+        db_prepare("UPDATE blobs SET refs = refs + ? WHERE blob_id = ? RETURNING refs, strong, fast, size");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, delta);
+    sqlite3_bind_int64(stmt, 2, blob_id);
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW && sqlite3_column_int64(stmt, 0) <= 0 &&
+        sqlite3_column_bytes(stmt, 1) == HASH_STRONG_SIZE)
+    {
+        memcpy(strong, sqlite3_column_blob(stmt, 1), HASH_STRONG_SIZE);
+        *fast = (uint64_t)sqlite3_column_int64(stmt, 2);
+        *size = (uint64_t)sqlite3_column_int64(stmt, 3);
+        *freed = 1;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        return DB_ERROR;
+
+    if (*freed)
+    {
+        stmt = db_prepare("DELETE FROM blobs WHERE blob_id = ?");
+        if (stmt == NULL)
+            return DB_ERROR;
+        sqlite3_bind_int64(stmt, 1, blob_id);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE)
+            return DB_ERROR;
+    }
+    return DB_OK;
+}
+
+int db_link_file(int owner_id, const char *name, long long blob_id, int *freed, uint64_t *freed_fast,
+                 unsigned char freed_strong[HASH_STRONG_SIZE], uint64_t *freed_size)
+{
+    long long old_id = 0;
+    int unused;
+
+    *freed = 0;
+    sqlite3_stmt *stmt = db_prepare("SELECT blob_id FROM files WHERE owner_id = ? AND name = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, owner_id);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+        old_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        return DB_ERROR;
+    if (old_id == blob_id)
+        return DB_OK;
+
+    stmt = db_prepare("INSERT OR REPLACE INTO files (owner_id, name, blob_id) VALUES (?, ?, ?)");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, owner_id);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, blob_id);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+        return DB_ERROR;
+    }
+
+    if (db_ref_blob(blob_id, 1, &unused, freed_fast, freed_strong, freed_size) != DB_OK)
+        return DB_ERROR;
+    if (old_id != 0)
+        return db_ref_blob(old_id, -1, freed, freed_fast, freed_strong, freed_size);
+    return DB_OK;
+}
+
+int db_find_file(int owner_id, const char *name, unsigned char strong[HASH_STRONG_SIZE], uint64_t *size)
+{
+    sqlite3_stmt *stmt = db_prepare("SELECT b.strong, b.size FROM files f JOIN blobs b ON b.blob_id = f.blob_id "
+                                    "WHERE f.owner_id = ? AND f.name = ?");
+    if (stmt == NULL)
+        return DB_ERROR;
+    sqlite3_bind_int(stmt, 1, owner_id);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+
+    int rc = sqlite3_step(stmt), ret = DB_NOT_FOUND;
+    if (rc == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == HASH_STRONG_SIZE)
+    {
+        memcpy(strong, sqlite3_column_blob(stmt, 0), HASH_STRONG_SIZE);
+        *size = (uint64_t)sqlite3_column_int64(stmt, 1);
+        ret = DB_OK;
+    }
+    else if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        ret = DB_ERROR;
+    sqlite3_finalize(stmt);
+    return ret;
+}
@@ -0,0 +1,214 @@
+#ifndef CHAT_DB_H
+#define CHAT_DB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+#define CHAT_DB "./database/chat.db"
+
+/* Return codes */
+#define DB_OK 0
+#define DB_ERROR -1
+#define DB_NOT_FOUND -2
+#define DB_CONFLICT -3
+#define DB_BAD_PASSWORD -4
+
+/**
+ * Each thread uses its own SQLite connection, opened on first use
+ * All functions are blocking
+ */
+
+/**
+ * Create an account
+ * Returns: DB_OK (*user_id set), DB_CONFLICT if the username exists, DB_ERROR
+ */
+int db_register(const char *username, const char *password, int *user_id);
+
+/**
+ * Check credentials
+ * Returns: DB_OK (*user_id set), DB_NOT_FOUND, DB_BAD_PASSWORD, DB_ERROR
+ */
+int db_login(const char *username, const char *password, int *user_id);
+
+/**
+ * Look up a user's name by id
+ * Returns: DB_OK, DB_NOT_FOUND, DB_ERROR
+ */
+int db_get_username(int user_id, char *username, size_t size);
+
+/**
+ * Store a direct message; is_offline marks it as not yet delivered
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_store_message(int sender_id, int receiver_id, const char *content, size_t len, int is_offline);
+
+/**
+ * Callback for each undelivered message, oldest first
+ * Returns: 0 to continue, non-zero to stop before this message
+ */
+typedef int (*db_message_cb)(void *arg, int sender_id, const char *sender_name,
+                             const char *content, long long timestamp);
+
+/**
+ * Report and then mark delivered the offline messages for a user, up to the
+ * one the callback stopped at
+ * Only messages whose content and sender name take max_len bytes at most are
+ * reported; db_next_offline_stream() hands out the longer ones
+ * Returns: number of messages reported, DB_ERROR
+ */
+int db_take_offline_messages(int user_id, size_t max_len, db_message_cb cb, void *arg);
+
+/**
+ * Direct messages sent in chunks
+ * The message row is hidden (is_offline 2) while its chunks are stored, one
+ * row each, so no step ever needs more than one chunk in memory
+ */
+
+/**
+ * Start a message; *timestamp receives its time
+ * Returns: DB_OK (*message_id set), DB_ERROR
+ */
+int db_begin_message_stream(int sender_id, int receiver_id, long long *message_id, long long *timestamp);
+
+/**
+ * Store chunk seq (0, 1, ...) of a message
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_store_message_chunk(long long message_id, unsigned seq, const char *data, size_t len);
+
+/**
+ * Make a complete message visible, as delivered or, with is_offline, waiting
+ * to be fetched
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_end_message_stream(long long message_id, int is_offline);
+
+/**
+ * Delete an unfinished message and its chunks
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_drop_message_stream(long long message_id);
+
+struct db_stream
+{
+    long long message_id;
+    int sender_id;
+    char sender_name[64];
+    long long timestamp;
+    unsigned n_chunks;
+};
+
+/**
+ * Find the oldest chunked message waiting for a user, or message whose
+ * content and sender name take more than max_len bytes (as one chunk)
+ * (db_take_offline_messages() leaves these out)
+ * Returns: DB_OK (*stream set), DB_NOT_FOUND, DB_ERROR
+ */
+int db_next_offline_stream(int user_id, size_t max_len, struct db_stream *stream);
+
+/**
+ * Read up to size bytes of chunk seq from offset
+ * Returns: DB_OK (*len bytes read, *chunk_len set to the chunk's size),
+ * DB_NOT_FOUND, DB_ERROR
+ */
+int db_read_message_chunk(long long message_id, unsigned seq, size_t offset, char *buf, size_t size,
+                          size_t *len, size_t *chunk_len);
+
+/**
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_mark_delivered(long long message_id);
+
+/**
+ * Create a group with the creator as its admin
+ * Returns: DB_OK (*group_id set), DB_ERROR
+ */
+int db_create_group(const char *name, int creator_id, int *group_id);
+
+/**
+ * Look up a group's name by id
+ * Returns: DB_OK, DB_NOT_FOUND, DB_ERROR
+ */
+int db_get_group(int group_id, char *name, size_t size);
+
+/**
+ * Check membership
+ * Returns: DB_OK (*is_admin set), DB_NOT_FOUND if not a member, DB_ERROR
+ */
+int db_get_group_role(int group_id, int user_id, int *is_admin);
+
+/**
+ * Returns: DB_OK, DB_CONFLICT if already a member, DB_ERROR
+ */
+int db_add_group_member(int group_id, int user_id);
+
+/**
+ * Returns: DB_OK, DB_NOT_FOUND if not a member, DB_ERROR
+ */
+int db_remove_group_member(int group_id, int user_id);
+
+/**
+ * Callback for each member of a group
+ * Returns: 0 to continue, non-zero to stop
+ */
+typedef int (*db_member_cb)(void *arg, int user_id);
+
+/**
+ * Report the members of a group
+ * Returns: number of members reported, DB_ERROR
+ */
+int db_get_group_members(int group_id, db_member_cb cb, void *arg);
+
+/**
+ * Store a group message once as the group's history (no receiver), and as
+ * offline for each of the given receivers
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_store_group_message(int sender_id, int group_id, const int *receivers, size_t n,
+                           const char *content, size_t len);
+
+/**
+ * Stored files are content-addressed: one blob row per distinct content,
+ * counting the names (owner, name) that refer to it. Changing the counts and
+ * the objects on disk together takes a write transaction around the calls:
+ * db_begin() waits for the other writers, so two uploads of the same content
+ * cannot both store it. After an error, db_rollback()
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_begin(void);
+int db_commit(void);
+void db_rollback(void);
+
+/**
+ * Find stored content, looked up by the fast hash and told apart by the strong one
+ * owner_id: only content one of owner_id's files already refers to, 0 = any
+ * Returns: DB_OK (*blob_id set), DB_NOT_FOUND, DB_ERROR
+ */
+int db_find_blob(int owner_id, uint64_t fast, const unsigned char strong[HASH_STRONG_SIZE], uint64_t size,
+                 long long *blob_id);
+
+/**
+ * Record newly stored content, referred to by no name yet
+ * Returns: DB_OK (*blob_id set), DB_ERROR
+ */
+int db_add_blob(uint64_t fast, const unsigned char strong[HASH_STRONG_SIZE], uint64_t size, long long *blob_id);
+
+/**
+ * Point owner's file name at a blob, in place of what it named before
+ * The content it no longer names loses a reference; when that was its last,
+ * the blob is deleted and *freed set, with its hashes and size in the freed_
+ * arguments, so the caller removes the object once that is committed
+ * Returns: DB_OK, DB_ERROR
+ */
+int db_link_file(int owner_id, const char *name, long long blob_id, int *freed, uint64_t *freed_fast,
+                 unsigned char freed_strong[HASH_STRONG_SIZE], uint64_t *freed_size);
+
+/**
+ * Look up the content a file name refers to
+ * Returns: DB_OK (strong and *size set), DB_NOT_FOUND, DB_ERROR
+ */
+int db_find_file(int owner_id, const char *name, unsigned char strong[HASH_STRONG_SIZE], uint64_t *size);
+
+#endif // CHAT_DB_H
@@ -0,0 +1,130 @@
+#include "compress.h"
+#include <stdlib.h>
+#include <zlib.h>
+
+/* What each sync flush ends with; left off the wire and fed back on inflate */
+static const unsigned char sync_tail[4] = {0x00, 0x00, 0xff, 0xff};
+
+struct frame_deflater
+{
+    z_stream zs;
+    int fresh; /* Nothing sent on this stream yet */
+};
+
+struct frame_inflater
+{
+    z_stream zs;
+};
+
+struct frame_deflater *deflater_new(void)
+{
+    struct frame_deflater *d = calloc(1, sizeof(*d));
+    if (d == NULL)
+        return NULL;
+    /* Negative window bits: raw deflate, no zlib header or checksum per stream */
+    if (deflateInit2(&d->zs, COMPRESS_LEVEL, Z_DEFLATED, -COMPRESS_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(d);
+        return NULL;
+    }
+    d->fresh = 1;
+    return d;
+}
+
+void deflater_free(struct frame_deflater *d)
+{
+    if (d == NULL)
+        return;
+    deflateEnd(&d->zs);
+    free(d);
+}
+
+size_t deflater_frame(struct frame_deflater *d, uint16_t type, const struct iovec *iov, int iovcnt, size_t len,
+                      char *out, size_t cap)
+{
+    z_stream *zs = &d->zs;
+    int rc = Z_OK;
+
+    /* Output up to the frame's own size is enough, plus the tail so a full
+     * buffer always means it did not fit */
+    size_t limit = cap < len + sizeof(sync_tail) ? cap : len + sizeof(sync_tail);
+    if (limit <= COMPRESS_HEADER_SIZE + sizeof(sync_tail))
+        return 0;
+    out[0] = (char)(type >> 8);
+    out[1] = (char)type;
+    out[2] = d->fresh ? COMPRESS_RESET : 0;
+
+    zs->next_out = (Bytef *)out + COMPRESS_HEADER_SIZE;
+    zs->avail_out = limit - COMPRESS_HEADER_SIZE;
+    for (int i = 0; i < iovcnt && rc == Z_OK && zs->avail_out > 0; i++)
+    {
+        zs->next_in = iov[i].iov_base;
+        zs->avail_in = iov[i].iov_len;
+        while (rc == Z_OK && zs->avail_in > 0 && zs->avail_out > 0)
+            rc = deflate(zs, Z_NO_FLUSH);
+    }
+    if (rc == Z_OK && zs->avail_out > 0)
+        rc = deflate(zs, Z_SYNC_FLUSH);
+
+    size_t n = (char *)zs->next_out - out;
+    if (rc != Z_OK || zs->avail_in > 0 || zs->avail_out == 0 || n < COMPRESS_HEADER_SIZE + sizeof(sync_tail) ||
+        n - sizeof(sync_tail) >= len)
+    {
+        /* The stream holds data the peer will never see: start over */
+        deflateReset(zs);
+        d->fresh = 1;
+        return 0;
+    }
+    d->fresh = 0;
+    return n - sizeof(sync_tail);
+}
+
+struct frame_inflater *inflater_new(void)
+{
+    struct frame_inflater *inf = calloc(1, sizeof(*inf));
+    if (inf == NULL)
+        return NULL;
+    if (inflateInit2(&inf->zs, -COMPRESS_WINDOW_BITS) != Z_OK)
+    {
+        free(inf);
+        return NULL;
+    }
+    return inf;
+}
+
+void inflater_free(struct frame_inflater *inf)
+{
+    if (inf == NULL)
+        return;
+    inflateEnd(&inf->zs);
+    free(inf);
+}
+
+int inflater_frame(struct frame_inflater *inf, const char *payload, size_t len, uint16_t *type, char *out,
+                   size_t cap)
+{
+    z_stream *zs = &inf->zs;
+    const unsigned char *p = (const unsigned char *)payload;
+
+    if (len < COMPRESS_HEADER_SIZE)
+        return -1;
+    *type = (uint16_t)(p[0] << 8 | p[1]);
+    if ((p[2] & COMPRESS_RESET) && inflateReset(zs) != Z_OK)
+        return -1;
+
+    zs->next_out = (Bytef *)out;
+    zs->avail_out = cap;
+    zs->next_in = (Bytef *)p + COMPRESS_HEADER_SIZE;
+    zs->avail_in = len - COMPRESS_HEADER_SIZE;
+    int rc = inflate(zs, Z_SYNC_FLUSH);
+    if (rc == Z_OK || rc == Z_BUF_ERROR)
+    {
+        zs->next_in = (Bytef *)sync_tail;
+        zs->avail_in = sizeof(sync_tail);
+        rc = inflate(zs, Z_SYNC_FLUSH);
+    }
+    /* A full buffer may hide more output */
+    if ((rc != Z_OK && rc != Z_BUF_ERROR) || zs->avail_in > 0 || zs->avail_out == 0)
+        return -1;
+    return (int)(cap - zs->avail_out);
+}
@@ -0,0 +1,61 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Deflate compression of large frames, on connections that chose
+ * COMPRESS_DEFLATE with HELLO
+ * A compressed frame goes as COMPRESSED, whose payload is
+ *     [TYPE:2][FLAGS:1][raw deflate data]
+ * TYPE being the type of the frame it stands for. One deflate stream runs
+ * per reply, server to client, each frame ending on a sync flush whose
+ * trailing 00 00 ff ff is left out, so a frame is compressed against the
+ * ones before it in the reply: a backlog of similar messages shrinks far
+ * more than each frame would alone. The stream is freed with the reply's
+ * last frame, so an idle session holds none of its state. COMPRESS_RESET in
+ * FLAGS starts a new stream (the first frame of a reply, and after a frame
+ * was sent uncompressed); the receiver resets its inflater before that frame.
+ */
+
+#define COMPRESS_HEADER_SIZE 3
+#define COMPRESS_RESET 0x01
+#define COMPRESS_MIN_SIZE 512 /* Smaller frames are not worth it, they go as they are */
+#define COMPRESS_LEVEL 6
+#define COMPRESS_WINDOW_BITS 15 /* 32 KiB of history: about 256 KiB of deflate state */
+
+struct frame_deflater;
+struct frame_inflater;
+
+/**
+ * Returns: a new stream, NULL if memory is short
+ */
+struct frame_deflater *deflater_new(void);
+void deflater_free(struct frame_deflater *d);
+
+/**
+ * Compress a frame's payload, gathered from iov, into out as the payload of
+ * a COMPRESSED frame
+ * Returns: its size, 0 if it would not be smaller than len (send the frame
+ * as it is; the stream starts again with the next one)
+ */
+size_t deflater_frame(struct frame_deflater *d, uint16_t type, const struct iovec *iov, int iovcnt, size_t len,
+                      char *out, size_t cap);
+
+/**
+ * Returns: a new stream, NULL if memory is short
+ */
+struct frame_inflater *inflater_new(void);
+void inflater_free(struct frame_inflater *inf);
+
+/**
+ * Restore the frame a COMPRESSED payload stands for
+ * Returns: its payload length, with *type set and the payload in out; -1 if
+ * the data is corrupt or would not fit in cap
+ */
+int inflater_frame(struct frame_inflater *inf, const char *payload, size_t len, uint16_t *type, char *out,
+                   size_t cap);
+
+#endif // COMPRESS_H
@@ -0,0 +1,151 @@
+#include "db_async.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER; /* A job was queued */
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;  /* The last job finished */
+static struct db_job *queue_head = NULL;
+static struct db_job **queue_tail = &queue_head;
+static int n_running = 0;
+
+/* Free slots, [0] small and [1] large; slots are taken and returned on the
+ * reactor thread that owns the connection */
+static __thread struct db_job *pool[2];
+static __thread unsigned pooled[2];
+
+void *db_job_alloc(size_t size)
+{
+    if (size > DB_JOB_LARGE)
+        return NULL;
+
+    int cls = size > DB_JOB_SMALL;
+    struct db_job *job = pool[cls];
+    if (job != NULL)
+    {
+        pool[cls] = job->next;
+        pooled[cls]--;
+        return job;
+    }
+
+    job = malloc(cls ? DB_JOB_LARGE : DB_JOB_SMALL);
+    if (job != NULL)
+        job->size = cls ? DB_JOB_LARGE : DB_JOB_SMALL;
+    return job;
+}
+
+static void db_job_free(struct db_job *job)
+{
+    int cls = job->size > DB_JOB_SMALL;
+    if (pooled[cls] >= DB_JOB_POOL_MAX)
+    {
+        free(job);
+        return;
+    }
+    job->next = pool[cls];
+    pool[cls] = job;
+    pooled[cls]++;
+}
+
+/**
+ * Back on the reactor: reply, then let the connection's next request in
+ */
+static void db_job_complete(struct reactor_call *call)
+{
+    struct db_job *job = (struct db_job *)call;
+    struct connection *conn = job->conn;
+
+    job->pending = 0;
+    if (!conn->is_dead)
+        job->done(job, conn);
+    conn_release(conn);
+    if (job->pending)
+        return;
+    if (job->release != NULL)
+        job->release(job);
+    db_job_free(job);
+}
+
+void db_submit(struct connection *conn, struct db_job *job, void (*run)(struct db_job *job),
+               void (*done)(struct db_job *job, struct connection *conn))
+{
+    job->call.fn = db_job_complete;
+    job->conn = conn;
+    job->run = run;
+    job->done = done;
+    job->pending = 1;
+    job->next = NULL;
+    conn_hold(conn);
+
+    pthread_mutex_lock(&queue_lock);
+    *queue_tail = job;
+    queue_tail = &job->next;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void db_job_suspend(struct db_job *job, void (*next)(struct db_job *job, struct connection *conn))
+{
+    job->done = next;
+    job->pending = 1;
+    conn_hold(job->conn);
+}
+
+void db_job_resume(struct db_job *job)
+{
+    db_job_complete(&job->call);
+}
+
+void db_job_wait_drain(struct db_job *job, void (*next)(struct db_job *job, struct connection *conn))
+{
+    db_job_suspend(job, next);
+    job->call.fn = db_job_complete;
+    conn_wait_drain(job->conn, &job->call);
+}
+
+static void *db_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&queue_lock);
+    while (1)
+    {
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        struct db_job *job = queue_head;
+        if ((queue_head = job->next) == NULL)
+            queue_tail = &queue_head;
+        n_running++;
+        pthread_mutex_unlock(&queue_lock);
+
+        job->run(job);
+        /* The connection is held, so its owner is still there to read */
+        reactor_post(job->conn->owner, &job->call);
+
+        pthread_mutex_lock(&queue_lock);
+        if (--n_running == 0 && queue_head == NULL)
+            pthread_cond_broadcast(&idle_cond);
+    }
+    return NULL;
+}
+
+int db_async_start(int n_workers)
+{
+    pthread_t tid;
+
+    for (int i = 0; i < n_workers; i++)
+    {
+        if (pthread_create(&tid, NULL, db_worker, NULL) != 0)
+            return -1;
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+void db_async_wait_idle(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (n_running > 0 || queue_head != NULL)
+        pthread_cond_wait(&idle_cond, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,81 @@
+#ifndef DB_ASYNC_H
+#define DB_ASYNC_H
+
+#include <stddef.h>
+
+#include "reactor.h"
+
+/**
+ * Storage requests off the reactor threads
+ * A handler that needs the database fills a job and submits it: run() executes
+ * on a storage worker thread, where the blocking chat_db calls are fine, then
+ * done() runs back on the reactor owning the connection to send the reply.
+ * The connection is held in between (conn_hold()), so its next requests wait
+ * and a handler split into run/done still sees them in order. done() is
+ * skipped if the client went away, and may submit the same job again for
+ * flows with several storage steps.
+ *
+ * Jobs are fixed-size slots recycled through per-thread pools, so a request
+ * costs no malloc() once the pools are warm.
+ */
+
+#define DB_JOB_SMALL 1024                /* Slot size for jobs carrying a few fields */
+#define DB_JOB_LARGE (BUFF_SIZE + 1024)  /* Slot size for jobs carrying a whole payload */
+#define DB_JOB_POOL_MAX 64               /* Free slots kept per size per thread */
+#define DEFAULT_DB_WORKERS 2
+
+struct db_job
+{
+    struct reactor_call call; /* Completion, posted to the connection's reactor */
+    struct db_job *next;      /* Worker queue */
+    struct connection *conn;
+    void (*run)(struct db_job *job);
+    void (*done)(struct db_job *job, struct connection *conn);
+    void (*release)(struct db_job *job); /* Frees what the job owns, or NULL */
+    size_t size; /* Slot size */
+    int pending; /* Submitted and not completed yet */
+};
+
+/**
+ * Start the storage worker threads
+ * Returns: 0 on success, -1 on error
+ */
+int db_async_start(int n_workers);
+
+/**
+ * Take a slot for a job type that embeds struct db_job as its first member
+ * The contents are uninitialised; set release
+ * Returns: the slot, NULL if size is over DB_JOB_LARGE or memory is short
+ */
+void *db_job_alloc(size_t size);
+
+/**
+ * Run job->run on a worker, then job->done on conn's reactor; the job is
+ * released and freed after done() unless it was submitted again from it
+ */
+void db_submit(struct connection *conn, struct db_job *job, void (*run)(struct db_job *job),
+               void (*done)(struct db_job *job, struct connection *conn));
+
+/**
+ * From done(): keep the job, and its connection held, past done() while it
+ * continues on other reactors; db_job_resume() then runs next on the
+ * connection's reactor, as a storage step completing would
+ */
+void db_job_suspend(struct db_job *job, void (*next)(struct db_job *job, struct connection *conn));
+
+/* End a suspension, on the connection's reactor thread */
+void db_job_resume(struct db_job *job);
+
+/**
+ * From done(): suspend the job until the connection's queued output drains
+ * (conn_wait_drain()), then run next; next is skipped if the client went away
+ */
+void db_job_wait_drain(struct db_job *job, void (*next)(struct db_job *job, struct connection *conn));
+
+/**
+ * Wait until no job is queued or running (completions may still sit in the
+ * reactors' mailboxes)
+ */
+void db_async_wait_idle(void);
+
+#endif // DB_ASYNC_H
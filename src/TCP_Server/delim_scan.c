@@ -0,0 +1,171 @@
+#include "delim_scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef size_t (*scan_fn)(const char *buf, size_t len, size_t *out, size_t max, size_t *scanned);
+
+/**
+ * Portable version: one memchr() per newline
+ */
+static size_t scan_memchr(const char *buf, size_t len, size_t *out, size_t max, size_t *scanned)
+{
+    size_t n = 0;
+    size_t pos = 0;
+
+    while (pos < len && n < max)
+    {
+        const char *nl = memchr(buf + pos, '\n', len - pos);
+        if (nl == NULL)
+        {
+            pos = len;
+            break;
+        }
+        out[n++] = nl - buf;
+        pos = nl - buf + 1;
+    }
+    *scanned = pos;
+    return n;
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * Append the positions of the set bits of a block's match mask
+ * @return: 0 when all were stored, otherwise the offset just past the last
+ * stored position (out is full and scanning must stop there)
+ */
+static inline size_t emit_mask(unsigned mask, size_t base, size_t *out, size_t *n, size_t max)
+{
+    while (mask != 0)
+    {
+        if (*n == max)
+            return out[*n - 1] + 1;
+        out[(*n)++] = base + (size_t)__builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return 0;
+}
+
+/**
+ * Finish the last partial block with memchr() and rebase its positions
+ */
+static size_t scan_tail(const char *buf, size_t pos, size_t len, size_t *out, size_t n,
+                        size_t max, size_t *scanned)
+{
+    size_t tail_scanned;
+    size_t found = scan_memchr(buf + pos, len - pos, out + n, max - n, &tail_scanned);
+
+    for (size_t i = n; i < n + found; i++)
+        out[i] += pos;
+    *scanned = pos + tail_scanned;
+    return n + found;
+}
+
+__attribute__((target("sse2"))) static size_t scan_sse2(const char *buf, size_t len, size_t *out,
+                                                        size_t max, size_t *scanned)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0;
+    size_t pos;
+
+    for (pos = 0; pos + 16 <= len; pos += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + pos));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        size_t stop = emit_mask(mask, pos, out, &n, max);
+        if (stop != 0)
+        {
+            *scanned = stop;
+            return n;
+        }
+    }
+    return scan_tail(buf, pos, len, out, n, max, scanned);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *buf, size_t len, size_t *out,
+                                                        size_t max, size_t *scanned)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    size_t pos;
+
+    for (pos = 0; pos + 32 <= len; pos += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+        size_t stop = emit_mask(mask, pos, out, &n, max);
+        if (stop != 0)
+        {
+            *scanned = stop;
+            return n;
+        }
+    }
+    return scan_tail(buf, pos, len, out, n, max, scanned);
+}
+#endif
+
+static scan_fn scan_impl = scan_memchr;
+static const char *scan_name = "memchr";
+
+/**
+ * Pick the widest implementation the CPU supports, before any thread starts
+ */
+__attribute__((constructor)) static void scan_select(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan_impl = scan_avx2;
+        scan_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scan_impl = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+}
+
+size_t scan_newlines(const char *buf, size_t len, size_t *out, size_t max, size_t *scanned)
+{
+    if (max == 0)
+    {
+        *scanned = 0;
+        return 0;
+    }
+    return scan_impl(buf, len, out, max, scanned);
+}
+
+const char *scan_newlines_impl(void)
+{
+    return scan_name;
+}
+
+int scan_newlines_use(const char *name)
+{
+    if (strcmp(name, "memchr") == 0)
+    {
+        scan_impl = scan_memchr;
+        scan_name = "memchr";
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+    {
+        scan_impl = scan_sse2;
+        scan_name = "sse2";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        scan_impl = scan_avx2;
+        scan_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
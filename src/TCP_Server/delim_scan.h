@@ -0,0 +1,33 @@
+#ifndef DELIM_SCAN_H
+#define DELIM_SCAN_H
+
+#include <stddef.h>
+
+/**
+ * Vectorised search for the '\n' of the text protocol's \r\n delimiter
+ * Uses AVX2 when the CPU has it, SSE2 on other x86-64, memchr() elsewhere;
+ * the implementation is picked once on first use
+ */
+
+/**
+ * Find every '\n' in buf[0, len)
+ * Positions are written to out in increasing order; scanning stops early once
+ * max positions have been found
+ * Returns: number of positions found, *scanned receives how many bytes were
+ * examined (len unless out filled up)
+ */
+size_t scan_newlines(const char *buf, size_t len, size_t *out, size_t max, size_t *scanned);
+
+/**
+ * Name of the implementation in use ("avx2", "sse2" or "memchr")
+ */
+const char *scan_newlines_impl(void);
+
+/**
+ * Switch to the implementation called name, so tests can hold each one to
+ * the others; not for use once threads are running
+ * Returns: 0 on success, -1 if it is unknown or the CPU lacks it
+ */
+int scan_newlines_use(const char *name);
+
+#endif // DELIM_SCAN_H
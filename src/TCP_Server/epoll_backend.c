@@ -0,0 +1,302 @@
+#define _GNU_SOURCE /* accept4(), splice() */
+#include "reactor.h"
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ACCEPT_BATCH 64 /* Connections accepted per listener event */
+
+/**
+ * Edge-triggered epoll transport
+ * Sockets are registered once for EPOLLIN | EPOLLOUT; output queued while
+ * handling a batch of events is written once at the end of the batch and the
+ * remainder is retried on EPOLLOUT. epoll_wait() sleeps until the next timer
+ * tick at most. File bytes never enter user space: downloads are sent with
+ * sendfile() and uploads spliced from the socket into the file.
+ */
+
+/* Registration tags of the AF_UNIX listener and the mailbox eventfd; the TCP
+ * listener is tagged NULL */
+static char unix_listener;
+static char mailbox;
+
+static int epoll_init(struct reactor *r)
+{
+    if ((r->epfd = epoll_create1(0)) == -1)
+        return -1;
+
+    /* The listeners are the only registrations without a connection pointer */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen_fd, &ev) == -1)
+    {
+        close(r->epfd);
+        return -1;
+    }
+
+    /* Every reactor watches the one local listener; only one is woken per client */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &unix_listener;
+    if (r->unix_fd != -1 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->unix_fd, &ev) == -1)
+    {
+        close(r->epfd);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &mailbox;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake_fd, &ev) == -1 ||
+        pipe2(r->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        close(r->epfd);
+        return -1;
+    }
+    return 0;
+}
+
+static int epoll_watch(struct reactor *r, struct connection *c)
+{
+    if (set_nonblocking(c->fd) == -1)
+        return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/**
+ * Whatever arrived is reported again when the new reactor registers the socket
+ */
+static int epoll_detach(struct reactor *r, struct connection *c)
+{
+    if (epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL) == -1)
+    {
+        perror("epoll_ctl() error");
+        c->is_dead = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Move upload body bytes from the socket into the sink file through the
+ * reactor's pipe; the pipe is empty again on return whatever happens, and a
+ * file that cannot take them leaves the rest of the body to be discarded
+ * @return: bytes taken from the socket, 0 at end of stream, -1 with errno set
+ */
+static ssize_t epoll_splice(struct reactor *r, struct connection *c)
+{
+    struct conn_xfer *x = &c->xfer;
+    size_t want = x->sink_left < XFER_PIPE_SIZE ? x->sink_left : XFER_PIPE_SIZE;
+
+    ssize_t n = splice(c->fd, NULL, r->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0)
+        return n;
+
+    for (ssize_t moved = 0; moved < n;)
+    {
+        ssize_t m = splice(r->pipe_fds[0], NULL, x->sink_fd, NULL, n - moved, SPLICE_F_MOVE);
+        if (m > 0)
+        {
+            moved += m;
+            continue;
+        }
+        if (m == -1 && errno == EINTR)
+            continue;
+
+        x->sink_error = m == 0 ? EIO : errno;
+        char scrap[4096];
+        while (moved < n && (m = read(r->pipe_fds[0], scrap, sizeof(scrap))) > 0)
+            moved += m;
+        break;
+    }
+    return n;
+}
+
+/**
+ * Drain the socket until it would block (required by edge-triggered mode)
+ * A congested connection is left unread until its output drains, one out of
+ * budget until its turn comes round again on the ready list, and a held one
+ * until it is released
+ */
+static void epoll_on_readable(struct reactor *r, struct connection *c)
+{
+    while (!c->is_dead && !c->congested && !c->is_ready && c->holds == 0)
+    {
+        /* An upload body the ring holds none of goes straight to its file */
+        int splicing = c->xfer.sink_left > 0 && c->xfer.sink_fd != -1 && c->xfer.sink_error == 0 &&
+                       rb_used(&c->in) == 0;
+        size_t space;
+        char *buf = NULL;
+        if (!splicing && (buf = conn_recv_space(c, &space)) == NULL)
+            return;
+
+        ssize_t n = splicing ? epoll_splice(r, c) : recv(c->fd, buf, space, 0);
+        if (n > 0 && splicing)
+        {
+            conn_sunk(r, c, n);
+        }
+        else if (n > 0)
+        {
+            conn_received(r, c, n);
+        }
+        else if (n == 0)
+        {
+            printf("Client %s disconnected\n", c->addr);
+            c->is_dead = 1;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            /* Idle until the next edge: no buffer held meanwhile */
+            conn_trim(c);
+            return;
+        }
+        else if (errno != EINTR)
+        {
+            perror(splicing ? "splice() error" : "recv() error");
+            c->is_dead = 1;
+        }
+    }
+}
+
+/**
+ * Write queued output until the kernel buffer is full, several segments per
+ * sendmsg() and file segments with sendfile(); a connection that drains below
+ * the low watermark resumes reading
+ */
+static void epoll_flush(struct reactor *r, struct connection *c)
+{
+    int resumed = 0;
+
+    while (c->out.bytes > 0)
+    {
+        const struct out_segment *head = c->out.head;
+        ssize_t n;
+
+        if (head->file_fd != -1)
+        {
+            off_t off = head->file_off + head->off;
+            n = sendfile(c->fd, head->file_fd, &off, head->len - head->off);
+            if (n == 0)
+            {
+                fprintf(stderr, "Download to %s: file shrank\n", c->addr);
+                c->is_dead = 1;
+                break;
+            }
+        }
+        else
+        {
+            struct iovec iov[WQ_IOV_MAX];
+            size_t segments;
+            struct msghdr msg = {0};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = wq_fill_iov(&c->out, iov, WQ_IOV_MAX, &segments);
+            n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror(head->file_fd != -1 ? "sendfile() error" : "sendmsg() error");
+                c->is_dead = 1;
+            }
+            break;
+        }
+        resumed |= conn_sent(c, n);
+    }
+
+    /* Reading stopped while congested and edge-triggered mode will not report
+     * the requests that arrived meanwhile again */
+    if (resumed)
+        epoll_on_readable(r, c);
+}
+
+/**
+ * Accept up to ACCEPT_BATCH pending connections
+ * The listener is level-triggered, so a longer queue is reported again after
+ * the clients already connected have been served
+ */
+static void epoll_accept(struct reactor *r, int listen_fd)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t sin_size = sizeof(client_addr);
+        int conn_sock = accept4(listen_fd, (struct sockaddr *)&client_addr, &sin_size,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_sock == -1)
+        {
+            if (!reactor_accept_failed(r, listen_fd, errno))
+                return;
+            continue;
+        }
+
+        reactor_admit(r, conn_sock, (struct sockaddr *)&client_addr);
+    }
+}
+
+static void epoll_run(struct reactor *r)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1)
+    {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, reactor_timeout(r));
+        if (n == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("epoll_wait() error");
+                return;
+            }
+            /* Woken up by reactor_pause(): finish the iteration so it can park */
+            n = 0;
+        }
+        reactor_tick(r);
+
+        for (int i = 0; i < n; i++)
+        {
+            struct connection *c = events[i].data.ptr;
+            if (events[i].data.ptr == &mailbox)
+            {
+                reactor_wake(r);
+                continue;
+            }
+            if (c == NULL || events[i].data.ptr == &unix_listener)
+            {
+                epoll_accept(r, c == NULL ? r->listen_fd : r->unix_fd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                epoll_on_readable(r, c);
+            if (!c->is_dead && (events[i].events & EPOLLOUT) && c->out.bytes > 0)
+                epoll_flush(r, c);
+            if (c->is_dead)
+                conn_destroy(r, c);
+        }
+
+        reactor_flush_pending(r);
+    }
+}
+
+const struct io_backend epoll_backend = {
+    .name = "epoll",
+    .zero_copy = 1,
+    .init = epoll_init,
+    .run = epoll_run,
+    .watch = epoll_watch,
+    .flush = epoll_flush,
+    .close = conn_destroy,
+    .resume = epoll_on_readable,
+    .detach = epoll_detach,
+};
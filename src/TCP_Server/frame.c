@@ -0,0 +1,195 @@
+#include "frame.h"
+#include <stdio.h>
+#include <string.h>
+
+const char *const codec_names[N_CODECS] = {"frame"};
+const char *const compress_names[N_COMPRESS] = {"none", "deflate"};
+
+void frame_decoder_init(struct frame_decoder *dec, uint32_t max_payload)
+{
+    dec->have_header = 0;
+    dec->type = 0;
+    dec->length = 0;
+    dec->max_payload = max_payload;
+}
+
+/**
+ * Resumable decode step
+ * State only moves forward: header (6 bytes) -> payload (length bytes) -> ready.
+ * A partial header or payload leaves the ring untouched and returns NEED_MORE;
+ * the next call resumes in the same state without looking at old bytes again
+ * @param dec: Decoder of this connection
+ * @param rb: Receive ring of this connection
+ * @param frame: Receives the frame on FRAME_READY
+ * @return: FRAME_READY, FRAME_NEED_MORE or FRAME_ERROR
+ */
+int frame_decode(struct frame_decoder *dec, struct ring_buffer *rb, struct frame *frame)
+{
+    if (!dec->have_header)
+    {
+        if (rb_used(rb) < FRAME_HEADER_SIZE)
+            return FRAME_NEED_MORE;
+
+        dec->type = ((uint16_t)(unsigned char)rb_at(rb, 0) << 8) |
+                    (uint16_t)(unsigned char)rb_at(rb, 1);
+        dec->length = ((uint32_t)(unsigned char)rb_at(rb, 2) << 24) |
+                      ((uint32_t)(unsigned char)rb_at(rb, 3) << 16) |
+                      ((uint32_t)(unsigned char)rb_at(rb, 4) << 8) |
+                      (uint32_t)(unsigned char)rb_at(rb, 5);
+        if (dec->length > dec->max_payload)
+            return FRAME_ERROR;
+
+        rb_consume(rb, FRAME_HEADER_SIZE);
+        dec->have_header = 1;
+    }
+
+    if (rb_used(rb) < dec->length)
+        return FRAME_NEED_MORE;
+
+    frame->type = dec->type;
+    frame->length = dec->length;
+    frame->payload = rb_peek(rb, dec->length);
+    dec->have_header = 0;
+    return FRAME_READY;
+}
+
+void frame_encode_header(unsigned char *header, uint16_t type, uint32_t length)
+{
+    header[0] = type >> 8;
+    header[1] = type & 0xFF;
+    header[2] = length >> 24;
+    header[3] = (length >> 16) & 0xFF;
+    header[4] = (length >> 8) & 0xFF;
+    header[5] = length & 0xFF;
+}
+
+int frame_encode(char *buf, size_t cap, uint16_t type, const void *payload, uint32_t length)
+{
+    if (cap < FRAME_HEADER_SIZE || cap - FRAME_HEADER_SIZE < length)
+        return -1;
+
+    frame_encode_header((unsigned char *)buf, type, length);
+    if (length > 0)
+        memcpy(buf + FRAME_HEADER_SIZE, payload, length);
+    return FRAME_HEADER_SIZE + length;
+}
+
+struct field field_next(const char **payload, uint32_t *len)
+{
+    struct field f = {*payload, *len};
+    const char *sep = memchr(*payload, '|', *len);
+
+    if (sep != NULL)
+    {
+        f.len = sep - *payload;
+        *payload = sep + 1;
+        *len -= f.len + 1;
+    }
+    else
+    {
+        *payload += *len;
+        *len = 0;
+    }
+    return f;
+}
+
+int field_id(struct field f)
+{
+    uint64_t id = 0;
+
+    /* At most 10 digits, so id cannot overflow before the range check */
+    if (f.len == 0 || f.len > 10)
+        return -1;
+    for (size_t i = 0; i < f.len; i++)
+    {
+        unsigned digit = (unsigned char)f.data[i] - '0';
+        if (digit > 9)
+            return -1;
+        id = id * 10 + digit;
+    }
+    return id > 0 && id <= INT32_MAX ? (int)id : -1;
+}
+
+int field_size(struct field f, uint64_t *size)
+{
+    uint64_t n = 0;
+
+    /* At most 18 digits: below 2^63, so it fits an off_t too */
+    if (f.len == 0 || f.len > 18)
+        return -1;
+    for (size_t i = 0; i < f.len; i++)
+    {
+        unsigned digit = (unsigned char)f.data[i] - '0';
+        if (digit > 9)
+            return -1;
+        n = n * 10 + digit;
+    }
+    *size = n;
+    return 0;
+}
+
+int field_copy(struct field f, char *out, size_t size)
+{
+    if (f.len >= size)
+        return -1;
+    memcpy(out, f.data, f.len);
+    out[f.len] = '\0';
+    return f.len;
+}
+
+void caps_init(struct proto_caps *caps)
+{
+    caps->version = PROTO_VERSION;
+    caps->codec = CODEC_FRAME;
+    caps->compress = COMPRESS_NONE;
+    caps->max_frame = FRAME_MAX_PAYLOAD;
+    caps->heartbeat_ms = 0;
+}
+
+/**
+ * Append names joined by ',' at buf + off
+ * @return: the new offset, size - 1 at most
+ */
+static size_t join_names(char *buf, size_t size, size_t off, const char *const *names, int n)
+{
+    for (int i = 0; i < n && off < size; i++)
+    {
+        int len = snprintf(buf + off, size - off, "%s%s", i ? "," : "", names[i]);
+        off = len < 0 || (size_t)len >= size - off ? size - 1 : off + len;
+    }
+    return off;
+}
+
+int caps_offer(char *buf, size_t size, unsigned heartbeat_s)
+{
+    size_t off = snprintf(buf, size, "version=%d max_frame=%d codecs=", PROTO_VERSION, FRAME_MAX_PAYLOAD);
+    if (off >= size)
+        return off;
+    off = join_names(buf, size, off, codec_names, N_CODECS);
+    off += snprintf(buf + off, size - off, " compress=");
+    if (off >= size)
+        return off;
+    off = join_names(buf, size, off, compress_names, N_COMPRESS);
+    return off + snprintf(buf + off, size - off, " heartbeat=%u", heartbeat_s);
+}
+
+int caps_pick(struct field list, const char *const *names, int n)
+{
+    uint32_t left = list.len;
+    const char *p = list.data;
+
+    while (left > 0)
+    {
+        const char *comma = memchr(p, ',', left);
+        size_t len = comma ? (size_t)(comma - p) : left;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (strlen(names[i]) == len && memcmp(names[i], p, len) == 0)
+                return i;
+        }
+        p += comma ? len + 1 : len;
+        left -= comma ? len + 1 : len;
+    }
+    return -1;
+}
@@ -0,0 +1,220 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcp_utils.h"
+#include "ring_buffer.h"
+
+/**
+ * Binary packet format from design.txt:
+ *     [TYPE:2bytes][LENGTH:4bytes][PAYLOAD:variable]
+ * Both header fields are in network byte order
+ */
+#define FRAME_HEADER_SIZE 6
+#define FRAME_MAX_PAYLOAD (BUFF_SIZE - FRAME_HEADER_SIZE)
+
+/* Field limits (including the terminating null) */
+#define USERNAME_SIZE 64
+#define PASSWORD_SIZE 64
+#define FILE_NAME_SIZE 128
+
+/* Command Types (Client -> Server) */
+#define CMD_REGISTER 1000
+#define CMD_LOGIN 1001
+#define CMD_LOGOUT 1002
+#define CMD_SEND_MESSAGE 1003
+#define CMD_SEND_GROUP_MESSAGE 1004
+#define CMD_SEND_FRIEND_REQUEST 1005
+#define CMD_ACCEPT_FRIEND_REQUEST 1006
+#define CMD_REJECT_FRIEND_REQUEST 1007
+#define CMD_UNFRIEND 1008
+#define CMD_GET_FRIEND_LIST 1009
+#define CMD_CREATE_GROUP 1010
+#define CMD_ADD_TO_GROUP 1011
+#define CMD_REMOVE_FROM_GROUP 1012
+#define CMD_LEAVE_GROUP 1013
+#define CMD_GET_OFFLINE_MESSAGES 1014
+#define CMD_PONG 1015
+#define CMD_HELLO 1016
+#define CMD_SEND_MESSAGE_CHUNK 1017
+#define CMD_UPLOAD_FILE 1018
+#define CMD_FILE_DATA 1019
+#define CMD_DOWNLOAD_FILE 1020
+#define CMD_FIRST CMD_REGISTER
+#define CMD_LAST CMD_DOWNLOAD_FILE
+#define N_COMMANDS (CMD_LAST - CMD_FIRST + 1)
+
+/* Command Types (Server -> Client) */
+#define MSG_RESPONSE 2000
+#define MSG_MESSAGE_RECEIVED 2001
+#define MSG_GROUP_MESSAGE_RECEIVED 2002
+#define MSG_FRIEND_REQUEST_RECEIVED 2003
+#define MSG_FRIEND_LIST_DATA 2004
+#define MSG_OFFLINE_MESSAGES_DATA 2005
+#define MSG_USER_STATUS_UPDATE 2006
+#define MSG_PING 2007
+#define MSG_MESSAGE_CHUNK_RECEIVED 2008
+#define MSG_FILE_DATA 2009
+#define MSG_COMPRESSED 2010 /* Another frame, deflated: see compress.h */
+
+/* Most message data in one SEND_MESSAGE_CHUNK, leaving room in the frame for
+ * the fields MESSAGE_CHUNK_RECEIVED puts in front of it */
+#define MESSAGE_CHUNK_MAX (FRAME_MAX_PAYLOAD - 256)
+
+/* Upload body bytes a client sends behind one FILE_DATA; its other requests
+ * wait until the piece is in, so they are best kept small */
+#define FILE_PIECE_SIZE (256 << 10)
+
+/* Status Codes (Server Response) */
+#define STATUS_SUCCESS 200
+#define STATUS_CREATED 201
+#define STATUS_BAD_REQUEST 400
+#define STATUS_UNAUTHORIZED 401
+#define STATUS_FORBIDDEN 403
+#define STATUS_NOT_FOUND 404
+#define STATUS_CONFLICT 409
+#define STATUS_SERVER_ERROR 500
+
+/**
+ * Capability exchange
+ * The greeting line offers, after its text,
+ *     version=V max_frame=N codecs=A,B compress=X,Y heartbeat=S
+ * A binary client that wants something other than the defaults sends HELLO
+ *     version|max_frame|codecs|compress|heartbeat
+ * (fields after version optional, lists in order of preference, heartbeat in
+ * seconds, 0 = server default) and the RESPONSE names the options in force:
+ *     200|version|max_frame|codec|compress|heartbeat
+ */
+#define PROTO_VERSION 1
+#define FRAME_MIN_PAYLOAD 1024 /* Smallest max_frame a client may ask for */
+#define HEARTBEAT_MIN 5        /* Shortest heartbeat a client may ask for, seconds */
+
+/* Payload encodings */
+#define CODEC_FRAME 0 /* '|'-separated text fields */
+#define N_CODECS 1
+
+/* Payload compression */
+#define COMPRESS_NONE 0
+#define COMPRESS_DEFLATE 1 /* Large frames deflated, see compress.h */
+#define N_COMPRESS 2
+
+extern const char *const codec_names[N_CODECS];
+extern const char *const compress_names[N_COMPRESS];
+
+/**
+ * Options in force on one connection, the defaults until a HELLO
+ */
+struct proto_caps
+{
+    uint16_t version;
+    uint8_t codec;
+    uint8_t compress;
+    uint32_t max_frame;    /* Largest payload either side sends */
+    uint32_t heartbeat_ms; /* Silence before a PING; 0 = the server's idle timeout */
+};
+
+/* Decoder results */
+#define FRAME_NEED_MORE 0
+#define FRAME_READY 1
+#define FRAME_ERROR -1
+
+struct frame
+{
+    uint16_t type;
+    uint32_t length;
+    char *payload; /* length bytes, not null-terminated */
+};
+
+/**
+ * Incremental decoder state, one per connection
+ * The header is parsed once and remembered, so a payload arriving over many
+ * reads costs one length comparison per read
+ */
+struct frame_decoder
+{
+    int have_header;
+    uint16_t type;
+    uint32_t length;
+    uint32_t max_payload;
+};
+
+/**
+ * Reset the decoder; payloads longer than max_payload are rejected
+ */
+void frame_decoder_init(struct frame_decoder *dec, uint32_t max_payload);
+
+/**
+ * Try to take the next frame out of the ring
+ * On FRAME_READY the header has been consumed and frame->payload points into
+ * the ring; the caller consumes the payload (rb_consume(rb, frame->length))
+ * once it has been handled
+ * Returns: FRAME_READY, FRAME_NEED_MORE, or FRAME_ERROR on an oversized length
+ */
+int frame_decode(struct frame_decoder *dec, struct ring_buffer *rb, struct frame *frame);
+
+/**
+ * Write the 6-byte header for a frame
+ */
+void frame_encode_header(unsigned char *header, uint16_t type, uint32_t length);
+
+/**
+ * Encode a whole frame into buf
+ * Returns: encoded size, -1 if it does not fit in cap
+ */
+int frame_encode(char *buf, size_t cap, uint16_t type, const void *payload, uint32_t length);
+
+/**
+ * A '|'-separated payload field, pointing into the payload (no copy, not
+ * null-terminated)
+ */
+struct field
+{
+    const char *data;
+    size_t len;
+};
+
+/**
+ * Take the next field off a payload
+ * payload and len are advanced past the field and its '|'; at the end of the
+ * payload the field is empty
+ */
+struct field field_next(const char **payload, uint32_t *len);
+
+/**
+ * Parse a field as a decimal id
+ * Returns: the id, -1 if the field is not a positive number that fits an int32
+ */
+int field_id(struct field f);
+
+/**
+ * Parse a field as a decimal size or offset (zero allowed)
+ * Returns: 0 on success, -1 if the field is not a number below 2^63
+ */
+int field_size(struct field f, uint64_t *size);
+
+/**
+ * Copy a field into out as a null-terminated string
+ * Returns: field length, -1 if it does not fit in size
+ */
+int field_copy(struct field f, char *out, size_t size);
+
+/**
+ * Defaults for a connection that sent no HELLO
+ */
+void caps_init(struct proto_caps *caps);
+
+/**
+ * Write the capabilities offered in the greeting line (no line end)
+ * Returns: same as snprintf()
+ */
+int caps_offer(char *buf, size_t size, unsigned heartbeat_s);
+
+/**
+ * Pick from a ','-separated list of names in order of preference
+ * Returns: index in names of the first one known, -1 if none is
+ */
+int caps_pick(struct field list, const char *const *names, int n);
+
+#endif // FRAME_H
@@ -0,0 +1,457 @@
+#include "handover.h"
+#include "shard.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct handover_hello
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_listeners;
+    uint32_t has_unix; /* The local listener follows the TCP ones */
+    uint32_t n_conns;
+};
+
+/* Session state of one connection; its socket travels with it */
+struct handover_conn
+{
+    char addr[ADDR_STR_LEN];
+    int32_t proto;
+    int32_t is_logined;
+    int32_t user_id;
+    char username[USERNAME_SIZE];
+    int32_t dec_have_header; /* Frame header already taken out of the input */
+    uint32_t dec_type;
+    uint32_t dec_length;
+    struct proto_caps caps;
+    struct message_stream stream; /* Chunked message half sent */
+    struct file_upload upload;    /* File half uploaded */
+    int32_t has_upload_fd;        /* Its descriptor follows the socket's */
+    int32_t has_source_fd;        /* A download's file follows those */
+    uint64_t sink_left;           /* Upload body still to come, before the input */
+    int32_t sink_error;
+    int32_t sink_upload;          /* It goes to upload's file (else discarded) */
+    uint64_t source_off;
+    uint64_t source_end;
+    uint32_t source_type;
+    uint64_t in_len;  /* Received bytes not yet parsed, following the record */
+    uint64_t out_len; /* Queued output not yet sent, following the input */
+};
+
+static void set_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+}
+
+int handover_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+
+    set_unix_addr(&addr, path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Send a record with file descriptors attached to its first byte
+ * @return: 0 on success, -1 on error
+ */
+static int send_with_fds(int sock, const void *data, size_t len, const int *fds, int n_fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_LISTENERS)];
+    struct iovec iov = {(void *)data, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (n_fds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * n_fds);
+    }
+
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n == -1)
+    {
+        perror("sendmsg() error");
+        return -1;
+    }
+    /* The descriptors went with the first byte; the rest is plain data */
+    if ((size_t)n < len && send_all(sock, (const char *)data + n, len - n) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Receive a record and the file descriptors attached to it
+ * @return: number of descriptors stored in fds, -1 on error or end of stream
+ */
+static int recv_with_fds(int sock, void *data, size_t len, int *fds, int max_fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_LISTENERS)];
+    struct iovec iov = {data, len};
+    struct msghdr msg = {0};
+    int n_fds = 0;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+    {
+        if (n == -1)
+            perror("recvmsg() error");
+        return -1;
+    }
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *passed = (int *)CMSG_DATA(cm);
+        for (int i = 0; i < count; i++)
+        {
+            if (n_fds < max_fds)
+                fds[n_fds++] = passed[i];
+            else
+                close(passed[i]);
+        }
+    }
+
+    if ((size_t)n < len && recv_all(sock, (char *)data + n, len - n) <= 0)
+    {
+        while (n_fds > 0)
+            close(fds[--n_fds]);
+        return -1;
+    }
+    return n_fds;
+}
+
+/**
+ * Send the part of a file segment not sent yet, read back from its file
+ * @return: 0 on success, -1 on error
+ */
+static int send_file_segment(int sock, const struct out_segment *seg)
+{
+    char buf[BUFF_SIZE];
+
+    for (size_t off = seg->off; off < seg->len;)
+    {
+        size_t want = seg->len - off < sizeof(buf) ? seg->len - off : sizeof(buf);
+        ssize_t n = pread(seg->file_fd, buf, want, seg->file_off + off);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Queued file piece could not be read\n");
+            return -1;
+        }
+        if (send_all(sock, buf, n) == -1)
+            return -1;
+        off += n;
+    }
+    return 0;
+}
+
+/**
+ * Send the unsent part of a write queue, segments gathered as they are
+ * @return: 0 on success, -1 on error
+ */
+static int send_queue(int sock, const struct write_queue *wq)
+{
+    struct iovec iov[WQ_IOV_MAX];
+    int n = 0;
+
+    for (const struct out_segment *seg = wq->head; seg != NULL; seg = seg->next)
+    {
+        if (seg->len == seg->off)
+            continue;
+        if (seg->file_fd != -1)
+        {
+            if (n > 0 && send_all_iov(sock, iov, n, NULL) == -1)
+                return -1;
+            n = 0;
+            if (send_file_segment(sock, seg) == -1)
+                return -1;
+            continue;
+        }
+        iov[n].iov_base = seg->base + seg->off;
+        iov[n].iov_len = seg->len - seg->off;
+        if (++n == WQ_IOV_MAX)
+        {
+            if (send_all_iov(sock, iov, n, NULL) == -1)
+                return -1;
+            n = 0;
+        }
+    }
+    return n > 0 && send_all_iov(sock, iov, n, NULL) == -1 ? -1 : 0;
+}
+
+static int send_conn(int sock, struct connection *c)
+{
+    struct handover_conn rec;
+    int fds[3] = {c->fd};
+    int n_fds = 1;
+
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.addr, c->addr, sizeof(rec.addr));
+    rec.proto = c->proto;
+    rec.is_logined = c->is_logined;
+    rec.user_id = c->user_id;
+    memcpy(rec.username, c->username, sizeof(rec.username));
+    rec.dec_have_header = c->dec.have_header;
+    rec.dec_type = c->dec.type;
+    rec.dec_length = c->dec.length;
+    rec.caps = c->caps;
+    rec.stream = c->stream;
+    rec.upload = c->upload;
+    if ((rec.has_upload_fd = c->upload.fd != -1))
+        fds[n_fds++] = c->upload.fd;
+    if ((rec.has_source_fd = c->xfer.source_fd != -1))
+        fds[n_fds++] = c->xfer.source_fd;
+    rec.sink_left = c->xfer.sink_left;
+    rec.sink_error = c->xfer.sink_error;
+    rec.sink_upload = c->xfer.sink_fd != -1;
+    rec.source_off = c->xfer.source_off;
+    rec.source_end = c->xfer.source_end;
+    rec.source_type = c->xfer.source_type;
+    rec.in_len = rb_used(&c->in);
+    rec.out_len = c->out.bytes;
+
+    if (send_with_fds(sock, &rec, sizeof(rec), fds, n_fds) == -1)
+        return -1;
+    if (rec.in_len > 0 && send_all(sock, rb_peek(&c->in, rec.in_len), rec.in_len) == -1)
+        return -1;
+    return send_queue(sock, &c->out);
+}
+
+int handover_send(int sock, struct reactor *reactors, int n)
+{
+    struct handover_hello hello = {HANDOVER_MAGIC, HANDOVER_VERSION, (uint32_t)n, 0, 0};
+    int listen_fds[HANDOVER_MAX_LISTENERS + 1];
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+    char ack;
+
+    if (n > HANDOVER_MAX_LISTENERS)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    for (int i = 0; i < n; i++)
+    {
+        listen_fds[i] = reactors[i].listen_fd;
+        for (struct connection *c = reactors[i].conns; c != NULL; c = c->next)
+            hello.n_conns += !c->is_dead;
+    }
+    /* All reactors share the one local listener */
+    if (n > 0 && reactors[0].unix_fd != -1)
+    {
+        listen_fds[n] = reactors[0].unix_fd;
+        hello.has_unix = 1;
+    }
+    if (send_with_fds(sock, &hello, sizeof(hello), listen_fds, n + (int)hello.has_unix) == -1)
+        return -1;
+
+    for (int i = 0; i < n; i++)
+    {
+        for (struct connection *c = reactors[i].conns; c != NULL; c = c->next)
+        {
+            if (!c->is_dead && send_conn(sock, c) == -1)
+                return -1;
+        }
+    }
+
+    /* Until this byte arrives the new process serves nothing */
+    if (recv(sock, &ack, 1, 0) != 1)
+    {
+        fprintf(stderr, "Handover not confirmed\n");
+        return -1;
+    }
+    printf("Handed over %u connection(s)\n", hello.n_conns);
+    return 0;
+}
+
+int handover_begin(struct handover_in *in, const char *path, int *listen_fds, int max_fds)
+{
+    struct sockaddr_un addr;
+    struct handover_hello hello;
+
+    in->unix_fd = -1;
+    in->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (in->sock == -1)
+        return -1;
+    set_unix_addr(&addr, path);
+    if (connect(in->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(in->sock);
+        return -1;
+    }
+
+    int n_fds = recv_with_fds(in->sock, &hello, sizeof(hello), listen_fds, max_fds);
+    if (n_fds == -1 || hello.magic != HANDOVER_MAGIC || hello.version != HANDOVER_VERSION)
+    {
+        fprintf(stderr, "Bad handover from %s\n", path);
+        while (n_fds > 0)
+            close(listen_fds[--n_fds]);
+        close(in->sock);
+        errno = EPROTO;
+        return -1;
+    }
+    in->n_conns = hello.n_conns;
+    if (hello.has_unix && n_fds == (int)hello.n_listeners + 1)
+        in->unix_fd = listen_fds[--n_fds];
+    return n_fds;
+}
+
+/**
+ * Read and discard len bytes
+ * @return: 0 on success, -1 on error
+ */
+static int skip_bytes(int sock, uint64_t len)
+{
+    char buf[BUFF_SIZE];
+
+    while (len > 0)
+    {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (recv_all(sock, buf, n) <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Rebuild connection number i from its record, on its user's home reactor
+ * if logged in, spread over the reactors otherwise
+ * @return: 0 on success (also when the socket could not be adopted), -1 on error
+ */
+static int adopt_conn(int sock, struct reactor *reactors, int n, uint32_t i)
+{
+    struct handover_conn rec;
+    char buf[BUFF_SIZE];
+    int fds[3];
+
+    int n_fds = recv_with_fds(sock, &rec, sizeof(rec), fds, 3);
+    if (n_fds < 1)
+        return -1;
+    if (n_fds != 1 + (rec.has_upload_fd != 0) + (rec.has_source_fd != 0))
+    {
+        while (n_fds > 0)
+            close(fds[--n_fds]);
+        return -1;
+    }
+    rec.addr[sizeof(rec.addr) - 1] = '\0';
+    rec.username[sizeof(rec.username) - 1] = '\0';
+    rec.upload.name[sizeof(rec.upload.name) - 1] = '\0';
+    int upload_fd = rec.has_upload_fd ? fds[1] : -1;
+    int source_fd = rec.has_source_fd ? fds[n_fds - 1] : -1;
+
+    struct reactor *r = &reactors[i % n];
+    if (rec.is_logined && rec.proto == PROTO_BINARY)
+        r = shard_home(r, rec.user_id);
+    struct connection *c = conn_attach(r, fds[0], rec.addr);
+    if (c == NULL || rec.in_len > c->in.cap)
+    {
+        if (c != NULL)
+            conn_destroy(r, c);
+        if (upload_fd != -1)
+            close(upload_fd);
+        if (source_fd != -1)
+            close(source_fd);
+        return skip_bytes(sock, rec.in_len + rec.out_len);
+    }
+
+    c->proto = rec.proto;
+    c->user_id = rec.user_id;
+    memcpy(c->username, rec.username, sizeof(c->username));
+    c->dec.have_header = rec.dec_have_header;
+    c->dec.type = rec.dec_type;
+    c->dec.length = rec.dec_length;
+    c->caps = rec.caps;
+    c->stream = rec.stream;
+    c->upload = rec.upload;
+    c->upload.fd = upload_fd;
+    c->xfer.sink_left = rec.sink_left;
+    c->xfer.sink_error = rec.sink_error;
+    c->xfer.sink_fd = rec.sink_upload ? upload_fd : -1;
+    c->xfer.source_fd = source_fd;
+    c->xfer.source_off = rec.source_off;
+    c->xfer.source_end = rec.source_end;
+    c->xfer.source_type = rec.source_type;
+    c->dec.max_payload = c->caps.max_frame;
+    if (rec.is_logined)
+    {
+        conn_set_logged_in(c, 1);
+        if (c->proto == PROTO_BINARY)
+            reactor_set_online(r, c);
+    }
+
+    /* Partial requests go back into the ring exactly as they were */
+    for (uint64_t left = rec.in_len; left > 0;)
+    {
+        size_t space;
+        char *dst = conn_recv_space(c, &space);
+        if (dst == NULL)
+            return -1;
+        size_t n = left < space ? left : space;
+        if (recv_all(sock, dst, n) <= 0)
+            return -1;
+        rb_commit(&c->in, n);
+        left -= n;
+    }
+    for (uint64_t left = rec.out_len; left > 0;)
+    {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        if (recv_all(sock, buf, n) <= 0)
+            return -1;
+        conn_send(c, buf, n);
+        left -= n;
+    }
+
+    /* Requests that were already complete are dispatched once the reactor
+     * runs, and the download goes on from there */
+    if (rec.in_len > 0 || rec.dec_have_header || source_fd != -1)
+        conn_defer(r, c);
+    return 0;
+}
+
+int handover_finish(struct handover_in *in, struct reactor *reactors, int n)
+{
+    uint32_t i;
+
+    for (i = 0; i < in->n_conns; i++)
+    {
+        if (adopt_conn(in->sock, reactors, n, i) == -1)
+        {
+            fprintf(stderr, "Handover interrupted after %u connection(s)\n", i);
+            close(in->sock);
+            return -1;
+        }
+    }
+
+    int ret = send_all(in->sock, "K", 1) == -1 ? -1 : (int)i;
+    close(in->sock);
+    return ret;
+}
@@ -0,0 +1,63 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdint.h>
+
+#include "reactor.h"
+
+/**
+ * Hot upgrade: a running server hands its listening sockets and every live
+ * connection to a newly started one over a Unix socket, so clients keep
+ * their sessions across a restart
+ *
+ * The new process connects to the old one's control socket and receives:
+ *     hello (listening sockets attached with SCM_RIGHTS)
+ *     per connection: record (socket attached), unread input, unsent output
+ * and answers one byte once it has taken everything; only then does the old
+ * process exit. Both ends must be the same build (records are native structs).
+ */
+
+#define HANDOVER_MAGIC 0x43484f56 /* "CHOV" */
+#define HANDOVER_VERSION 6
+#define HANDOVER_MAX_LISTENERS 64
+#define HANDOVER_TIMEOUT 10 /* Seconds the old process waits on a stalled new one */
+
+/**
+ * Bind and listen on a Unix control socket at path (replacing a stale one)
+ * Returns: the socket, -1 on error
+ */
+int handover_listen(const char *path);
+
+/**
+ * Old process: send the listening sockets and the connections of all
+ * reactors, which must be paused, then wait for the new process to confirm
+ * Returns: 0 once the new process owns everything, -1 if it does not (the
+ * reactors can then resume as if nothing happened)
+ */
+int handover_send(int sock, struct reactor *reactors, int n);
+
+/**
+ * Incoming handover, between handover_begin() and handover_finish()
+ */
+struct handover_in
+{
+    int sock;
+    int unix_fd; /* Inherited local listener, -1 if the old process had none */
+    uint32_t n_conns;
+};
+
+/**
+ * New process: connect to the old one and receive its listening sockets
+ * Returns: number of TCP listening sockets stored in listen_fds, -1 on error
+ */
+int handover_begin(struct handover_in *in, const char *path, int *listen_fds, int max_fds);
+
+/**
+ * New process: adopt the connections, spread over the reactors (logged-in
+ * sessions on their home shard, so shard_link() first), and tell the old
+ * process it can exit; call before the reactors run
+ * Returns: number of connections adopted, -1 on error
+ */
+int handover_finish(struct handover_in *in, struct reactor *reactors, int n);
+
+#endif // HANDOVER_H
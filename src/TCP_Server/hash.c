@@ -0,0 +1,304 @@
+#include "hash.h"
+#include <string.h>
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+/* XXH64 is defined on little-endian words, SHA-256 on big-endian ones */
+static uint64_t read_le64(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+void xxh64_init(struct xxh64_state *s, uint64_t seed)
+{
+    s->v[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    s->v[1] = seed + XXH_PRIME2;
+    s->v[2] = seed;
+    s->v[3] = seed - XXH_PRIME1;
+    s->total = 0;
+    s->buf_len = 0;
+}
+
+/* Consume whole 32-byte stripes, returning how many bytes that was */
+static size_t xxh64_stripes(uint64_t v[4], const unsigned char *p, size_t len)
+{
+    size_t done = 0;
+    while (len - done >= 32)
+    {
+        v[0] = xxh64_round(v[0], read_le64(p + done));
+        v[1] = xxh64_round(v[1], read_le64(p + done + 8));
+        v[2] = xxh64_round(v[2], read_le64(p + done + 16));
+        v[3] = xxh64_round(v[3], read_le64(p + done + 24));
+        done += 32;
+    }
+    return done;
+}
+
+void xxh64_update(struct xxh64_state *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    s->total += len;
+    if (s->buf_len > 0)
+    {
+        size_t n = 32 - s->buf_len < len ? 32 - s->buf_len : len;
+        memcpy(s->buf + s->buf_len, p, n);
+        s->buf_len += n;
+        p += n;
+        len -= n;
+        if (s->buf_len < 32)
+            return;
+        xxh64_stripes(s->v, s->buf, 32);
+        s->buf_len = 0;
+    }
+    size_t done = xxh64_stripes(s->v, p, len);
+    memcpy(s->buf, p + done, len - done);
+    s->buf_len = len - done;
+}
+
+uint64_t xxh64_final(const struct xxh64_state *s)
+{
+    uint64_t h;
+
+    if (s->total >= 32)
+    {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge(h, s->v[i]);
+    }
+    else
+        h = s->v[2] + XXH_PRIME5;
+    h += s->total;
+
+    const unsigned char *p = s->buf;
+    size_t left = s->buf_len;
+    for (; left >= 8; p += 8, left -= 8)
+        h = rotl64(h ^ xxh64_round(0, read_le64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (left >= 4)
+    {
+        h = rotl64(h ^ (uint64_t)read_le32(p) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+        h = rotl64(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void sha256_init(struct sha256_state *s)
+{
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, iv, sizeof(iv));
+    s->total = 0;
+    s->buf_len = 0;
+}
+
+static void sha256_block(uint32_t h[8], const unsigned char *p)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = read_be32(p + 4 * i);
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+void sha256_update(struct sha256_state *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    s->total += len;
+    if (s->buf_len > 0)
+    {
+        size_t n = 64 - s->buf_len < len ? 64 - s->buf_len : len;
+        memcpy(s->buf + s->buf_len, p, n);
+        s->buf_len += n;
+        p += n;
+        len -= n;
+        if (s->buf_len < 64)
+            return;
+        sha256_block(s->h, s->buf);
+        s->buf_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(s->h, p);
+    memcpy(s->buf, p, len);
+    s->buf_len = len;
+}
+
+void sha256_final(struct sha256_state *s, unsigned char out[HASH_STRONG_SIZE])
+{
+    uint64_t bits = s->total * 8;
+
+    /* 0x80, zeros up to 56 mod 64, then the length in bits */
+    s->buf[s->buf_len++] = 0x80;
+    if (s->buf_len > 56)
+    {
+        memset(s->buf + s->buf_len, 0, 64 - s->buf_len);
+        sha256_block(s->h, s->buf);
+        s->buf_len = 0;
+    }
+    memset(s->buf + s->buf_len, 0, 56 - s->buf_len);
+    for (int i = 0; i < 8; i++)
+        s->buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_block(s->h, s->buf);
+
+    for (int i = 0; i < 8; i++)
+    {
+        out[4 * i] = (unsigned char)(s->h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)s->h[i];
+    }
+}
+
+void content_hash_init(struct content_hash *h)
+{
+    xxh64_init(&h->fast, 0);
+    sha256_init(&h->strong);
+}
+
+void content_hash_update(struct content_hash *h, const void *data, size_t len)
+{
+    xxh64_update(&h->fast, data, len);
+    sha256_update(&h->strong, data, len);
+}
+
+void content_hash_final(struct content_hash *h, uint64_t *fast, unsigned char strong[HASH_STRONG_SIZE])
+{
+    *fast = xxh64_final(&h->fast);
+    sha256_final(&h->strong, strong);
+}
+
+void hash_strong_to_hex(const unsigned char strong[HASH_STRONG_SIZE], char hex[HASH_STRONG_HEX])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < HASH_STRONG_SIZE; i++)
+    {
+        hex[2 * i] = digits[strong[i] >> 4];
+        hex[2 * i + 1] = digits[strong[i] & 0xf];
+    }
+    hex[2 * HASH_STRONG_SIZE] = '\0';
+}
+
+static int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+int hash_strong_from_hex(const char *hex, size_t len, unsigned char strong[HASH_STRONG_SIZE])
+{
+    if (len != 2 * HASH_STRONG_SIZE)
+        return -1;
+    for (int i = 0; i < HASH_STRONG_SIZE; i++)
+    {
+        int hi = hex_digit(hex[2 * i]), lo = hex_digit(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -1;
+        strong[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+int hash_fast_from_hex(const char *hex, size_t len, uint64_t *fast)
+{
+    if (len == 0 || len > 16)
+        return -1;
+    *fast = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        int d = hex_digit(hex[i]);
+        if (d < 0)
+            return -1;
+        *fast = *fast << 4 | (uint64_t)d;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Content hashes of stored files, computed as the bytes stream in
+ * Two of them: XXH64, fast and non-cryptographic, is what lookups go by;
+ * SHA-256 then decides whether two files with the same XXH64 really are the
+ * same content, so a collision can never hand out someone else's file.
+ * Both are plain C with no dependency and give the reference results.
+ */
+
+#define HASH_STRONG_SIZE 32                          /* SHA-256 digest */
+#define HASH_STRONG_HEX (2 * HASH_STRONG_SIZE + 1)   /* As text, with the '\0' */
+
+struct xxh64_state
+{
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32];
+    unsigned buf_len;
+};
+
+struct sha256_state
+{
+    uint32_t h[8];
+    uint64_t total;
+    unsigned char buf[64];
+    unsigned buf_len;
+};
+
+/* Both hashes of one stream */
+struct content_hash
+{
+    struct xxh64_state fast;
+    struct sha256_state strong;
+};
+
+void xxh64_init(struct xxh64_state *s, uint64_t seed);
+void xxh64_update(struct xxh64_state *s, const void *data, size_t len);
+uint64_t xxh64_final(const struct xxh64_state *s);
+
+void sha256_init(struct sha256_state *s);
+void sha256_update(struct sha256_state *s, const void *data, size_t len);
+void sha256_final(struct sha256_state *s, unsigned char out[HASH_STRONG_SIZE]);
+
+void content_hash_init(struct content_hash *h);
+void content_hash_update(struct content_hash *h, const void *data, size_t len);
+
+/**
+ * Finish both hashes; the state must be initialised again before reuse
+ */
+void content_hash_final(struct content_hash *h, uint64_t *fast, unsigned char strong[HASH_STRONG_SIZE]);
+
+/* Lower-case hex of a SHA-256 digest */
+void hash_strong_to_hex(const unsigned char strong[HASH_STRONG_SIZE], char hex[HASH_STRONG_HEX]);
+
+/**
+ * Parse the hex of a SHA-256 digest (exactly 64 hex digits)
+ * Returns: 0 on success, -1 if it is not one
+ */
+int hash_strong_from_hex(const char *hex, size_t len, unsigned char strong[HASH_STRONG_SIZE]);
+
+/**
+ * Parse the hex of an XXH64 value (1 to 16 hex digits)
+ * Returns: 0 on success, -1 if it is not one
+ */
+int hash_fast_from_hex(const char *hex, size_t len, uint64_t *fast);
+
+#endif // HASH_H
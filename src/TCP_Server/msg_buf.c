@@ -0,0 +1,50 @@
+#include "msg_buf.h"
+#include "frame.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct msg_buf *mb_frame(uint16_t type, const void *payload, uint32_t len)
+{
+    struct msg_buf *mb = malloc(sizeof(*mb) + FRAME_HEADER_SIZE + len);
+    if (mb == NULL)
+        return NULL;
+
+    mb->refs = 1;
+    mb->len = FRAME_HEADER_SIZE + len;
+    frame_encode_header((unsigned char *)mb->data, type, len);
+    memcpy(mb->data + FRAME_HEADER_SIZE, payload, len);
+    return mb;
+}
+
+struct msg_buf *mb_framev(uint16_t type, const struct iovec *iov, int iovcnt)
+{
+    uint32_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    struct msg_buf *mb = malloc(sizeof(*mb) + FRAME_HEADER_SIZE + len);
+    if (mb == NULL)
+        return NULL;
+
+    mb->refs = 1;
+    mb->len = FRAME_HEADER_SIZE + len;
+    frame_encode_header((unsigned char *)mb->data, type, len);
+    char *dst = mb->data + FRAME_HEADER_SIZE;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    return mb;
+}
+
+void mb_ref(struct msg_buf *mb)
+{
+    __atomic_add_fetch(&mb->refs, 1, __ATOMIC_RELAXED);
+}
+
+void mb_unref(struct msg_buf *mb)
+{
+    if (__atomic_sub_fetch(&mb->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(mb);
+}
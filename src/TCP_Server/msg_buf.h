@@ -0,0 +1,38 @@
+#ifndef MSG_BUF_H
+#define MSG_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Immutable, reference-counted outbound message
+ * A message going to many connections (group fan-out) is serialised once and
+ * every write queue holds a reference instead of its own copy; the last
+ * reference frees it. The count is atomic so a buffer may be handed to
+ * another reactor thread.
+ */
+struct msg_buf
+{
+    int refs;
+    size_t len;
+    char data[];
+};
+
+/**
+ * Serialise one frame (header and payload) into a new buffer holding one reference
+ * Returns: the buffer, NULL on allocation failure
+ */
+struct msg_buf *mb_frame(uint16_t type, const void *payload, uint32_t len);
+
+/**
+ * Same, with the payload gathered from several pieces
+ */
+struct msg_buf *mb_framev(uint16_t type, const struct iovec *iov, int iovcnt);
+
+void mb_ref(struct msg_buf *mb);
+
+/* Drop a reference, freeing the buffer with the last one */
+void mb_unref(struct msg_buf *mb);
+
+#endif // MSG_BUF_H
@@ -0,0 +1,1320 @@
+#define _GNU_SOURCE /* accept4() */
+#include "reactor.h"
+#include "shard.h"
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_BATCH 64 /* Delimiters reported per scan */
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int reactor_init(struct reactor *r, int listen_fd, int unix_fd, const struct conn_handlers *handlers,
+                 const struct io_backend *io)
+{
+    memset(r, 0, sizeof(*r));
+    r->listen_fd = listen_fd;
+    r->unix_fd = unix_fd;
+    r->handlers = handlers;
+    r->io = io;
+    r->epfd = -1;
+    r->pipe_fds[0] = -1;
+    r->pipe_fds[1] = -1;
+    r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    r->limits.out_low = DEFAULT_OUT_LOW;
+    r->limits.out_high = DEFAULT_OUT_HIGH;
+    r->limits.out_max = DEFAULT_OUT_MAX;
+    r->timeouts.login_ms = DEFAULT_LOGIN_TIMEOUT * 1000;
+    r->timeouts.idle_ms = DEFAULT_IDLE_TIMEOUT * 1000;
+    r->timeouts.pong_ms = DEFAULT_PONG_TIMEOUT * 1000;
+    r->budget.bytes = DEFAULT_BUDGET_BYTES;
+    r->budget.requests = DEFAULT_BUDGET_REQUESTS;
+    r->xfer_rate = DEFAULT_XFER_RATE;
+    r->ready_tail = &r->ready;
+    r->shards = r;
+    r->n_shards = 1;
+    if ((r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        return -1;
+    r->now_ms = monotonic_ms();
+    tw_init(&r->timers, r->now_ms, TIMER_TICK_MS);
+
+    return io->init(r);
+}
+
+void reactor_run(struct reactor *r)
+{
+    r->io->run(r);
+}
+
+static void conn_mark_dirty(struct connection *conn);
+static void conn_dispatch(struct reactor *r, struct connection *c);
+static void conn_pump_file(struct connection *c);
+static void conn_xfer_tick(void *arg);
+static void conn_run_drained(struct connection *c);
+
+/**
+ * Give each connection on the ready list another turn, oldest first
+ * Those that use up their budget again rejoin at the back, behind the
+ * others that were waiting with them
+ */
+static void reactor_run_ready(struct reactor *r)
+{
+    struct connection *c = r->ready;
+
+    r->ready = NULL;
+    r->ready_tail = &r->ready;
+    while (c != NULL)
+    {
+        struct connection *next = c->ready_next;
+        c->is_ready = 0;
+        if (!c->is_dead && c->holds == 0)
+        {
+            conn_dispatch(r, c);
+            if (!c->is_ready && !c->is_dead && r->io->resume != NULL)
+                r->io->resume(r, c);
+            conn_trim(c);
+        }
+        if (!c->is_dead && c->xfer.source_fd != -1)
+            conn_pump_file(c);
+        if (!c->is_dead && c->drain_waiters != NULL && c->out.bytes < XFER_AHEAD)
+            conn_run_drained(c);
+        /* The end-of-iteration flush disposes of it */
+        if (c->is_dead)
+            conn_mark_dirty(c);
+        c = next;
+    }
+}
+
+void reactor_tick(struct reactor *r)
+{
+    r->now_ms = monotonic_ms();
+    r->turn++;
+    tw_advance(&r->timers, r->now_ms);
+    reactor_run_ready(r);
+}
+
+int reactor_timeout(struct reactor *r)
+{
+    if (r->ready != NULL)
+        return 0;
+    /* A full shard queue: retry soon rather than at the next tick */
+    if (r->outbox_pending)
+        return 1;
+    return tw_timeout(&r->timers, monotonic_ms());
+}
+
+/**
+ * Keep waiting until since + limit
+ * @return: 1 if that is still ahead (the timer is armed for it) or limit is 0, 0 if it has passed
+ */
+static int conn_wait(struct connection *c, uint64_t since, unsigned limit)
+{
+    struct reactor *r = c->owner;
+
+    if (limit == 0)
+        return 1;
+    if (r->now_ms - since >= limit)
+        return 0;
+    tw_arm(&r->timers, &c->timer, since + limit - r->now_ms);
+    return 1;
+}
+
+/**
+ * Timer callback, also run on state changes: apply the timeout of the
+ * current state and arm the timer for the next check
+ * Activity does not touch the timer; the check finds the newer last_rx_ms
+ * and waits again for the remainder
+ */
+static void conn_check_timeouts(void *arg)
+{
+    struct connection *c = arg;
+    struct reactor *r = c->owner;
+    const struct conn_timeouts *to = &r->timeouts;
+    const char *reason;
+
+    tw_cancel(&r->timers, &c->timer);
+    if (c->is_dead)
+        return;
+
+    if (!c->is_logined)
+    {
+        if (conn_wait(c, c->state_ms, to->login_ms))
+            return;
+        reason = "login timeout";
+    }
+    else if (!c->ping_sent)
+    {
+        uint64_t since = c->last_rx_ms > c->state_ms ? c->last_rx_ms : c->state_ms;
+        unsigned idle_ms = c->caps.heartbeat_ms ? c->caps.heartbeat_ms : to->idle_ms;
+        if (conn_wait(c, since, idle_ms))
+            return;
+        if (to->pong_ms == 0)
+            reason = "idle timeout";
+        else
+        {
+            /* Text clients have no PING; the same silence closes them after pong_ms */
+            c->ping_sent = 1;
+            c->ping_ms = r->now_ms;
+            if (c->proto == PROTO_BINARY)
+                conn_send_frame(c, MSG_PING, NULL, 0);
+            conn_wait(c, c->ping_ms, to->pong_ms);
+            return;
+        }
+    }
+    else
+    {
+        if (conn_wait(c, c->ping_ms, to->pong_ms))
+            return;
+        reason = "no reply to heartbeat";
+    }
+
+    printf("Closing %s: %s\n", c->addr, reason);
+    c->is_dead = 1;
+    conn_mark_dirty(c);
+}
+
+void conn_set_logged_in(struct connection *conn, int logged_in)
+{
+    conn->is_logined = logged_in;
+    conn->state_ms = conn->owner->now_ms;
+    conn->ping_sent = 0;
+    conn_check_timeouts(conn);
+}
+
+/* Connections open on all reactors, which max_conns applies to; one that
+ * moves to another reactor stays counted */
+static size_t n_open;
+
+/**
+ * Take a zeroed connection slot, carving a new slab when none is free
+ * Slabs are never given back: they serve the next clients
+ */
+static struct connection *conn_alloc(struct reactor *r)
+{
+    if (r->free_conns == NULL)
+    {
+        struct connection *slab = malloc(CONN_SLAB * sizeof(*slab));
+        if (slab == NULL)
+            return NULL;
+        for (int i = 0; i < CONN_SLAB; i++)
+        {
+            slab[i].next = r->free_conns;
+            r->free_conns = &slab[i];
+        }
+    }
+
+    struct connection *c = r->free_conns;
+    r->free_conns = c->next;
+    memset(c, 0, sizeof(*c));
+    return c;
+}
+
+/* Back to the slot pool of the reactor it was last on */
+static void conn_free(struct connection *c)
+{
+    struct reactor *r = c->owner;
+    c->next = r->free_conns;
+    r->free_conns = c;
+}
+
+/**
+ * Receive buffers come from a per-reactor pool: a connection holds one only
+ * while it has unread input
+ */
+static char *input_get(struct reactor *r, size_t size)
+{
+    char *data = r->input_pool;
+    if (data == NULL)
+        return malloc(size);
+    memcpy(&r->input_pool, data, sizeof(char *));
+    r->input_pooled--;
+    return data;
+}
+
+static void input_put(struct reactor *r, char *data)
+{
+    if (r->input_pooled >= INPUT_POOL_MAX)
+    {
+        free(data);
+        return;
+    }
+    memcpy(data, &r->input_pool, sizeof(char *));
+    r->input_pool = data;
+    r->input_pooled++;
+}
+
+void conn_trim(struct connection *c)
+{
+    char *data = rb_detach(&c->in);
+    if (data != NULL)
+        input_put(c->owner, data);
+}
+
+struct connection *conn_attach(struct reactor *r, int fd, const char *addr)
+{
+    struct connection *c = conn_alloc(r);
+    if (c == NULL)
+    {
+        perror("malloc() error");
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->owner = r;
+    rb_init_lazy(&c->in, BUFF_SIZE);
+    caps_init(&c->caps);
+    frame_decoder_init(&c->dec, c->caps.max_frame);
+    wq_init(&c->out);
+    timer_init(&c->timer, conn_check_timeouts, c);
+    c->upload.fd = -1;
+    c->xfer.sink_fd = -1;
+    c->xfer.source_fd = -1;
+    timer_init(&c->xfer.timer, conn_xfer_tick, c);
+    c->state_ms = r->now_ms;
+    c->last_rx_ms = r->now_ms;
+
+    snprintf(c->addr, sizeof(c->addr), "%s", addr);
+
+    c->next = r->conns;
+    if (r->conns)
+        r->conns->prev = c;
+    r->conns = c;
+    r->n_conns++;
+    __atomic_add_fetch(&n_open, 1, __ATOMIC_RELAXED);
+
+    if (r->io->watch(r, c) == -1)
+    {
+        perror("Failed to watch connection");
+        conn_destroy(r, c);
+        return NULL;
+    }
+
+    conn_check_timeouts(c);
+    return c;
+}
+
+struct connection *conn_open(struct reactor *r, int fd, const struct sockaddr *peer)
+{
+    char client_ip[INET_ADDRSTRLEN];
+    char addr[ADDR_STR_LEN];
+
+    if (peer->sa_family == AF_UNIX)
+    {
+        /* Local peers are usually unnamed */
+        snprintf(addr, sizeof(addr), "unix:%d", fd);
+    }
+    else
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+        if (inet_ntop(AF_INET, &in->sin_addr, client_ip, INET_ADDRSTRLEN) == NULL)
+        {
+            perror("inet_ntop error");
+            strcpy(client_ip, "?");
+        }
+        snprintf(addr, sizeof(addr), "%s:%d", client_ip, ntohs(in->sin_port));
+    }
+
+    struct connection *c = conn_attach(r, fd, addr);
+    if (c == NULL)
+        return NULL;
+    printf("Got a connection from %s\n", c->addr);
+
+    /* Text clients only look at the code; binary ones may answer with HELLO */
+    char greeting[256];
+    int len = snprintf(greeting, sizeof(greeting), "100-Connected to the server ");
+    len += caps_offer(greeting + len, sizeof(greeting) - len - 2, r->timeouts.idle_ms / 1000);
+    if (len > (int)sizeof(greeting) - 3)
+        len = sizeof(greeting) - 3;
+    memcpy(greeting + len, "\r\n", 2);
+    conn_send(c, greeting, len + 2);
+    return c;
+}
+
+/**
+ * Take the connection out of every list and index of r
+ */
+static void conn_unlink(struct reactor *r, struct connection *c)
+{
+    if (c->is_dirty)
+    {
+        struct connection **pp = &r->dirty;
+        while (*pp != c)
+            pp = &(*pp)->dirty_next;
+        *pp = c->dirty_next;
+    }
+    if (c->is_ready)
+    {
+        struct connection **pp = &r->ready;
+        while (*pp != c)
+            pp = &(*pp)->ready_next;
+        *pp = c->ready_next;
+        if (r->ready_tail == &c->ready_next)
+            r->ready_tail = pp;
+    }
+    if (c->is_logined)
+        reactor_set_offline(r, c);
+    tw_cancel(&r->timers, &c->timer);
+    /* Only armed for a transfer, which ends before a connection can move */
+    tw_cancel(&r->timers, &c->xfer.timer);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        r->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    r->n_conns--;
+}
+
+void conn_destroy(struct reactor *r, struct connection *c)
+{
+    conn_unlink(r, c);
+    __atomic_sub_fetch(&n_open, 1, __ATOMIC_RELAXED);
+    if (c->migrate_to != NULL)
+    {
+        /* Never left: drop the move and its hold */
+        struct connection **pp = &r->migrating;
+        while (*pp != c)
+            pp = &(*pp)->migrating_next;
+        *pp = c->migrating_next;
+        c->migrate_to = NULL;
+        c->holds--;
+    }
+    if (c->xfer.up_paused)
+    {
+        c->xfer.up_paused = 0;
+        c->holds--;
+    }
+
+    c->is_dead = 1;
+    c->is_closed = 1;
+    printf("Client %s: %llu request(s), %llu byte(s) received, budget exhausted %u time(s), %zu byte(s) dropped\n",
+           c->addr, (unsigned long long)c->requests, (unsigned long long)c->rx_bytes, c->budget_exhausted,
+           c->dropped_bytes);
+    close(c->fd);
+    wq_clear(&c->out);
+    if (c->xfer.source_fd != -1)
+        close(c->xfer.source_fd);
+    if (c->upload.fd != -1)
+        close(c->upload.fd);
+    deflater_free(c->deflater);
+    c->deflater = NULL;
+    free(c->io_ctx);
+    c->io_ctx = NULL;
+    /* Whatever was left unread goes with it */
+    rb_consume(&c->in, rb_used(&c->in));
+    conn_trim(c);
+    if (c->drain_waiters != NULL)
+    {
+        /* A waiter may hold the last reference */
+        conn_hold(c);
+        conn_run_drained(c);
+        conn_release(c);
+        return;
+    }
+    if (c->holds == 0)
+        conn_free(c);
+}
+
+void conn_hold(struct connection *conn)
+{
+    conn->holds++;
+}
+
+void conn_release(struct connection *conn)
+{
+    if (--conn->holds > 0)
+        return;
+    if (conn->is_closed)
+        conn_free(conn);
+    else if (!conn->is_dead)
+        conn_defer(conn->owner, conn);
+}
+
+/**
+ * On the new owner, sent by reactor_migrate(): join its lists, receive and
+ * dispatch again
+ */
+static void conn_arrive(struct reactor_call *call)
+{
+    struct connection *c = (struct connection *)((char *)call - offsetof(struct connection, call));
+    struct reactor *r = c->owner;
+
+    c->migrate_to = NULL;
+    c->prev = NULL;
+    c->next = r->conns;
+    if (r->conns)
+        r->conns->prev = c;
+    r->conns = c;
+    r->n_conns++;
+
+    if (r->io->watch(r, c) == -1)
+    {
+        perror("Failed to watch connection");
+        c->is_dead = 1;
+    }
+    if (c->is_logined)
+        reactor_set_online(r, c);
+    conn_check_timeouts(c);
+    if (c->out.bytes > 0 || c->is_dead)
+        conn_mark_dirty(c);
+    conn_release(c);
+}
+
+void conn_migrate(struct connection *c, struct reactor *to)
+{
+    struct reactor *r = c->owner;
+
+    if (to == r || c->migrate_to != NULL || c->is_dead)
+        return;
+    c->migrate_to = to;
+    c->call.fn = conn_arrive;
+    /* Nothing waits on a connection across reactors */
+    conn_run_drained(c);
+    /* Requests wait, the input stays buffered and goes along */
+    conn_hold(c);
+    c->migrating_next = r->migrating;
+    r->migrating = c;
+}
+
+/**
+ * Send off the connections waiting to move whose other holds are gone and
+ * whose backend is done with them
+ */
+static void reactor_migrate(struct reactor *r)
+{
+    struct connection **pp = &r->migrating;
+    struct connection *c;
+
+    while ((c = *pp) != NULL)
+    {
+        /* A dead one is already on its way out */
+        if (c->is_dead || c->holds > 1)
+        {
+            pp = &c->migrating_next;
+            continue;
+        }
+        if (!r->io->detach(r, c))
+        {
+            if (c->is_dead)
+                conn_mark_dirty(c);
+            pp = &c->migrating_next;
+            continue;
+        }
+        *pp = c->migrating_next;
+        conn_unlink(r, c);
+        c->owner = c->migrate_to;
+        shard_send(r, c->migrate_to, &c->call);
+    }
+}
+
+void reactor_post(struct reactor *r, struct reactor_call *call)
+{
+    struct reactor_call *head = __atomic_load_n(&r->mailbox, __ATOMIC_RELAXED);
+    do
+        call->next = head;
+    while (!__atomic_compare_exchange_n(&r->mailbox, &head, call, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* Only the first call into an empty mailbox needs to wake the reactor */
+    uint64_t one = 1;
+    if (head == NULL && write(r->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("eventfd write error");
+}
+
+void reactor_wake(struct reactor *r)
+{
+    uint64_t count;
+
+    /* Reset before running: a call posted after the swap below signals again */
+    if (read(r->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        perror("eventfd read error");
+    reactor_run_mailbox(r);
+}
+
+int reactor_run_mailbox(struct reactor *r)
+{
+    struct reactor_call *call = __atomic_exchange_n(&r->mailbox, NULL, __ATOMIC_ACQUIRE);
+    struct reactor_call *fifo = NULL;
+    int n = 0;
+
+    /* The mailbox is a stack: reverse it to run calls in the order they were posted */
+    while (call != NULL)
+    {
+        struct reactor_call *next = call->next;
+        call->next = fifo;
+        fifo = call;
+        call = next;
+    }
+    while (fifo != NULL)
+    {
+        call = fifo;
+        fifo = fifo->next;
+        call->fn(call);
+        n++;
+    }
+    return n + shard_drain(r);
+}
+
+/**
+ * Remember that the connection has output for the end-of-iteration flush
+ * Dead connections are queued too, so the flush disposes of them
+ */
+static void conn_mark_dirty(struct connection *conn)
+{
+    if (conn->is_dirty)
+        return;
+    conn->is_dirty = 1;
+    conn->dirty_next = conn->owner->dirty;
+    conn->owner->dirty = conn;
+}
+
+/**
+ * Apply the slow-consumer policy after output was queued
+ */
+static void conn_check_backlog(struct connection *conn)
+{
+    const struct conn_limits *limits = &conn->owner->limits;
+
+    if (conn->out.bytes <= limits->out_high)
+        return;
+
+    if (!conn->congested)
+    {
+        conn->congested = 1;
+        fprintf(stderr, "Slow consumer %s: %zu bytes queued\n", conn->addr, conn->out.bytes);
+    }
+    conn->dropped_bytes += wq_drop(&conn->out);
+
+    if (limits->out_max > 0 && conn->out.bytes > limits->out_max)
+    {
+        fprintf(stderr, "Slow consumer %s: %zu bytes queued, disconnecting\n", conn->addr, conn->out.bytes);
+        conn->is_dead = 1;
+    }
+}
+
+/**
+ * Append one message (data, then the pieces of iov) to the output queue without flushing
+ * @return: 0 on success, -1 on error (connection marked dead)
+ */
+static int conn_queue(struct connection *conn, const void *data, size_t len, const struct iovec *iov, int iovcnt,
+                      int cls)
+{
+    if (wq_appendv(&conn->out, data, len, iov, iovcnt, cls) == -1)
+    {
+        perror("malloc() error");
+        conn->is_dead = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int conn_send(struct connection *conn, const void *data, size_t len)
+{
+    if (conn->is_dead)
+        return -1;
+
+    conn_queue(conn, data, len, NULL, 0, WQ_NORMAL);
+    conn_check_backlog(conn);
+    conn_mark_dirty(conn);
+    return conn->is_dead ? -1 : (int)len;
+}
+
+/**
+ * A droppable frame, header and payload, is queued as a segment of its own,
+ * so a congested connection drops it whole or sends it whole
+ */
+static int conn_send_frame_cls(struct connection *conn, uint16_t type, const struct iovec *iov,
+                               int iovcnt, int cls)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    uint32_t len = 0;
+
+    if (conn->is_dead)
+        return -1;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > conn->caps.max_frame)
+        return -1;
+    if (cls == WQ_DROPPABLE && conn->congested)
+    {
+        conn->dropped_bytes += sizeof(header) + len;
+        return 0;
+    }
+
+    frame_encode_header(header, type, len);
+    conn_queue(conn, header, sizeof(header), iov, iovcnt, cls);
+    conn_check_backlog(conn);
+    conn_mark_dirty(conn);
+    return conn->is_dead ? -1 : (int)(sizeof(header) + len);
+}
+
+int conn_send_frame(struct connection *conn, uint16_t type, const void *payload, uint32_t len)
+{
+    struct iovec iov = {(void *)payload, len};
+    return conn_send_frame_cls(conn, type, &iov, 1, WQ_NORMAL);
+}
+
+int conn_send_framev(struct connection *conn, uint16_t type, const struct iovec *iov, int iovcnt)
+{
+    return conn_send_frame_cls(conn, type, iov, iovcnt, WQ_NORMAL);
+}
+
+int conn_send_droppable_frame(struct connection *conn, uint16_t type, const void *payload, uint32_t len)
+{
+    struct iovec iov = {(void *)payload, len};
+    return conn_send_frame_cls(conn, type, &iov, 1, WQ_DROPPABLE);
+}
+
+int conn_send_shared(struct connection *conn, struct msg_buf *mb)
+{
+    if (conn->is_dead || mb->len - FRAME_HEADER_SIZE > conn->caps.max_frame)
+        return -1;
+
+    if (wq_append_shared(&conn->out, mb, WQ_NORMAL) == -1)
+    {
+        perror("malloc() error");
+        conn->is_dead = 1;
+    }
+    conn_check_backlog(conn);
+    conn_mark_dirty(conn);
+    return conn->is_dead ? -1 : (int)mb->len;
+}
+
+static struct connection **online_bucket(struct reactor *r, int user_id)
+{
+    return &r->online[(unsigned)user_id & (ONLINE_BUCKETS - 1)];
+}
+
+void reactor_set_online(struct reactor *r, struct connection *c)
+{
+    struct connection **bucket = online_bucket(r, c->user_id);
+    c->online_next = *bucket;
+    *bucket = c;
+}
+
+void reactor_set_offline(struct reactor *r, struct connection *c)
+{
+    for (struct connection **pp = online_bucket(r, c->user_id); *pp != NULL; pp = &(*pp)->online_next)
+    {
+        if (*pp == c)
+        {
+            *pp = c->online_next;
+            c->online_next = NULL;
+            return;
+        }
+    }
+}
+
+struct connection *reactor_find_user(struct reactor *r, int user_id, struct connection *prev)
+{
+    struct connection *c = prev ? prev->online_next : *online_bucket(r, user_id);
+    while (c != NULL && c->user_id != user_id)
+        c = c->online_next;
+    return c;
+}
+
+/**
+ * Best effort, never blocks: a client that cannot take these few bytes
+ * right away does not get them
+ */
+static void conn_reject(struct reactor *r, int fd)
+{
+    static const char busy[] = "503-Server busy, try again later\r\n";
+
+    send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    if (r->rejected++ % 1000 == 0)
+        fprintf(stderr, "Reactor %d busy: %zu client(s) turned away\n", r->id, r->rejected);
+}
+
+void reactor_admit(struct reactor *r, int fd, const struct sockaddr *peer)
+{
+    if (r->max_conns > 0 && __atomic_load_n(&n_open, __ATOMIC_RELAXED) >= r->max_conns)
+        conn_reject(r, fd);
+    else
+        conn_open(r, fd, peer);
+}
+
+int reactor_accept_failed(struct reactor *r, int listen_fd, int err)
+{
+    if (err == EINTR || err == ECONNABORTED)
+        return 1;
+    if ((err != EMFILE && err != ENFILE) || r->spare_fd == -1)
+    {
+        if (err != EAGAIN && err != EWOULDBLOCK)
+            fprintf(stderr, "accept() error: %s\n", strerror(err));
+        return 0;
+    }
+
+    /* The io_uring backend's listener blocks, so only accept what is there */
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) != 1)
+        return 0;
+
+    close(r->spare_fd);
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd != -1)
+        conn_reject(r, fd);
+    r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd != -1;
+}
+
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int n_paused;
+
+/**
+ * Block the calling reactor until reactor_resume()
+ */
+static void reactor_park(struct reactor *r)
+{
+    pthread_mutex_lock(&pause_lock);
+    n_paused++;
+    pthread_cond_broadcast(&pause_cond);
+    while (r->paused)
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    n_paused--;
+    pthread_mutex_unlock(&pause_lock);
+}
+
+/**
+ * The signal only interrupts a reactor blocked in its wait; one that was busy
+ * sees the flag at the end of its iteration. A signal that lands just before
+ * the wait is lost, hence the periodic resend.
+ */
+void reactor_pause(struct reactor *reactors, int n)
+{
+    pthread_mutex_lock(&pause_lock);
+    for (int i = 0; i < n; i++)
+        __atomic_store_n(&reactors[i].paused, 1, __ATOMIC_RELEASE);
+    while (n_paused < n)
+    {
+        for (int i = 0; i < n; i++)
+            pthread_kill(reactors[i].thread, REACTOR_WAKE_SIGNAL);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TIMER_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pause_cond, &pause_lock, &deadline);
+    }
+    pthread_mutex_unlock(&pause_lock);
+}
+
+void reactor_resume(struct reactor *reactors, int n)
+{
+    pthread_mutex_lock(&pause_lock);
+    for (int i = 0; i < n; i++)
+        reactors[i].paused = 0;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+/**
+ * Bring a transfer allowance up to date; what goes unused is saved up to
+ * XFER_BURST_MS worth (at least one splice or piece)
+ */
+static void xfer_refill(struct reactor *r, struct xfer_bucket *b)
+{
+    uint64_t elapsed = r->now_ms - b->refill_ms;
+    int64_t cap = (int64_t)(r->xfer_rate * XFER_BURST_MS / 1000);
+
+    if (elapsed > 1000)
+        elapsed = 1000;
+    if (cap < XFER_PIPE_SIZE)
+        cap = XFER_PIPE_SIZE;
+    b->tokens += (int64_t)(elapsed * r->xfer_rate / 1000);
+    if (b->tokens > cap)
+        b->tokens = cap;
+    b->refill_ms = r->now_ms;
+}
+
+/* Come back once b is out of debt; an earlier wake-up already armed stays */
+static void conn_xfer_wait(struct connection *c, const struct xfer_bucket *b)
+{
+    struct reactor *r = c->owner;
+    if (!timer_armed(&c->xfer.timer))
+        tw_arm(&r->timers, &c->xfer.timer, (uint64_t)(-b->tokens * 1000) / r->xfer_rate + 1);
+}
+
+static void conn_xfer_tick(void *arg)
+{
+    struct connection *c = arg;
+    struct conn_xfer *x = &c->xfer;
+
+    if (x->up_paused)
+    {
+        xfer_refill(c->owner, &x->up);
+        if (x->up.tokens >= 0)
+        {
+            x->up_paused = 0;
+            conn_release(c);
+        }
+        else
+        {
+            conn_xfer_wait(c, &x->up);
+        }
+    }
+    if (x->source_fd != -1)
+        conn_pump_file(c);
+}
+
+/**
+ * Queue one download piece of len bytes as a frame: a file segment where the
+ * backend can sendfile() it, a copy otherwise
+ * @return: 0 on success, -1 on error (connection marked dead)
+ */
+static int conn_queue_piece(struct connection *c, uint32_t len)
+{
+    struct conn_xfer *x = &c->xfer;
+    unsigned char header[FRAME_HEADER_SIZE];
+    char data[FRAME_MAX_PAYLOAD];
+
+    if (!c->owner->io->zero_copy)
+    {
+        ssize_t n = pread(x->source_fd, data, len, x->source_off);
+        if (n != (ssize_t)len)
+        {
+            fprintf(stderr, "Download to %s: file shrank or could not be read\n", c->addr);
+            c->is_dead = 1;
+            return -1;
+        }
+    }
+
+    frame_encode_header(header, x->source_type, len);
+    if (!c->owner->io->zero_copy)
+    {
+        struct iovec iov = {data, len};
+        return conn_queue(c, header, sizeof(header), &iov, 1, WQ_NORMAL);
+    }
+    if (conn_queue(c, header, sizeof(header), NULL, 0, WQ_NORMAL) == -1)
+        return -1;
+    if (wq_append_file(&c->out, x->source_fd, x->source_off, len, 0) == -1)
+    {
+        perror("malloc() error");
+        c->is_dead = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue the next pieces of the download while little output is waiting and
+ * the allowance lasts; conn_sent() and the transfer timer bring it back
+ */
+static void conn_pump_file(struct connection *c)
+{
+    struct reactor *r = c->owner;
+    struct conn_xfer *x = &c->xfer;
+
+    while (x->source_fd != -1 && !c->is_dead && c->out.bytes < XFER_AHEAD)
+    {
+        if (r->xfer_rate > 0)
+        {
+            xfer_refill(r, &x->down);
+            if (x->down.tokens < 0)
+            {
+                conn_xfer_wait(c, &x->down);
+                return;
+            }
+        }
+
+        uint64_t left = x->source_end - x->source_off;
+        uint32_t len = left < c->caps.max_frame ? (uint32_t)left : c->caps.max_frame;
+        if (conn_queue_piece(c, len) == -1)
+            return;
+        x->down.tokens -= len;
+        x->source_off += len;
+        conn_mark_dirty(c);
+        if (x->source_off == x->source_end)
+            conn_stop_file(c);
+    }
+}
+
+int conn_send_file(struct connection *conn, uint16_t type, int fd, uint64_t off, uint64_t len)
+{
+    struct conn_xfer *x = &conn->xfer;
+
+    conn_stop_file(conn);
+    if (conn->is_dead || len == 0)
+    {
+        close(fd);
+        return conn->is_dead ? -1 : 0;
+    }
+
+    x->source_fd = fd;
+    x->source_off = off;
+    x->source_end = off + len;
+    x->source_type = type;
+    conn_pump_file(conn);
+    return conn->is_dead ? -1 : 0;
+}
+
+void conn_wait_drain(struct connection *conn, struct reactor_call *call)
+{
+    call->next = conn->drain_waiters;
+    conn->drain_waiters = call;
+    if (conn->out.bytes < XFER_AHEAD)
+        conn_defer(conn->owner, conn);
+}
+
+/**
+ * Run the calls waiting for the output to drain, oldest first; those that
+ * wait again join a new list
+ */
+static void conn_run_drained(struct connection *c)
+{
+    struct reactor_call *call = c->drain_waiters;
+    struct reactor_call *fifo = NULL;
+
+    c->drain_waiters = NULL;
+    while (call != NULL)
+    {
+        struct reactor_call *next = call->next;
+        call->next = fifo;
+        fifo = call;
+        call = next;
+    }
+    while (fifo != NULL)
+    {
+        call = fifo;
+        fifo = fifo->next;
+        call->fn(call);
+    }
+}
+
+void conn_stop_file(struct connection *conn)
+{
+    if (conn->xfer.source_fd == -1)
+        return;
+    /* Pieces still queued keep reading from it */
+    wq_release_file(&conn->out, conn->xfer.source_fd);
+    conn->xfer.source_fd = -1;
+}
+
+void conn_receive_file(struct connection *conn, int fd, uint64_t len)
+{
+    struct conn_xfer *x = &conn->xfer;
+
+    x->sink_fd = fd;
+    x->sink_left = len;
+    x->sink_error = 0;
+    if (len == 0 && fd != -1)
+    {
+        x->sink_fd = -1;
+        conn->owner->handlers->on_file_received(conn, 0);
+    }
+}
+
+/**
+ * Charge n body bytes that reached the sink; the last one completes it
+ */
+static void conn_sink_done(struct reactor *r, struct connection *c, size_t n)
+{
+    struct conn_xfer *x = &c->xfer;
+
+    x->sink_left -= n;
+    if (r->xfer_rate > 0)
+    {
+        xfer_refill(r, &x->up);
+        x->up.tokens -= n;
+        if (x->up.tokens < 0 && !x->up_paused)
+        {
+            /* Nothing more is read or dispatched until the allowance is back */
+            x->up_paused = 1;
+            conn_hold(c);
+            conn_xfer_wait(c, &x->up);
+        }
+    }
+
+    if (x->sink_left == 0 && x->sink_fd != -1)
+    {
+        x->sink_fd = -1;
+        r->handlers->on_file_received(c, x->sink_error);
+    }
+}
+
+void conn_sunk(struct reactor *r, struct connection *c, size_t n)
+{
+    c->rx_bytes += n;
+    c->last_rx_ms = r->now_ms;
+    c->ping_sent = 0;
+    conn_sink_done(r, c, n);
+}
+
+/**
+ * Write body bytes that were received into the input ring to the sink (the
+ * io_uring backend, or bytes that came in with the request)
+ * @return: 1 if there were any, 0 if the ring is empty
+ */
+static int conn_sink_buffered(struct reactor *r, struct connection *c)
+{
+    struct conn_xfer *x = &c->xfer;
+    size_t n = rb_used(&c->in);
+
+    if (n == 0)
+        return 0;
+    if (n > x->sink_left)
+        n = x->sink_left;
+
+    if (x->sink_fd != -1 && x->sink_error == 0)
+    {
+        const char *data = rb_peek(&c->in, n);
+        for (size_t done = 0; done < n;)
+        {
+            ssize_t w = write(x->sink_fd, data + done, n - done);
+            if (w > 0)
+                done += w;
+            else if (w == -1 && errno == EINTR)
+                continue;
+            else
+            {
+                x->sink_error = w == 0 ? EIO : errno;
+                break;
+            }
+        }
+    }
+    rb_consume(&c->in, n);
+    conn_sink_done(r, c, n);
+    return 1;
+}
+
+/**
+ * A client that pipelines N requests gets its N replies in one write
+ * Calls for other reactors made during the iteration are announced last,
+ * once per destination
+ */
+void reactor_flush_pending(struct reactor *r)
+{
+    struct connection *c;
+
+    while ((c = r->dirty) != NULL)
+    {
+        r->dirty = c->dirty_next;
+        c->is_dirty = 0;
+        if (!c->is_dead)
+            r->io->flush(r, c);
+        if (c->is_dead)
+            r->io->close(r, c);
+    }
+    reactor_migrate(r);
+    shard_flush(r);
+
+    if (__atomic_load_n(&r->paused, __ATOMIC_ACQUIRE))
+        reactor_park(r);
+}
+
+int conn_sent(struct connection *c, size_t n)
+{
+    wq_consume(&c->out, n);
+    /* The next piece of a download is queued, and the drain waiters run, on
+     * the next iteration, after the other connections had their turn */
+    if ((c->xfer.source_fd != -1 || c->drain_waiters != NULL) && c->out.bytes < XFER_AHEAD)
+        conn_defer(c->owner, c);
+    if (c->congested && c->out.bytes <= c->owner->limits.out_low)
+    {
+        c->congested = 0;
+        printf("Client %s caught up\n", c->addr);
+        return 1;
+    }
+    return 0;
+}
+
+char *conn_recv_space(struct connection *c, size_t *space)
+{
+    if (c->in.data == NULL)
+    {
+        char *data = input_get(c->owner, rb_storage_size(&c->in));
+        if (data == NULL)
+        {
+            perror("malloc() error");
+            c->is_dead = 1;
+            *space = 0;
+            return NULL;
+        }
+        rb_attach(&c->in, data);
+    }
+
+    char *buf = rb_write_ptr(&c->in, space);
+    if (*space == 0 && (c->is_ready || c->holds > 0))
+    {
+        /* Complete requests waiting their turn: not an overlong one */
+        return NULL;
+    }
+    if (*space == 0)
+    {
+        /* Full ring without a delimiter: the request can never complete */
+        fprintf(stderr, "Buffer overflow: message too long\n");
+        rb_consume(&c->in, rb_used(&c->in));
+        c->scan_off = 0;
+        buf = rb_write_ptr(&c->in, space);
+    }
+    return buf;
+}
+
+void conn_defer(struct reactor *r, struct connection *c)
+{
+    if (c->is_ready)
+        return;
+    c->is_ready = 1;
+    c->ready_next = NULL;
+    *r->ready_tail = c;
+    r->ready_tail = &c->ready_next;
+}
+
+/**
+ * Charge one complete request of len bytes to this iteration's budget
+ * A request is only refused once the budget is already spent, so one larger
+ * than the whole budget still goes through on its own
+ * @return: 1 if it may be dispatched, 0 if not (the connection is then deferred)
+ */
+static int conn_take_budget(struct reactor *r, struct connection *c, size_t len)
+{
+    if (c->turn != r->turn)
+    {
+        c->turn = r->turn;
+        c->turn_bytes = 0;
+        c->turn_requests = 0;
+    }
+
+    if ((r->budget.requests > 0 && c->turn_requests >= r->budget.requests) ||
+        (r->budget.bytes > 0 && c->turn_bytes >= r->budget.bytes))
+    {
+        if (!c->is_ready)
+            c->budget_exhausted++;
+        conn_defer(r, c);
+        return 0;
+    }
+
+    c->turn_requests++;
+    c->turn_bytes += len;
+    c->requests++;
+    return 1;
+}
+
+/**
+ * Requests are handed to the handler straight out of the ring: the view is
+ * null-terminated over its '\r' and the bytes are released afterwards
+ * Only bytes received since the last call are scanned, and one scan reports
+ * every delimiter in them
+ */
+static void conn_dispatch_lines(struct reactor *r, struct connection *c)
+{
+    size_t delims[LINE_BATCH];
+    size_t n;
+
+    while (!c->is_dead && (n = rb_scan_crlf(&c->in, &c->scan_off, delims, LINE_BATCH)) > 0)
+    {
+        size_t consumed = 0;
+        for (size_t i = 0; i < n && !c->is_dead; i++)
+        {
+            size_t msg_len = delims[i] - consumed;
+            if (c->holds > 0 || !conn_take_budget(r, c, msg_len + 2))
+            {
+                /* Rescan from the first line left over */
+                c->scan_off = msg_len;
+                return;
+            }
+            char *request = rb_peek(&c->in, msg_len + 2);
+            request[msg_len] = '\0';
+            printf("Recieved from client %s: %s\n", c->addr, request);
+            r->handlers->on_request(c, request);
+            rb_consume(&c->in, msg_len + 2);
+            consumed += msg_len + 2;
+        }
+        c->scan_off -= consumed;
+    }
+}
+
+/**
+ * Decode every complete frame; a partial one stays in the ring and the
+ * decoder resumes where it stopped when more bytes arrive
+ */
+static void conn_dispatch_frames(struct reactor *r, struct connection *c)
+{
+    struct frame frame;
+    int ret;
+
+    while (!c->is_dead && c->holds == 0)
+    {
+        if (c->xfer.sink_left > 0)
+        {
+            /* An upload body: no frames until it is all in */
+            if (!conn_sink_buffered(r, c))
+                return;
+            continue;
+        }
+        if ((ret = frame_decode(&c->dec, &c->in, &frame)) == FRAME_NEED_MORE)
+            return;
+        if (ret == FRAME_ERROR)
+        {
+            /* There is no delimiter to resynchronise on */
+            fprintf(stderr, "Frame too long from %s\n", c->addr);
+            c->is_dead = 1;
+            return;
+        }
+        if (!conn_take_budget(r, c, FRAME_HEADER_SIZE + frame.length))
+        {
+            /* Put the frame back: its payload is still in the ring */
+            c->dec.have_header = 1;
+            return;
+        }
+        printf("Recieved from client %s: type %u, %u bytes\n", c->addr, frame.type, frame.length);
+        r->handlers->on_frame(c, &frame);
+        rb_consume(&c->in, frame.length);
+    }
+}
+
+/**
+ * Dispatch the complete requests buffered so far, as far as the budget goes
+ */
+static void conn_dispatch(struct reactor *r, struct connection *c)
+{
+    /* Text requests start with a command word; a binary TYPE (1000-2999) starts with 0x03-0x0B */
+    if (c->proto == PROTO_UNKNOWN)
+    {
+        if (rb_used(&c->in) == 0)
+            return;
+        c->proto = (unsigned char)rb_at(&c->in, 0) < 0x20 ? PROTO_BINARY : PROTO_TEXT;
+    }
+
+    if (c->proto == PROTO_BINARY)
+        conn_dispatch_frames(r, c);
+    else
+        conn_dispatch_lines(r, c);
+}
+
+void conn_received(struct reactor *r, struct connection *c, size_t n)
+{
+    rb_commit(&c->in, n);
+    c->rx_bytes += n;
+    c->last_rx_ms = r->now_ms;
+    c->ping_sent = 0;
+
+    /* Deferred connections wait for their turn on the ready list, held ones
+     * for their release */
+    if (!c->is_ready && c->holds == 0)
+    {
+        conn_dispatch(r, c);
+        conn_trim(c);
+    }
+}
@@ -0,0 +1,534 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "tcp_utils.h"
+#include "ring_buffer.h"
+#include "frame.h"
+#include "hash.h"
+#include "compress.h"
+#include "write_queue.h"
+#include "timer_wheel.h"
+
+#define MAX_EVENTS 256
+#define ADDR_STR_LEN (INET_ADDRSTRLEN + 8)
+
+/* Wire protocol of a connection, decided by its first byte */
+#define PROTO_UNKNOWN 0
+#define PROTO_TEXT 1   /* \r\n-delimited USER/POST/BYE lines */
+#define PROTO_BINARY 2 /* [TYPE][LENGTH][PAYLOAD] frames from design.txt */
+
+/* Default output watermarks, see struct conn_limits */
+#define DEFAULT_OUT_LOW (64 << 10)
+#define DEFAULT_OUT_HIGH (256 << 10)
+#define DEFAULT_OUT_MAX (4 << 20)
+
+/* Default session timeouts in seconds, see struct conn_timeouts */
+#define DEFAULT_LOGIN_TIMEOUT 30
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_PONG_TIMEOUT 20
+
+/* Default fairness budget, see struct conn_budget */
+#define DEFAULT_BUDGET_BYTES (64 << 10)
+#define DEFAULT_BUDGET_REQUESTS 32
+
+#define TIMER_TICK_MS 100
+
+#define REACTOR_WAKE_SIGNAL SIGUSR2 /* Interrupts a reactor's wait, see reactor_pause() */
+
+#define ONLINE_BUCKETS 1024 /* Logged-in users index, power of two */
+
+/* Default cap on file transfers, see struct conn_xfer */
+#define DEFAULT_XFER_RATE (8 << 20)
+#define XFER_BURST_MS 250     /* Most unused transfer allowance a connection saves up */
+#define XFER_AHEAD (32 << 10) /* Most queued output a download piece joins, so replies are not stuck behind a file;
+                              * also what conn_wait_drain() waits for */
+#define XFER_PIPE_SIZE (64 << 10) /* Upload bytes spliced per call (the default pipe capacity) */
+
+#define CONN_SLAB 64        /* Connections allocated at once */
+#define INPUT_POOL_MAX 64   /* Idle receive buffers kept per reactor */
+
+struct reactor;
+struct shard_queue;
+
+/**
+ * Work handed to a reactor from another thread: fn runs on the reactor's own
+ * thread, see reactor_post()
+ */
+struct reactor_call
+{
+    struct reactor_call *next;
+    void (*fn)(struct reactor_call *call);
+};
+
+/**
+ * Direct message a client is sending in chunks (binary protocol)
+ */
+struct message_stream
+{
+    long long id; /* Stored message, 0 = none open */
+    int to;
+    long long timestamp;
+    unsigned seq; /* Chunks stored */
+    uint64_t bytes;
+    int missed; /* A chunk could not be delivered: the rest is only stored */
+};
+
+/**
+ * File a client is uploading into the storage directory (binary protocol)
+ */
+struct file_upload
+{
+    int fd;            /* Partial file, -1 = none open; closed with the connection */
+    char name[FILE_NAME_SIZE];
+    uint64_t size;     /* Announced size */
+    uint64_t off;      /* Bytes stored */
+    uint64_t incoming; /* Body bytes of the FILE_DATA being received */
+    struct content_hash hash; /* Of the first off bytes */
+    int has_hashes;           /* UPLOAD_FILE announced the two below, checked once complete */
+    uint64_t fast;
+    unsigned char strong[HASH_STRONG_SIZE];
+};
+
+/**
+ * Allowance of one transfer direction: bytes that may move before waiting
+ * (negative: owed), refilled at the reactor's xfer_rate
+ */
+struct xfer_bucket
+{
+    int64_t tokens;
+    uint64_t refill_ms;
+};
+
+/**
+ * File bytes moving over a connection besides its frames
+ * An upload body follows its request on the wire and goes from the socket
+ * into sink_fd; a download goes out in frames of one piece each, queued as
+ * the output drains. Each direction is capped at the reactor's xfer_rate,
+ * and requests and replies pass between the pieces.
+ */
+struct conn_xfer
+{
+    int sink_fd;        /* Receives the body (not owned), -1 = discard it */
+    uint64_t sink_left; /* Body bytes still to come, 0 = none */
+    int sink_error;     /* errno of a failed write; the rest is discarded */
+    int source_fd;      /* File being sent (owned), -1 = none */
+    uint64_t source_off;
+    uint64_t source_end;
+    uint16_t source_type; /* Frame type of the pieces */
+    struct xfer_bucket up;
+    struct xfer_bucket down;
+    int up_paused;      /* Held until up is out of debt */
+    struct timer timer; /* Next refill a paused direction waits for */
+};
+
+/**
+ * Per-client state owned by the event loop
+ * Replaces the locals that used to live on each forked child's stack
+ */
+struct connection
+{
+    int fd;
+    char addr[ADDR_STR_LEN]; /* "ip:port" (TCP) or "unix:fd" of the peer, for logging */
+    int is_logined;
+    int user_id; /* Binary protocol session */
+    char username[USERNAME_SIZE];
+    struct message_stream stream;
+    struct file_upload upload;
+    struct conn_xfer xfer;
+    int is_dead; /* Set on fatal I/O error, reaped by the backend */
+    int is_closed; /* Destroyed, but kept allocated while holds > 0 */
+    unsigned holds; /* Replies being prepared on other threads, see conn_hold() */
+    struct reactor *owner;
+
+    int proto;
+    struct ring_buffer in; /* Received bytes not yet split into requests; no storage while empty */
+    size_t scan_off;       /* Bytes of in already searched for \r\n */
+    struct frame_decoder dec;
+    struct proto_caps caps; /* Options chosen with HELLO; dec follows its max_frame */
+    struct frame_deflater *deflater; /* With COMPRESS_DEFLATE, during a compressed reply */
+
+    struct write_queue out; /* Bytes the kernel has not accepted yet */
+    struct reactor_call *drain_waiters; /* Run once out is below XFER_AHEAD, see conn_wait_drain() */
+    int congested;          /* Above the high watermark, until drained to the low one */
+    size_t dropped_bytes;   /* Droppable frames discarded while congested */
+
+    int io_inflight; /* Backend operations still referencing this connection */
+    void *io_ctx;    /* Backend per-connection data (malloc'd, freed with the connection) */
+
+    struct timer timer;  /* Next timeout check for the current session state */
+    uint64_t state_ms;   /* Connected, logged in or logged out at */
+    uint64_t last_rx_ms; /* Last bytes received at */
+    uint64_t ping_ms;    /* Heartbeat sent at, valid while ping_sent */
+    int ping_sent;
+
+    int is_dirty; /* Output queued during this loop iteration */
+    struct connection *dirty_next;
+
+    unsigned turn;          /* Loop iteration the two counters below belong to */
+    size_t turn_bytes;      /* Request bytes dispatched during it */
+    unsigned turn_requests; /* Requests dispatched during it */
+    int is_ready;           /* Out of budget with input left, queued for a later iteration */
+    struct connection *ready_next;
+
+    uint64_t rx_bytes;         /* Statistics, reported on disconnect */
+    uint64_t requests;
+    unsigned budget_exhausted; /* Times the connection was cut off and re-queued */
+
+    struct connection *online_next; /* Chain in the reactor's logged-in users index */
+
+    struct reactor *migrate_to;        /* Reactor it is moving to, see conn_migrate() */
+    struct connection *migrating_next; /* Chain in the reactor's connections waiting to move */
+    struct reactor_call call;          /* Carries it to migrate_to */
+
+    struct connection *prev;
+    struct connection *next;
+};
+
+/**
+ * Application callbacks, one per wire protocol
+ */
+struct conn_handlers
+{
+    /* Complete request line (delimiter stripped, null-terminated) */
+    void (*on_request)(struct connection *conn, char *request);
+    /* Complete frame; the payload is only valid during the call */
+    void (*on_frame)(struct connection *conn, const struct frame *frame);
+    /* Body announced with conn_receive_file() written (err 0) or failed (an
+     * errno); not called for a discarded one */
+    void (*on_file_received)(struct connection *conn, int err);
+};
+
+/**
+ * Transport used by a reactor to move bytes between sockets and connections
+ * The epoll backend is readiness-based; the io_uring backend is completion-based
+ * and batches its submissions, but both drive the same connection core below
+ */
+struct io_backend
+{
+    const char *name;
+    int zero_copy; /* Flushes file segments and splices uploads itself; otherwise
+                    * file bytes are copied through the input ring and the queue */
+    int (*init)(struct reactor *r);                      /* Returns 0 or -1 */
+    void (*run)(struct reactor *r);                      /* Loop forever */
+    int (*watch)(struct reactor *r, struct connection *c); /* Start receiving, 0 or -1 */
+    void (*flush)(struct reactor *r, struct connection *c); /* Push queued output */
+    void (*close)(struct reactor *r, struct connection *c); /* Dispose of a dead connection */
+    void (*resume)(struct reactor *r, struct connection *c); /* Receive again after a budget stop or a hold */
+    /* Stop using the connection before it moves to another reactor: 1 once
+     * nothing is in flight (watch() takes it on there), 0 to be asked again */
+    int (*detach)(struct reactor *r, struct connection *c);
+};
+
+extern const struct io_backend epoll_backend;
+extern const struct io_backend uring_backend;
+
+/**
+ * Slow-consumer policy, in bytes of queued output per connection
+ * Above out_high the connection is congested: queued droppable frames are
+ * dropped, new ones are discarded (none are sent yet, see
+ * conn_send_droppable_frame()), and the epoll backend stops reading its
+ * requests. Below out_low it recovers. Above out_max (0 = never) it is closed.
+ */
+struct conn_limits
+{
+    size_t out_low;
+    size_t out_high;
+    size_t out_max;
+};
+
+/**
+ * Session timeouts per state, in milliseconds (0 = never)
+ * Before logging in, a client has login_ms from connecting (or logging out).
+ * Once logged in, after idle_ms without receiving anything it is sent a PING
+ * (binary protocol) and is closed if nothing arrives within pong_ms; with
+ * pong_ms 0 it is closed after idle_ms without a PING.
+ */
+struct conn_timeouts
+{
+    unsigned login_ms;
+    unsigned idle_ms;
+    unsigned pong_ms;
+};
+
+/**
+ * Fairness budget: most a connection gets dispatched per loop iteration (0 =
+ * no limit). A connection that uses it up with more input pending stops being
+ * read and goes to the back of the reactor's ready queue, which is served
+ * round-robin on the following iterations, so one flooding client cannot
+ * starve the others sharing its loop.
+ */
+struct conn_budget
+{
+    size_t bytes;
+    unsigned requests;
+};
+
+/**
+ * One event loop; each runs on its own thread and shares nothing with the others
+ */
+struct reactor
+{
+    int id;
+    pthread_t thread; /* Thread running the loop */
+    int paused;       /* Park at the end of the current iteration */
+    int listen_fd;
+    int unix_fd;      /* AF_UNIX listener shared by every reactor, -1 if none */
+    int spare_fd;     /* Held in reserve to accept and turn away a client when out of descriptors */
+    size_t max_conns; /* Admission limit on the connections of all reactors, 0 = none */
+    size_t rejected;  /* Clients turned away */
+    const struct conn_handlers *handlers;
+    struct conn_limits limits;
+    struct conn_timeouts timeouts;
+    struct conn_budget budget;
+    size_t xfer_rate;          /* File transfer bytes per second each way per connection, 0 = no cap */
+    unsigned turn;             /* Loop iterations so far */
+    struct timer_wheel timers; /* Every connection's timeout, one timer each */
+    uint64_t now_ms;           /* Monotonic clock, read once per loop iteration */
+    struct connection *conns; /* All live connections */
+    size_t n_conns;
+    struct connection *dirty; /* Connections with output queued this iteration */
+    struct connection *ready; /* Connections out of budget with input left, oldest first */
+    struct connection **ready_tail;
+    struct connection *online[ONLINE_BUCKETS]; /* Logged-in connections by user_id */
+    struct reactor_call *mailbox; /* Posted by other threads, newest first */
+    int wake_fd;                  /* eventfd the backend watches for the mailbox and the shard queues */
+
+    struct reactor *shards;         /* Every reactor, by id, see shard.h */
+    int n_shards;
+    struct shard_queue **inbox;     /* Calls from each other reactor */
+    struct shard_queue **outbox;    /* Calls to each other reactor */
+    int outbox_pending;             /* Calls sent to other reactors and not announced yet */
+    struct connection *migrating;   /* Waiting to move to another reactor */
+
+    struct connection *free_conns; /* Unused connection slots, from slabs of CONN_SLAB */
+    char *input_pool;              /* Receive buffers of idle connections, chained through their first bytes */
+    unsigned input_pooled;
+
+    const struct io_backend *io;
+    int epfd;       /* epoll backend */
+    int pipe_fds[2]; /* epoll backend: uploads are spliced through it */
+    void *io_state; /* Backend private data */
+};
+
+/**
+ * Set up the backend and start listening on the (non-blocking) listening
+ * socket and, unless unix_fd is -1, on the local one too
+ * Returns: 0 on success, -1 on error
+ */
+int reactor_init(struct reactor *r, int listen_fd, int unix_fd, const struct conn_handlers *handlers,
+                 const struct io_backend *io);
+
+/**
+ * Run the event loop forever
+ */
+void reactor_run(struct reactor *r);
+
+/**
+ * Stop every reactor at the end of its current loop iteration and wait until
+ * all of them are parked; their state can then be read from this thread
+ * (hot upgrade). REACTOR_WAKE_SIGNAL must have a handler installed without
+ * SA_RESTART, and each reactor's thread must be set.
+ */
+void reactor_pause(struct reactor *reactors, int n);
+
+/**
+ * Let paused reactors continue
+ */
+void reactor_resume(struct reactor *reactors, int n);
+
+/**
+ * Queue data to a client
+ * Nothing is written right away: every reply queued while handling one batch
+ * of input goes out together in a single write at the end of the iteration
+ * Returns: len on success, -1 on error (connection is then closed by the loop)
+ */
+int conn_send(struct connection *conn, const void *data, size_t len);
+
+/**
+ * Queue one frame (header and payload) to a client
+ * Returns: same as conn_send; -1 without closing the connection if the
+ * payload is over the client's max_frame
+ */
+int conn_send_frame(struct connection *conn, uint16_t type, const void *payload, uint32_t len);
+
+/**
+ * Queue one frame whose payload is gathered from several pieces (e.g. a count
+ * followed by the entries it counts), without joining them first
+ * Returns: same as conn_send
+ */
+int conn_send_framev(struct connection *conn, uint16_t type, const struct iovec *iov, int iovcnt);
+
+/**
+ * Queue a frame that may be dropped if the client is not keeping up
+ * Not wired up yet: it is meant for USER_STATUS_UPDATE presence updates,
+ * which the server does not send (it keeps no friend lists to send them to),
+ * so today no frame is ever queued droppable and the slow-consumer policy
+ * only ever disconnects
+ * Returns: same as conn_send; 0 if it was discarded
+ */
+int conn_send_droppable_frame(struct connection *conn, uint16_t type, const void *payload, uint32_t len);
+
+/**
+ * Queue a shared, already serialised message; the queue keeps a reference
+ * instead of copying it, so one buffer can fan out to many connections
+ * Returns: same as conn_send_frame
+ */
+int conn_send_shared(struct connection *conn, struct msg_buf *mb);
+
+/**
+ * Send len bytes of a file from off as frames of type, one piece of at most
+ * max_frame each; the connection takes over fd and closes it when done. A
+ * download already going on is stopped first
+ * Returns: 0 on success, -1 if the connection is dead
+ */
+int conn_send_file(struct connection *conn, uint16_t type, int fd, uint64_t off, uint64_t len);
+
+/**
+ * Stop the download going on, if any; pieces already queued still go out
+ */
+void conn_stop_file(struct connection *conn);
+
+/**
+ * Run call on the connection's reactor once its queued output is below
+ * XFER_AHEAD, so a sender of many frames goes at the pace the client reads
+ * them instead of filling the queue up to out_max. Also run, without
+ * waiting, when the connection is destroyed or moves to another reactor.
+ * Any number of calls may wait; each runs once
+ */
+void conn_wait_drain(struct connection *conn, struct reactor_call *call);
+
+/**
+ * Take the next len bytes of input, which follow the frame being handled,
+ * as a body to write into fd (-1: discard them); frames are decoded again
+ * once it is in, and on_file_received() reports how it went
+ */
+void conn_receive_file(struct connection *conn, int fd, uint64_t len);
+
+/**
+ * Keep a connection while another thread prepares its reply: its next
+ * requests wait (input stays buffered and the epoll backend stops reading),
+ * and if it is closed meanwhile its memory stays valid until released
+ */
+void conn_hold(struct connection *conn);
+
+/**
+ * Drop a hold, on the owner reactor's thread; the last one frees a closed
+ * connection or resumes dispatching the input that waited
+ */
+void conn_release(struct connection *conn);
+
+/**
+ * Run call->fn on r's thread soon; callable from any thread (lock-free)
+ */
+void reactor_post(struct reactor *r, struct reactor_call *call);
+
+/**
+ * Run the calls posted to r so far, in posting order, and those the other
+ * reactors sent it (shard_send()); its backend does this when wake_fd fires,
+ * or the thread that paused r with reactor_pause()
+ * Returns: number of calls run
+ */
+int reactor_run_mailbox(struct reactor *r);
+
+/**
+ * Enter or leave the logged-in state, which switches the connection from its
+ * login deadline to idle heartbeats or back
+ */
+void conn_set_logged_in(struct connection *conn, int logged_in);
+
+/**
+ * Index a logged-in connection by user_id, so messages for that user can be
+ * delivered to it (a user may be logged in on several connections)
+ */
+void reactor_set_online(struct reactor *r, struct connection *c);
+
+/* Remove the connection from the index; safe if it is not there */
+void reactor_set_offline(struct reactor *r, struct connection *c);
+
+/**
+ * Move a connection to another reactor (its user's home shard): once its
+ * requests in flight are done, it leaves this one at
+ * the end of an iteration and carries on there with its buffered input.
+ * Nothing is dispatched meanwhile. No-op if to is already its owner
+ */
+void conn_migrate(struct connection *c, struct reactor *to);
+
+/**
+ * Iterate over this reactor's connections logged in as user_id
+ * Returns: the next one after prev (NULL: start), NULL when there are no more
+ */
+struct connection *reactor_find_user(struct reactor *r, int user_id, struct connection *prev);
+
+/**
+ * Backend interface to the connection core
+ */
+
+/* Adopt an accepted socket, greet the client. Returns NULL on error */
+struct connection *conn_open(struct reactor *r, int fd, const struct sockaddr *peer);
+
+/* Admission control for an accepted socket: open it, or tell the client the
+ * server is busy and close it when the reactors together are at max_conns
+ * (sessions moving to their home shard are already counted) */
+void reactor_admit(struct reactor *r, int fd, const struct sockaddr *peer);
+
+/* Handle an accept() failure; out of descriptors, one pending client is
+ * accepted on the spare descriptor and turned away so it does not wait in
+ * the backlog. Returns: 1 if accepting may go on, 0 to stop for now */
+int reactor_accept_failed(struct reactor *r, int listen_fd, int err);
+
+/* Adopt a socket without greeting it (handed over from another process). Returns NULL on error */
+struct connection *conn_attach(struct reactor *r, int fd, const char *addr);
+
+/* Contiguous free space in the input ring, which takes a buffer from the
+ * reactor's pool if it had none; *space receives its size
+ * Returns NULL while the ring is full of requests waiting for a budget turn
+ * or a release: the backend must stop receiving until resume(); also NULL
+ * when out of memory (the connection is then dead) */
+char *conn_recv_space(struct connection *c, size_t *space);
+
+/* Account n body bytes the backend moved into xfer.sink_fd itself, see
+ * struct conn_xfer; the connection is held while over its rate */
+void conn_sunk(struct reactor *r, struct connection *c, size_t n);
+
+/* Account n bytes written into conn_recv_space() and dispatch complete
+ * requests, within the connection's budget (it is is_ready when cut off) */
+void conn_received(struct reactor *r, struct connection *c, size_t n);
+
+/* Nothing more to receive for now: an empty input ring gives its buffer
+ * back to the pool, so an idle connection holds none */
+void conn_trim(struct connection *c);
+
+/* Queue the connection to have its buffered input dispatched on a later
+ * iteration (adopted connections, budget stops); safe if already queued */
+void conn_defer(struct reactor *r, struct connection *c);
+
+/* Drop n bytes the kernel accepted from the output queue
+ * Returns: 1 if this ended congestion (reading may resume), 0 otherwise */
+int conn_sent(struct connection *c, size_t n);
+
+/* Unlink, close and free; the backend must hold no more references */
+void conn_destroy(struct reactor *r, struct connection *c);
+
+/* Start of a loop iteration: read the clock, run the timers that are due and
+ * give the connections queued on the ready list a new budget */
+void reactor_tick(struct reactor *r);
+
+/* How long the backend may wait for events before calling reactor_tick(), in ms
+ * (-1 = forever, 0 while connections are waiting on the ready list) */
+int reactor_timeout(struct reactor *r);
+
+/* The backend saw wake_fd readable: reset it and run the mailbox */
+void reactor_wake(struct reactor *r);
+
+/* End of a loop iteration: flush every connection with queued output once,
+ * send off the connections moving away, wake the reactors sent calls, then
+ * park if reactor_pause() asked to */
+void reactor_flush_pending(struct reactor *r);
+
+#endif // REACTOR_H
@@ -0,0 +1,173 @@
+#include "ring_buffer.h"
+#include "delim_scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RB_SCAN_BATCH 64
+
+/**
+ * Allocate ring storage plus an equally sized spill area used by rb_peek()
+ * @param rb: Ring to initialise
+ * @param cap: Requested capacity, rounded up to a power of two
+ * @return: 0 on success, -1 on allocation failure
+ */
+int rb_init(struct ring_buffer *rb, size_t cap)
+{
+    size_t size = 1;
+    while (size < cap)
+        size <<= 1;
+
+    rb->data = malloc(2 * size);
+    if (rb->data == NULL)
+        return -1;
+    rb->cap = size;
+    rb->head = 0;
+    rb->tail = 0;
+    return 0;
+}
+
+void rb_init_lazy(struct ring_buffer *rb, size_t cap)
+{
+    size_t size = 1;
+    while (size < cap)
+        size <<= 1;
+
+    rb->data = NULL;
+    rb->cap = size;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+size_t rb_storage_size(const struct ring_buffer *rb)
+{
+    return 2 * rb->cap;
+}
+
+void rb_attach(struct ring_buffer *rb, char *data)
+{
+    rb->data = data;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+char *rb_detach(struct ring_buffer *rb)
+{
+    char *data = rb->data;
+    if (data == NULL || rb_used(rb) > 0)
+        return NULL;
+    rb->data = NULL;
+    rb->head = 0;
+    rb->tail = 0;
+    return data;
+}
+
+void rb_free(struct ring_buffer *rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+    rb->cap = 0;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+/**
+ * Contiguous free region: from tail up to either the end of the ring or head
+ * @param rb: Ring buffer
+ * @param len: Receives the number of bytes that may be written
+ * @return: Write position
+ */
+char *rb_write_ptr(struct ring_buffer *rb, size_t *len)
+{
+    size_t pos = rb->tail & (rb->cap - 1);
+    size_t free_total = rb->cap - rb_used(rb);
+    size_t to_end = rb->cap - pos;
+
+    *len = free_total < to_end ? free_total : to_end;
+    return rb->data + pos;
+}
+
+void rb_commit(struct ring_buffer *rb, size_t n)
+{
+    rb->tail += n;
+}
+
+/**
+ * Scan the not yet scanned bytes (at most two segments, before and after the
+ * wrap) for '\n' with the vectorised scanner, keeping those preceded by '\r'
+ * The '\r' may sit in the previous segment or in bytes scanned by an earlier call
+ * @param rb: Ring buffer
+ * @param from: In: bytes already scanned; out: bytes scanned now
+ * @param offs: Receives the offsets of '\r' relative to the read position
+ * @param max: Capacity of offs
+ * @return: Number of delimiters found
+ */
+size_t rb_scan_crlf(const struct ring_buffer *rb, size_t *from, size_t *offs, size_t max)
+{
+    size_t used = rb_used(rb);
+    size_t off = *from;
+    size_t n = 0;
+
+    while (off < used && n < max)
+    {
+        size_t pos = (rb->head + off) & (rb->cap - 1);
+        size_t seg = rb->cap - pos;
+        if (seg > used - off)
+            seg = used - off;
+
+        size_t newlines[RB_SCAN_BATCH];
+        size_t want = max - n < RB_SCAN_BATCH ? max - n : RB_SCAN_BATCH;
+        size_t scanned;
+        size_t found = scan_newlines(rb->data + pos, seg, newlines, want, &scanned);
+
+        for (size_t i = 0; i < found; i++)
+        {
+            size_t nl = off + newlines[i];
+            if (nl > 0 && rb_at(rb, nl - 1) == '\r')
+                offs[n++] = nl - 1;
+        }
+        off += scanned;
+    }
+
+    *from = off;
+    return n;
+}
+
+long rb_find_crlf(const struct ring_buffer *rb, size_t from)
+{
+    size_t off;
+    return rb_scan_crlf(rb, &from, &off, 1) == 1 ? (long)off : -1;
+}
+
+/**
+ * Contiguous view of the next len bytes
+ * @param rb: Ring buffer
+ * @param len: Number of bytes to view, at most rb_used()
+ * @return: Pointer to the bytes, writable until rb_consume()
+ */
+char *rb_peek(struct ring_buffer *rb, size_t len)
+{
+    size_t pos = rb->head & (rb->cap - 1);
+
+    if (pos + len > rb->cap)
+    {
+        /* Wrapped: append the part at the start of the ring to the spill space */
+        memcpy(rb->data + rb->cap, rb->data, pos + len - rb->cap);
+    }
+    return rb->data + pos;
+}
+
+/**
+ * Advance the read position; an emptied ring restarts at offset 0 so that the
+ * next message is less likely to wrap
+ * @param rb: Ring buffer
+ * @param n: Number of bytes consumed
+ */
+void rb_consume(struct ring_buffer *rb, size_t n)
+{
+    rb->head += n;
+    if (rb->head == rb->tail)
+    {
+        rb->head = 0;
+        rb->tail = 0;
+    }
+}
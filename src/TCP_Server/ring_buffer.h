@@ -0,0 +1,109 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stddef.h>
+
+/**
+ * Byte ring used as a per-connection receive buffer
+ * recv() writes straight into the free region and parsers read messages in
+ * place; consuming a message only advances head, nothing is shifted.
+ * head/tail are free-running counters, masked with cap - 1 on access.
+ */
+struct ring_buffer
+{
+    char *data;  /* cap bytes of ring followed by cap bytes of spill space */
+    size_t cap;  /* Power of two */
+    size_t head; /* Next byte to read */
+    size_t tail; /* Next byte to write */
+};
+
+/**
+ * Allocate the storage (cap is rounded up to a power of two)
+ * Returns: 0 on success, -1 on error
+ */
+int rb_init(struct ring_buffer *rb, size_t cap);
+
+/**
+ * Set up a ring of capacity cap (rounded up to a power of two) without
+ * storage yet; rb_attach() provides it before the first write
+ */
+void rb_init_lazy(struct ring_buffer *rb, size_t cap);
+
+/**
+ * Bytes of storage the ring needs: the ring and its spill space
+ */
+size_t rb_storage_size(const struct ring_buffer *rb);
+
+/**
+ * Give a ring set up with rb_init_lazy() rb_storage_size() bytes of storage
+ */
+void rb_attach(struct ring_buffer *rb, char *data);
+
+/**
+ * Take the storage back from an empty ring, so it can serve another one
+ * while this one is idle
+ * Returns: the storage, NULL if the ring has unread bytes or no storage
+ */
+char *rb_detach(struct ring_buffer *rb);
+
+/**
+ * Release the storage
+ */
+void rb_free(struct ring_buffer *rb);
+
+/**
+ * Number of unread bytes
+ */
+static inline size_t rb_used(const struct ring_buffer *rb)
+{
+    return rb->tail - rb->head;
+}
+
+/**
+ * Contiguous free space at the write position
+ * Returns: pointer to write to, *len receives its size (0 when full)
+ */
+char *rb_write_ptr(struct ring_buffer *rb, size_t *len);
+
+/**
+ * Mark n bytes written at rb_write_ptr() as readable
+ */
+void rb_commit(struct ring_buffer *rb, size_t n);
+
+/**
+ * Byte at offset off from the read position (off < rb_used())
+ */
+static inline char rb_at(const struct ring_buffer *rb, size_t off)
+{
+    return rb->data[(rb->head + off) & (rb->cap - 1)];
+}
+
+/**
+ * Resumable search for every "\r\n" in the unread bytes
+ * *from is the number of bytes (from the read position) already scanned by
+ * earlier calls; only bytes past it are examined and it is advanced to the
+ * end of what was scanned. Keep it across reads and subtract what is consumed.
+ * Returns: number of delimiters found (at most max), their '\r' offsets from
+ * the read position in offs
+ */
+size_t rb_scan_crlf(const struct ring_buffer *rb, size_t *from, size_t *offs, size_t max);
+
+/**
+ * Find the first "\r\n" in the unread bytes, starting the search at offset from
+ * Returns: offset of '\r' from the read position, -1 if not found
+ */
+long rb_find_crlf(const struct ring_buffer *rb, size_t from);
+
+/**
+ * View the first len unread bytes as one contiguous block (len <= rb_used())
+ * Only when the block wraps around the end of the ring is the wrapped part
+ * copied into the spill space behind it; the view is valid until rb_consume()
+ */
+char *rb_peek(struct ring_buffer *rb, size_t len);
+
+/**
+ * Drop n bytes from the read position
+ */
+void rb_consume(struct ring_buffer *rb, size_t n);
+
+#endif // RING_BUFFER_H
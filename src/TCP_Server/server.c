@@ -8,140 +8,517 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <signal.h>
 #include <errno.h>
-#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "tcp_utils.h"
+#include "reactor.h"
+#include "handover.h"
+#include "frame.h"
+#include "msg_buf.h"
+#include "chat_db.h"
+#include "db_async.h"
+#include "shard.h"
+#include "hash.h"
 
 #define ACCOUNT_FILE_PATH "account.txt"
-#define BACKLOG 10
+#define DEFAULT_BACKLOG 128
 #define SERVER_IP_ADDR "127.0.0.1"
 #define LOG_FILE "log_20225610.txt"
 #define BYE_REQUEST "BYE"
 #define USER_REQUEST "USER"
 #define POST_REQUEST "POST"
 #define RESPONSE_SIZE (1 << 10)
-
-/* Handler process signal*/
-void sig_chld(int signo);
+#define MAX_REACTORS 64
+#define MAX_DB_WORKERS 64
 
 /* Check username in account file */
 int check_username(char *username);
 
 /* Process client request */
-void process_request(int sock, char *request, int *is_logined);
+void process_request(struct connection *conn, char *request);
+
+/* Process binary protocol frame */
+void process_frame(struct connection *conn, const struct frame *frame);
+
+/* Send a RESPONSE (2000) frame with payload "status|text" */
+void send_response(struct connection *conn, int status, const char *text);
+
+/* Upload body of a FILE_DATA written into its file */
+void file_received(struct connection *conn, int err);
+
+#define DEFAULT_MAX_MESSAGE 4 /* MiB, see -M; no more than DEFAULT_OUT_MAX */
+
+/* -M: longest direct message sent in chunks, bytes */
+static uint64_t max_message_bytes = (uint64_t)DEFAULT_MAX_MESSAGE << 20;
+
+/* Storage directory (second argument) files are uploaded into, -1 = none */
+static int storage_fd = -1;
+
+/* -m: seconds between printouts of the per-command counters; 0 = commands are not timed */
+static int stats_interval = 0;
+
+static const struct conn_handlers chat_handlers = {
+    .on_request = process_request,
+    .on_frame = process_frame,
+    .on_file_received = file_received,
+};
+
+/* Create, bind and listen on a TCP socket for the given port */
+int open_listener(int port, int reuse_port, int backlog);
+
+/* Create, bind and listen on a Unix stream socket at path */
+int open_unix_listener(const char *path, int backlog);
+
+/* Thread entry point running one reactor */
+void *reactor_thread(void *arg);
+
+/* Reactors of this process, for the hot upgrade thread */
+struct server_state
+{
+    struct reactor *reactors;
+    int n_reactors;
+    int control_sock;
+};
+
+/* Thread entry point handing the server over to new processes that connect */
+void *handover_thread(void *arg);
+
+/* Thread entry point printing the per-command counters (-m) */
+void *stats_thread(void *arg);
+
+/* REACTOR_WAKE_SIGNAL handler: only there to interrupt a reactor's wait */
+static void on_wake_signal(int sig)
+{
+    (void)sig;
+}
 
 /*
- * Receive and echo message to client
- * [IN] sockfd: socket descriptor that connects to client
+ * Accept clients and serve them from one or more epoll event loops
+ * With -t N, each of the N reactors owns a SO_REUSEPORT listener and the
+ * kernel spreads incoming connections across them; on login a session moves
+ * to its user's home reactor (user_id mod N), and messages for users homed
+ * elsewhere are passed over lock-free queues between reactors
+ * -b selects the transport: readiness-based epoll (default) or io_uring
+ * -q LOW:HIGH:MAX sets the per-connection output watermarks in KiB (MAX 0 =
+ * never disconnect a slow consumer)
+ * -k LOGIN:IDLE:PONG sets the session timeouts in seconds (0 = never)
+ * -w N runs the database on N storage worker threads, so no reactor ever
+ * waits on it
+ * -f BYTES:REQUESTS sets the fairness budget, how much of one client's input
+ * (KiB, requests) is handled per loop iteration before the others get a turn
+ * (0 = no limit)
+ * -a BACKLOG:MAX sets the listen() backlog and the most clients served at
+ * once (0 = no limit); clients over the limit are told the server is busy
+ * -m SECONDS times every command on the reactors and prints the counts and
+ * latencies per command every SECONDS, with the ratio and CPU time of the
+ * compression of large responses for clients that chose compress=deflate
+ * -M MIB caps a direct message sent in chunks (SEND_MESSAGE_CHUNK), at most
+ * the -q maximum; chunks are stored and relayed as they come, each once the
+ * receiver has read the last, so its size does not matter to memory
+ * -F KIB caps file transfers at KIB KiB/s each way per connection (0 = no
+ * cap), so a download or upload leaves room for the chat on the same socket
+ * With a storage directory after the port (created if missing), logged-in
+ * clients may upload files into it and download them again, resuming either
+ * from an offset; without one file transfers are refused. Each content is
+ * stored once, under its SHA-256 in objects/, however many names refer to it
+ * -U PATH also accepts clients on a Unix stream socket at PATH; they speak the
+ * same protocols and count against the same limit as TCP clients
+ * -H PATH accepts hot upgrades on a Unix socket: a new server started with
+ * -u PATH takes over the listening sockets and every client session, and this
+ * one exits without dropping anyone (epoll backend only)
  */
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    int n_reactors = 1;
+    int n_workers = DEFAULT_DB_WORKERS;
+    const struct io_backend *io = &epoll_backend;
+    struct conn_limits limits = {DEFAULT_OUT_LOW, DEFAULT_OUT_HIGH, DEFAULT_OUT_MAX};
+    struct conn_timeouts timeouts = {DEFAULT_LOGIN_TIMEOUT * 1000, DEFAULT_IDLE_TIMEOUT * 1000,
+                                     DEFAULT_PONG_TIMEOUT * 1000};
+    struct conn_budget budget = {DEFAULT_BUDGET_BYTES, DEFAULT_BUDGET_REQUESTS};
+    size_t xfer_rate = DEFAULT_XFER_RATE;
+    int backlog = DEFAULT_BACKLOG;
+    long max_conns = 0;
+    const char *handover_path = NULL; /* -H */
+    const char *takeover_path = NULL; /* -u */
+    const char *unix_path = NULL;     /* -U */
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:b:q:k:f:a:m:M:F:H:u:U:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            n_reactors = atoi(optarg);
+            break;
+        case 'w':
+            n_workers = atoi(optarg);
+            break;
+        case 'b':
+            if (strcmp(optarg, "uring") == 0)
+                io = &uring_backend;
+            else if (strcmp(optarg, "epoll") != 0)
+                n_reactors = 0;
+            break;
+        case 'q':
+        {
+            unsigned long low, high, max;
+            if (sscanf(optarg, "%lu:%lu:%lu", &low, &high, &max) != 3 || low > high ||
+                (max != 0 && max < high))
+                n_reactors = 0;
+            limits.out_low = low << 10;
+            limits.out_high = high << 10;
+            limits.out_max = max << 10;
+            break;
+        }
+        case 'k':
+        {
+            unsigned login, idle, pong;
+            if (sscanf(optarg, "%u:%u:%u", &login, &idle, &pong) != 3 ||
+                login > 86400 || idle > 86400 || pong > 86400)
+                n_reactors = 0;
+            timeouts.login_ms = login * 1000;
+            timeouts.idle_ms = idle * 1000;
+            timeouts.pong_ms = pong * 1000;
+            break;
+        }
+        case 'f':
+        {
+            unsigned long bytes;
+            unsigned requests;
+            if (sscanf(optarg, "%lu:%u", &bytes, &requests) != 2 || bytes > (1UL << 20))
+                n_reactors = 0;
+            budget.bytes = bytes << 10;
+            budget.requests = requests;
+            break;
+        }
+        case 'a':
+            if (sscanf(optarg, "%d:%ld", &backlog, &max_conns) != 2 || backlog < 1 || max_conns < 0)
+                n_reactors = 0;
+            break;
+        case 'm':
+            stats_interval = atoi(optarg);
+            if (stats_interval < 1)
+                n_reactors = 0;
+            break;
+        case 'M':
+        {
+            unsigned long mib;
+            if (sscanf(optarg, "%lu", &mib) != 1 || mib < 1 || mib > 1024)
+                n_reactors = 0;
+            max_message_bytes = (uint64_t)mib << 20;
+            break;
+        }
+        case 'F':
+        {
+            unsigned long kib;
+            if (sscanf(optarg, "%lu", &kib) != 1 || kib > (1UL << 30))
+                n_reactors = 0;
+            xfer_rate = (size_t)kib << 10;
+            break;
+        }
+        case 'H':
+            handover_path = optarg;
+            break;
+        case 'u':
+            takeover_path = optarg;
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        default:
+            n_reactors = 0;
+            break;
+        }
+    }
+    if (handover_path != NULL && io != &epoll_backend)
+        n_reactors = 0;
+    /* A message must fit in what a receiver may have queued */
+    if (limits.out_max != 0 && max_message_bytes > limits.out_max)
+        n_reactors = 0;
+    if (argc - optind < 1 || argc - optind > 2 || n_reactors < 1 || n_reactors > MAX_REACTORS || n_workers < 1 ||
+        n_workers > MAX_DB_WORKERS)
     {
         printf("Invalid Arguments!!!\n");
-        printf("Usage: ./server Port_Number\n");
+        printf("Usage: ./server [-t Reactor_Threads(1-%d)] [-w Storage_Threads(1-%d)] [-b epoll|uring] [-q Low:High:Max(KiB)] [-k Login:Idle:Pong(s)] [-f Bytes(KiB):Requests] [-a Backlog:Max_Clients] [-m Stats_Interval(s)] [-M Max_Message(MiB)] [-F Transfer_Rate(KiB/s)] [-H Handover_Socket] [-u Takeover_Socket] [-U Unix_Socket] Port_Number [Storage_Dir]\n",
+               MAX_REACTORS, MAX_DB_WORKERS);
         return 0;
     }
-    int server_port = atoi(argv[1]);
+    int server_port = atoi(argv[optind]);
+    const char *storage_dir = argc - optind == 2 ? argv[optind + 1] : NULL;
 
-    int listen_sock, conn_sock; /* file descriptors */
-    pid_t pid;
-    struct sockaddr_in server_addr; /* server's address information */
-    struct sockaddr_in client_addr; /* client's address information */
-    socklen_t sin_size;
+    struct reactor *reactors = calloc(n_reactors, sizeof(struct reactor));
+    struct handover_in takeover;
+    int inherited[HANDOVER_MAX_LISTENERS + 1];
+    int n_inherited = 0;
+    int unix_sock = -1;
+    pthread_t tid;
 
-    if ((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    if (reactors == NULL)
     {
         perror("\nError: ");
         exit(EXIT_FAILURE);
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); /* INADDR_ANY puts your IP address automatically */
+    /* A peer closing mid-write is reported through send(), not a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction wake;
+    memset(&wake, 0, sizeof(wake));
+    wake.sa_handler = on_wake_signal; /* No SA_RESTART: waits must return EINTR */
+    sigaction(REACTOR_WAKE_SIGNAL, &wake, NULL);
+
+    /* The old process keeps serving until we have taken everything over */
+    if (takeover_path != NULL &&
+        (n_inherited = handover_begin(&takeover, takeover_path, inherited, HANDOVER_MAX_LISTENERS)) == -1)
+    {
+        perror("\nError: ");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = n_reactors; i < n_inherited; i++)
+        close(inherited[i]);
+
+    /* An inherited local listener keeps its path; without -U it is dropped */
+    if (takeover_path != NULL && takeover.unix_fd != -1)
+    {
+        if (unix_path != NULL)
+            unix_sock = takeover.unix_fd;
+        else
+            close(takeover.unix_fd);
+    }
+    if (unix_path != NULL && unix_sock == -1 && (unix_sock = open_unix_listener(unix_path, backlog)) == -1)
+    {
+        perror("\nError: ");
+        exit(EXIT_FAILURE);
+    }
 
-    if (bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    for (int i = 0; i < n_reactors; i++)
+    {
+        /* SO_REUSEPORT also lets a successor with more reactors bind next to these */
+        int listen_sock = i < n_inherited ? inherited[i]
+                                          : open_listener(server_port, n_reactors > 1 || handover_path != NULL, backlog);
+        if (listen_sock == -1 || reactor_init(&reactors[i], listen_sock, unix_sock, &chat_handlers, io) == -1)
+        {
+            perror("\nError: ");
+            exit(EXIT_FAILURE);
+        }
+        reactors[i].id = i;
+        reactors[i].limits = limits;
+        reactors[i].timeouts = timeouts;
+        reactors[i].budget = budget;
+        reactors[i].xfer_rate = xfer_rate;
+        /* One limit over all reactors: logged-in sessions gather on their home shards */
+        reactors[i].max_conns = max_conns;
+    }
+    if (shard_link(reactors, n_reactors) == -1)
     {
         perror("\nError: ");
         exit(EXIT_FAILURE);
     }
 
-    if (listen(listen_sock, BACKLOG) == -1)
+    if (takeover_path != NULL)
+    {
+        int adopted = handover_finish(&takeover, reactors, n_reactors);
+        if (adopted == -1)
+            exit(EXIT_FAILURE);
+        printf("Took over %d connection(s) from %s\n", adopted, takeover_path);
+    }
+
+    if (storage_dir != NULL &&
+        ((mkdir(storage_dir, 0755) == -1 && errno != EEXIST) ||
+         (storage_fd = open(storage_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1))
     {
         perror("\nError: ");
         exit(EXIT_FAILURE);
     }
 
-    /* Establish a signal handler to catch SIGCHLD */
-    signal(SIGCHLD, sig_chld);
+    if (db_async_start(n_workers) == -1)
+    {
+        fprintf(stderr, "Failed to start the storage workers\n");
+        exit(EXIT_FAILURE);
+    }
 
-    printf("Server started at port number %d\n", server_port);
+    printf("Server started at port number %d with %d %s reactor(s), %d storage worker(s)\n", server_port,
+           n_reactors, io->name, n_workers);
+    if (unix_path != NULL)
+        printf("Also listening on %s\n", unix_path);
+    if (storage_dir != NULL)
+        printf("Storing files in %s\n", storage_dir);
 
-    while (1)
+    /* The main thread runs the first reactor itself */
+    reactors[0].thread = pthread_self();
+    for (int i = 1; i < n_reactors; i++)
     {
+        if (pthread_create(&tid, NULL, reactor_thread, &reactors[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start reactor %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+        reactors[i].thread = tid;
+        pthread_detach(tid);
+    }
 
-        sin_size = sizeof(struct sockaddr_in);
-        if ((conn_sock = accept(listen_sock, (struct sockaddr *)&client_addr, &sin_size)) == -1)
+    if (handover_path != NULL)
+    {
+        static struct server_state state;
+        state.reactors = reactors;
+        state.n_reactors = n_reactors;
+        state.control_sock = handover_listen(handover_path);
+        if (state.control_sock == -1 || pthread_create(&tid, NULL, handover_thread, &state) != 0)
         {
-            if (errno == EINTR)
-                continue;
-            else
-            {
-                perror("\nError: ");
-                exit(EXIT_FAILURE);
-            }
+            perror("\nError: ");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+    if (stats_interval > 0)
+    {
+        static int n_timed;
+        n_timed = n_reactors;
+        if (pthread_create(&tid, NULL, stats_thread, &n_timed) != 0)
+        {
+            perror("\nError: ");
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(tid);
+    }
+    reactor_run(&reactors[0]);
+
+    return 0;
+}
+
+/*
+@brief Open a non-blocking listening socket on INADDR_ANY:port
+
+@param reuse_port: set SO_REUSEPORT so several reactors can bind the same port
+@param backlog: completed connections the kernel queues until they are accepted
+
+@return the listening socket, or -1 on error (errno is set)
+*/
+int open_listener(int port, int reuse_port, int backlog)
+{
+    int listen_sock;
+    int on = 1;
+    struct sockaddr_in server_addr; /* server's address information */
+
+    if ((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    if (reuse_port && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+    {
+        close(listen_sock);
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); /* INADDR_ANY puts your IP address automatically */
+
+    /* accept() must not block the loop when a client resets before we get to it */
+    if (bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+        listen(listen_sock, backlog) == -1 ||
+        set_nonblocking(listen_sock) == -1)
+    {
+        close(listen_sock);
+        return -1;
+    }
+    return listen_sock;
+}
+
+/*
+@brief Open a non-blocking listening socket on a Unix stream socket
+
+@param path: filesystem path of the socket; a stale one left by a previous run is replaced
+@param backlog: completed connections the kernel queues until they are accepted
+
+@return the listening socket, or -1 on error (errno is set)
+*/
+int open_unix_listener(const char *path, int backlog)
+{
+    int listen_sock;
+    struct sockaddr_un server_addr;
+
+    if (strlen(path) >= sizeof(server_addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((listen_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strcpy(server_addr.sun_path, path);
+
+    unlink(path);
+    if (bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+        listen(listen_sock, backlog) == -1 ||
+        set_nonblocking(listen_sock) == -1)
+    {
+        close(listen_sock);
+        return -1;
+    }
+    return listen_sock;
+}
 
-        /* For each client, fork spawns a child, and the child handles the new client */
-        pid = fork();
+void *reactor_thread(void *arg)
+{
+    reactor_run((struct reactor *)arg);
+    return NULL;
+}
+
+/*
+@brief Wait for a new server process on the control socket and hand everything to it
 
-        /* fork() is called in child process */
-        if (pid == 0)
+The reactors are paused while their state is sent; this process exits once
+the new one confirms, and carries on serving if the handover fails
+*/
+void *handover_thread(void *arg)
+{
+    struct server_state *state = arg;
+
+    while (1)
+    {
+        int sock = accept(state->control_sock, NULL, NULL);
+        if (sock == -1)
         {
-            int client_port;
-            char client_ip[INET_ADDRSTRLEN];
-            char client_request[BUFF_SIZE];
-            int is_logined = 0;
-            close(listen_sock);
-            if (inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN) == NULL)
-            {
-                perror("inet_ntop error");
-            }
-            else
-            {
-                client_port = ntohs(client_addr.sin_port);
-                printf("Got a connection from %s:%d\n", client_ip, client_port);
-            }
-            send_all(conn_sock, "100-Connected to the server\r\n", strlen("100-Connected to the server\r\n"));
-            while (1)
-            {
-                memset(client_request, 0, BUFF_SIZE);
-                int recv_len = recv_until_delimiter(conn_sock, client_request, BUFF_SIZE);
-                if (recv_len == 0)
-                {
-                    printf("Client %s:%d disconnected\n", client_ip, client_port);
-                    break;
-                }
-                else if (recv_len > 0)
-                {
-                    printf("Recieved from client %s:%d: %s\n", client_ip, client_port, client_request);
-                    process_request(conn_sock, client_request, &is_logined);
-                }
-            }
-            close(conn_sock);
-            exit(0);
+            if (errno != EINTR)
+                perror("accept() error");
+            continue;
         }
 
-        /* The parent closes the connected socket since the child handles the new client */
-        close(conn_sock);
+        printf("New server process connected, handing over\n");
+        reactor_pause(state->reactors, state->n_reactors);
+
+        /* Finish the storage requests in flight and the calls between shards,
+         * so their replies and the sessions in transit are handed over too */
+        int ran;
+        do
+        {
+            db_async_wait_idle();
+            ran = 0;
+            for (int i = 0; i < state->n_reactors; i++)
+                shard_flush(&state->reactors[i]);
+            for (int i = 0; i < state->n_reactors; i++)
+                ran += reactor_run_mailbox(&state->reactors[i]);
+        } while (ran > 0);
+
+        if (handover_send(sock, state->reactors, state->n_reactors) == 0)
+            exit(EXIT_SUCCESS);
+
+        fprintf(stderr, "Handover failed, resuming\n");
+        close(sock);
+        reactor_resume(state->reactors, state->n_reactors);
     }
-    close(listen_sock);
-    return 0;
+    return NULL;
 }
 
 /*
@@ -176,107 +553,2045 @@ int check_username(char *username)
     return temp;
 }
 
-void sig_chld(int signo)
+struct user_job
+{
+    struct db_job job;
+    int status; /* check_username() result */
+    char username[BUFF_SIZE];
+};
+
+static void user_run(struct db_job *job)
+{
+    struct user_job *j = (struct user_job *)job;
+    j->status = check_username(j->username);
+}
+
+/* Reply to USER with the status of the account */
+static void user_done_status(struct connection *conn, int status)
+{
+    char response[RESPONSE_SIZE];
+
+    if (status == 1)
+    {
+        strcpy(response, "110-Logged in successfully\r\n");
+        conn_set_logged_in(conn, 1);
+    }
+    else if (status == 0)
+        strcpy(response, "211-Account is locked\r\n");
+    else
+        strcpy(response, "212-Account does not exist\r\n");
+    conn_send(conn, response, strlen(response));
+}
+
+static void user_done(struct db_job *job, struct connection *conn)
 {
-    pid_t pid;
-    int stat;
+    user_done_status(conn, ((struct user_job *)job)->status);
+}
 
-    /* Wait the child process terminate */
-    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0)
-        printf("Child %d terminated\n", pid);
+/* Separators between the words of a text request */
+#define WORD_SPACE " \t\n\v\f\r"
 
-    (void)signo; // Suppress unused parameter warning
+static int word_is(const char *word, size_t len, const char *name)
+{
+    return strlen(name) == len && memcmp(word, name, len) == 0;
 }
 
-void process_request(int sock, char *request, int *is_logined)
+void process_request(struct connection *conn, char *request)
 {
     char response[RESPONSE_SIZE];
 
     if (strcmp(request, BYE_REQUEST) == 0)
     {
-        if (*is_logined == 1)
+        if (conn->is_logined == 1)
         {
             strcpy(response, "130-Logged out successfully!\r\n");
-            send_all(sock, response, strlen(response));
-            *is_logined = 0;
+            conn_send(conn, response, strlen(response));
+            conn_set_logged_in(conn, 0);
             return;
         }
         else
         {
             strcpy(response, "221-Log out FAILED, you have NOT logged in yet\r\n");
-            send_all(sock, response, strlen(response));
+            conn_send(conn, response, strlen(response));
             return;
         }
     }
     else
     {
-        char type[10];
-        char text[BUFF_SIZE];
-        memset(type, 0, sizeof(type));
-        memset(text, 0, sizeof(text));
-        int scan_result = sscanf(request, "%s %s", type, text);
+        /* "TYPE TEXT": both words stay in the line, text is terminated in place */
+        char *type = request + strspn(request, WORD_SPACE);
+        size_t type_len = strcspn(type, WORD_SPACE);
+        char *text = type + type_len;
+        text += strspn(text, WORD_SPACE);
+        text[strcspn(text, WORD_SPACE)] = '\0';
 
-        if (scan_result == 2)
+        if (type_len > 0 && *text != '\0')
         {
-            if (strcmp(type, USER_REQUEST) == 0)
+            if (word_is(type, type_len, USER_REQUEST))
             {
-                int res = check_username(text);
-                if (*is_logined == 1)
+                if (conn->is_logined == 1)
                 {
                     strcpy(response, "213-Logged in FAILED, you have already logged in\r\n");
-                    send_all(sock, response, strlen(response));
+                    conn_send(conn, response, strlen(response));
                     return;
                 }
                 else
                 {
-                    if (res == 1)
+                    /* The account file is read on a storage worker, never here */
+                    struct user_job *j = db_job_alloc(sizeof(*j));
+                    if (j == NULL)
                     {
-                        strcpy(response, "110-Logged in successfully\r\n");
-                        send_all(sock, response, strlen(response));
-                        *is_logined = 1;
-                        return;
-                    }
-                    else if (res == 0)
-                    {
-                        strcpy(response, "211-Account is locked\r\n");
-                        send_all(sock, response, strlen(response));
-                        return;
-                    }
-                    else
-                    {
-                        strcpy(response, "212-Account does not exist\r\n");
-                        send_all(sock, response, strlen(response));
+                        strcpy(response, "500-Server error, try again later\r\n");
+                        conn_send(conn, response, strlen(response));
                         return;
                     }
+                    j->job.release = NULL;
+                    strcpy(j->username, text);
+                    db_submit(conn, &j->job, user_run, user_done);
+                    return;
                 }
             }
-            else if (strcmp(type, POST_REQUEST) == 0)
+            else if (word_is(type, type_len, POST_REQUEST))
             {
-                if (*is_logined == 1)
+                if (conn->is_logined == 1)
                 {
                     strcpy(response, "120-Post successful\r\n");
-                    send_all(sock, response, strlen(response));
+                    conn_send(conn, response, strlen(response));
                     return;
                 }
                 else
                 {
                     strcpy(response, "221-Post FAILED, you have NOT logged in yet\r\n");
-                    send_all(sock, response, strlen(response));
+                    conn_send(conn, response, strlen(response));
                     return;
                 }
             }
             else
             {
                 strcpy(response, "300-Invalid request\r\n");
-                send_all(sock, response, strlen(response));
+                conn_send(conn, response, strlen(response));
                 return;
             }
         }
         else
         {
             strcpy(response, "300-Invalid request\r\n");
-            send_all(sock, response, strlen(response));
+            conn_send(conn, response, strlen(response));
             return;
         }
     }
-}
\ No newline at end of file
+}
+
+void send_response(struct connection *conn, int status, const char *text)
+{
+    char response[RESPONSE_SIZE];
+    int len = snprintf(response, sizeof(response), "%d|%s", status, text);
+    if (len >= (int)sizeof(response))
+        len = sizeof(response) - 1;
+    conn_send_frame(conn, MSG_RESPONSE, response, len);
+}
+
+/* Compression counters, one row per reactor so each is written by one thread */
+struct compress_stats
+{
+    uint64_t frames;    /* Sent compressed */
+    uint64_t skipped;   /* Tried, but not smaller: sent as they were */
+    uint64_t bytes_in;  /* Payload bytes of both */
+    uint64_t bytes_out; /* What went on the wire for them */
+    uint64_t cpu_ns;    /* Reactor CPU time spent deflating, while -m is on */
+} __attribute__((aligned(64)));
+
+static struct compress_stats compress_stats[MAX_REACTORS];
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+@brief Send a frame that may be large, deflated if the connection chose
+COMPRESS_DEFLATE and it is worth it (see compress.h)
+*/
+static void send_bulk_framev(struct connection *conn, uint16_t type, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if (conn->caps.compress == COMPRESS_DEFLATE && len >= COMPRESS_MIN_SIZE)
+    {
+        if (conn->deflater == NULL)
+            conn->deflater = deflater_new();
+        if (conn->deflater != NULL)
+        {
+            char out[FRAME_MAX_PAYLOAD];
+            uint64_t start = stats_interval ? thread_cpu_ns() : 0;
+            size_t n = deflater_frame(conn->deflater, type, iov, iovcnt, len, out, sizeof(out));
+
+            struct compress_stats *st = &compress_stats[conn->owner->id];
+            if (stats_interval)
+                __atomic_store_n(&st->cpu_ns, st->cpu_ns + thread_cpu_ns() - start, __ATOMIC_RELAXED);
+            __atomic_store_n(&st->bytes_in, st->bytes_in + len, __ATOMIC_RELAXED);
+            if (n > 0)
+            {
+                __atomic_store_n(&st->frames, st->frames + 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&st->bytes_out, st->bytes_out + n, __ATOMIC_RELAXED);
+                conn_send_frame(conn, MSG_COMPRESSED, out, n);
+                return;
+            }
+            __atomic_store_n(&st->skipped, st->skipped + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&st->bytes_out, st->bytes_out + len, __ATOMIC_RELAXED);
+        }
+    }
+    conn_send_framev(conn, type, iov, iovcnt);
+}
+
+/*
+@brief After the last frame of a bulk reply: free its deflate stream (about
+256 KiB), so only connections in the middle of one hold any
+*/
+static void end_bulk_reply(struct connection *conn)
+{
+    deflater_free(conn->deflater);
+    conn->deflater = NULL;
+}
+
+/* Reply sent once a storage request completes, decided on the worker */
+#define REPLY_TEXT_SIZE (32 + USERNAME_SIZE)
+
+struct reply_job
+{
+    struct db_job job;
+    int user_id; /* Caller, copied when the request is submitted */
+    int status;
+    char text[REPLY_TEXT_SIZE];
+};
+
+/* Worker side: set the reply */
+static void job_reply(struct reply_job *j, int status, const char *text)
+{
+    j->status = status;
+    snprintf(j->text, sizeof(j->text), "%s", text);
+}
+
+static void reply_done(struct db_job *job, struct connection *conn)
+{
+    struct reply_job *j = (struct reply_job *)job;
+    send_response(conn, j->status, j->text);
+}
+
+/*
+@brief Take a job for a storage request of conn
+
+@param size: size of the job type, which starts with a struct reply_job
+
+@return the job, NULL if there was none (a response was sent)
+*/
+static void *reply_job_alloc(struct connection *conn, size_t size)
+{
+    struct reply_job *j = db_job_alloc(size);
+    if (j == NULL)
+    {
+        send_response(conn, STATUS_SERVER_ERROR, "Out of memory");
+        return NULL;
+    }
+    j->job.release = NULL;
+    j->user_id = conn->user_id;
+    return j;
+}
+
+struct account_job
+{
+    struct reply_job reply;
+    int user_id; /* Logged in as, on success */
+    char username[USERNAME_SIZE];
+    char password[PASSWORD_SIZE];
+};
+
+static void register_run(struct db_job *job)
+{
+    struct account_job *j = (struct account_job *)job;
+
+    int res = db_register(j->username, j->password, &j->user_id);
+    if (res == DB_OK)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%d", j->user_id);
+        job_reply(&j->reply, STATUS_SUCCESS, text);
+    }
+    else if (res == DB_CONFLICT)
+        job_reply(&j->reply, STATUS_CONFLICT, "Username already exists");
+    else
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+}
+
+static void handle_register(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct field username = field_next(&p, &left);
+    struct field password = field_next(&p, &left);
+
+    if (username.len == 0 || username.len >= USERNAME_SIZE ||
+        password.len == 0 || password.len >= PASSWORD_SIZE)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid username or password");
+        return;
+    }
+
+    struct account_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    field_copy(username, j->username, sizeof(j->username));
+    field_copy(password, j->password, sizeof(j->password));
+    db_submit(conn, &j->reply.job, register_run, reply_done);
+}
+
+static void login_run(struct db_job *job)
+{
+    struct account_job *j = (struct account_job *)job;
+
+    int res = db_login(j->username, j->password, &j->user_id);
+    if (res == DB_OK)
+    {
+        char text[32 + USERNAME_SIZE];
+        snprintf(text, sizeof(text), "%d|%s", j->user_id, j->username);
+        job_reply(&j->reply, STATUS_SUCCESS, text);
+    }
+    else if (res == DB_ERROR)
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+    else
+        job_reply(&j->reply, STATUS_UNAUTHORIZED, "Invalid credentials");
+}
+
+static void login_done(struct db_job *job, struct connection *conn)
+{
+    struct account_job *j = (struct account_job *)job;
+
+    if (j->reply.status == STATUS_SUCCESS)
+    {
+        conn_set_logged_in(conn, 1);
+        conn->user_id = j->user_id;
+        strcpy(conn->username, j->username);
+        reactor_set_online(conn->owner, conn);
+        /* Messages for the user are routed to its home shard: the session moves there */
+        conn_migrate(conn, shard_home(conn->owner, conn->user_id));
+    }
+    send_response(conn, j->reply.status, j->reply.text);
+}
+
+static void handle_login(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct field username = field_next(&p, &left);
+    struct field password = field_next(&p, &left);
+
+    if (username.len == 0 || username.len >= USERNAME_SIZE || password.len >= PASSWORD_SIZE)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid username or password");
+        return;
+    }
+
+    struct account_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    field_copy(username, j->username, sizeof(j->username));
+    field_copy(password, j->password, sizeof(j->password));
+    db_submit(conn, &j->reply.job, login_run, login_done);
+}
+
+static void abort_stream(struct connection *conn, int status, const char *text);
+static void stop_transfers(struct connection *conn);
+
+static void handle_logout(struct connection *conn, const struct frame *frame)
+{
+    (void)frame;
+    abort_stream(conn, 0, NULL);
+    stop_transfers(conn);
+    reactor_set_offline(conn->owner, conn);
+    conn_set_logged_in(conn, 0);
+    conn->user_id = 0;
+    conn->username[0] = '\0';
+    send_response(conn, STATUS_SUCCESS, "Logged out successfully");
+}
+
+/* Back on the origin shard */
+static void message_delivered(struct shard_delivery *d)
+{
+    mb_unref(d->mb);
+    db_job_resume(d->arg);
+}
+
+/*
+@brief Deliver a message on the home shards of its recipients, then go on with next
+
+The job is suspended, its connection held, until the message has been
+round the shards; next then finds in d->users only the recipients that had
+no connection. Takes over the reference to mb
+
+@param paced: also wait until the recipients' connections took what was queued to them
+*/
+static void deliver_message(struct db_job *job, struct connection *conn, struct shard_delivery *d,
+                            struct msg_buf *mb, int *users, size_t n_users, int paced,
+                            void (*next)(struct db_job *job, struct connection *conn))
+{
+    d->mb = mb;
+    d->users = users;
+    d->n_users = n_users;
+    d->done = message_delivered;
+    d->arg = job;
+    d->paced = paced;
+    if (shard_deliver(conn->owner, d))
+    {
+        mb_unref(mb);
+        next(job, conn);
+        return;
+    }
+    /* Comes back through the shard queues or a drained connection, after this call returns */
+    db_job_suspend(job, next);
+}
+
+/*
+Direct messages: the receiver is looked up, the message delivered live by
+the receiver's home shard if online there, then stored (as offline if not)
+*/
+struct direct_message_job
+{
+    struct reply_job reply;
+    int receiver_id;
+    int proceed; /* Receiver exists */
+    struct shard_delivery delivery;
+    uint32_t len;
+    char content[FRAME_MAX_PAYLOAD];
+};
+
+static void send_message_run(struct db_job *job)
+{
+    struct direct_message_job *j = (struct direct_message_job *)job;
+    char name[USERNAME_SIZE];
+
+    int res = db_get_username(j->receiver_id, name, sizeof(name));
+    if (res == DB_NOT_FOUND)
+        job_reply(&j->reply, STATUS_NOT_FOUND, "User not found");
+    else if (res != DB_OK)
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+    else
+        j->proceed = 1;
+}
+
+static void send_message_store_run(struct db_job *job)
+{
+    struct direct_message_job *j = (struct direct_message_job *)job;
+    int is_offline = j->delivery.n_users > 0;
+
+    if (db_store_message(j->reply.user_id, j->receiver_id, j->content, j->len, is_offline) == DB_OK)
+        job_reply(&j->reply, STATUS_SUCCESS, "Message sent");
+    else
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+}
+
+static void send_message_delivered(struct db_job *job, struct connection *conn)
+{
+    db_submit(conn, job, send_message_store_run, reply_done);
+}
+
+/*
+@brief Send MESSAGE_RECEIVED to the receiver's connections: sender_id|sender_username|content|timestamp
+*/
+static void send_message_route(struct db_job *job, struct connection *conn)
+{
+    struct direct_message_job *j = (struct direct_message_job *)job;
+    char payload[FRAME_MAX_PAYLOAD];
+
+    if (!j->proceed)
+    {
+        reply_done(job, conn);
+        return;
+    }
+
+    int len = snprintf(payload, sizeof(payload), "%d|%s|%.*s|%lld", conn->user_id, conn->username,
+                       (int)j->len, j->content, (long long)time(NULL));
+    if (len < 0 || len >= (int)sizeof(payload))
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Message too long");
+        return;
+    }
+
+    struct msg_buf *mb = mb_frame(MSG_MESSAGE_RECEIVED, payload, len);
+    if (mb == NULL)
+    {
+        send_response(conn, STATUS_SERVER_ERROR, "Out of memory");
+        return;
+    }
+    deliver_message(job, conn, &j->delivery, mb, &j->receiver_id, 1, 0, send_message_delivered);
+}
+
+/*
+@brief Send a direct message to the receiver, or keep it until they fetch it
+
+A receiver with no connection gets it with GET_OFFLINE_MESSAGES
+*/
+static void handle_send_message(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct field receiver = field_next(&p, &left);
+
+    if (receiver.len == 0 || left == 0)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid message");
+        return;
+    }
+
+    struct direct_message_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->receiver_id = field_id(receiver); /* -1 is nobody: not found */
+    j->proceed = 0;
+    j->len = left;
+    memcpy(j->content, p, left);
+    db_submit(conn, &j->reply.job, send_message_run, send_message_route);
+}
+
+/* One chunk of a direct message sent in pieces, see SEND_MESSAGE_CHUNK */
+struct chunk_job
+{
+    struct reply_job reply;
+    struct message_stream stream; /* The connection's as of this chunk; the message is created on the first */
+    int more;                     /* Chunks follow this one */
+    int proceed;                  /* Stored: relay it */
+    struct shard_delivery delivery;
+    uint32_t len;
+    char data[MESSAGE_CHUNK_MAX];
+};
+
+static void chunk_store_run(struct db_job *job)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+    char name[USERNAME_SIZE];
+
+    j->proceed = 0;
+    if (j->stream.id == 0)
+    {
+        int res = db_get_username(j->stream.to, name, sizeof(name));
+        if (res == DB_NOT_FOUND)
+        {
+            job_reply(&j->reply, STATUS_NOT_FOUND, "User not found");
+            return;
+        }
+        if (res != DB_OK ||
+            db_begin_message_stream(j->reply.user_id, j->stream.to, &j->stream.id, &j->stream.timestamp) != DB_OK)
+        {
+            j->stream.id = 0;
+            job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+            return;
+        }
+    }
+    if (db_store_message_chunk(j->stream.id, j->stream.seq, j->data, j->len) != DB_OK)
+    {
+        db_drop_message_stream(j->stream.id);
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+        return;
+    }
+    j->proceed = 1;
+}
+
+static void chunk_end_run(struct db_job *job)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+
+    if (db_end_message_stream(j->stream.id, j->stream.missed) == DB_OK)
+        job_reply(&j->reply, STATUS_SUCCESS, "Message sent");
+    else
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+}
+
+/*
+@brief Acknowledge a chunk; after the last one, make the whole message visible
+
+A receiver that missed part of it fetches it with GET_OFFLINE_MESSAGES
+*/
+static void chunk_delivered(struct db_job *job, struct connection *conn)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+
+    if (j->delivery.n_users > 0)
+        conn->stream.missed = 1;
+    if (j->more)
+    {
+        job_reply(&j->reply, STATUS_SUCCESS, "Chunk stored");
+        reply_done(job, conn);
+        return;
+    }
+    j->stream = conn->stream;
+    memset(&conn->stream, 0, sizeof(conn->stream));
+    db_submit(conn, job, chunk_end_run, reply_done);
+}
+
+/*
+@brief Relay a stored chunk to the receiver: MESSAGE_CHUNK_RECEIVED message_id|sender_id|sender_username|timestamp|more|data
+
+Once a chunk could not be delivered the rest are only stored, so a receiver
+sees either the whole message live or fetches it later. The chunk is only
+acknowledged once the receiver has read down what was queued to it, so the
+sender goes at the receiver's pace
+*/
+static void chunk_route(struct db_job *job, struct connection *conn)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+    char prefix[128];
+
+    if (!j->proceed)
+    {
+        /* Anything stored was dropped: the client starts over */
+        memset(&conn->stream, 0, sizeof(conn->stream));
+        reply_done(job, conn);
+        return;
+    }
+    conn->stream = j->stream;
+    conn->stream.seq++;
+    conn->stream.bytes += j->len;
+    j->delivery.n_users = 0;
+    if (conn->stream.missed)
+    {
+        chunk_delivered(job, conn);
+        return;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = snprintf(prefix, sizeof(prefix), "%lld|%d|%s|%lld|%d|", j->stream.id, conn->user_id,
+                              conn->username, j->stream.timestamp, j->more);
+    iov[1].iov_base = j->data;
+    iov[1].iov_len = j->len;
+    struct msg_buf *mb = mb_framev(MSG_MESSAGE_CHUNK_RECEIVED, iov, 2);
+    if (mb == NULL)
+    {
+        conn->stream.missed = 1;
+        chunk_delivered(job, conn);
+        return;
+    }
+    deliver_message(job, conn, &j->delivery, mb, &j->stream.to, 1, 1, chunk_delivered);
+}
+
+static void chunk_drop_run(struct db_job *job)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+
+    if (db_drop_message_stream(j->stream.id) != DB_OK)
+        fprintf(stderr, "Failed to drop unfinished message %lld\n", j->stream.id);
+}
+
+static void chunk_dropped(struct db_job *job, struct connection *conn)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+    if (j->reply.status != 0)
+        reply_done(job, conn);
+}
+
+/*
+@brief Give up the message conn is sending in chunks, deleting what was stored
+
+@param status, text: reply once it is gone, or none if status is 0
+*/
+static void abort_stream(struct connection *conn, int status, const char *text)
+{
+    if (conn->stream.id == 0)
+    {
+        if (status != 0)
+            send_response(conn, status, text);
+        return;
+    }
+
+    struct chunk_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->stream = conn->stream;
+    j->reply.status = 0;
+    if (status != 0)
+        job_reply(&j->reply, status, text);
+    memset(&conn->stream, 0, sizeof(conn->stream));
+    db_submit(conn, &j->reply.job, chunk_drop_run, chunk_dropped);
+}
+
+/*
+@brief Take one chunk of a direct message too long for a single frame: receiver_id|more|data
+
+Each chunk is stored, relayed and acknowledged before the connection's next
+request is read, so a message of any size costs one chunk of memory
+*/
+static void handle_send_message_chunk(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    int receiver_id = field_id(field_next(&p, &left));
+    struct field more = field_next(&p, &left);
+
+    if (receiver_id < 0 || more.len != 1 || (more.data[0] != '0' && more.data[0] != '1') ||
+        left > MESSAGE_CHUNK_MAX)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid chunk");
+        return;
+    }
+    if (conn->stream.id != 0 && conn->stream.to != receiver_id)
+    {
+        send_response(conn, STATUS_CONFLICT, "Another message is being sent");
+        return;
+    }
+    if (conn->stream.bytes + left > max_message_bytes)
+    {
+        abort_stream(conn, STATUS_BAD_REQUEST, "Message too long");
+        return;
+    }
+
+    struct chunk_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->stream = conn->stream;
+    j->stream.to = receiver_id;
+    j->more = more.data[0] == '1';
+    j->len = left;
+    memcpy(j->data, p, left);
+    db_submit(conn, &j->reply.job, chunk_store_run, chunk_route);
+}
+
+/* Group requests: the group, and the member or new group name they name */
+struct group_job
+{
+    struct reply_job reply;
+    int group_id;
+    int member_id;
+    char name[USERNAME_SIZE];
+};
+
+static void create_group_run(struct db_job *job)
+{
+    struct group_job *j = (struct group_job *)job;
+
+    if (db_create_group(j->name, j->reply.user_id, &j->group_id) != DB_OK)
+    {
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+        return;
+    }
+
+    char text[32 + USERNAME_SIZE];
+    snprintf(text, sizeof(text), "%d|%s", j->group_id, j->name);
+    job_reply(&j->reply, STATUS_CREATED, text);
+}
+
+static void handle_create_group(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct field name = field_next(&p, &left);
+
+    if (name.len == 0 || name.len >= USERNAME_SIZE || left != 0)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid name");
+        return;
+    }
+
+    struct group_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    field_copy(name, j->name, sizeof(j->name));
+    db_submit(conn, &j->reply.job, create_group_run, reply_done);
+}
+
+/*
+@brief Check that the group exists and the caller belongs to it, setting the reply if not
+
+Runs on a storage worker; the caller was checked to be logged in when the request was submitted
+
+@param need_admin: also require the admin role
+
+@return 1 if the request may proceed, 0 if the reply was set
+*/
+static int check_group_access(struct reply_job *j, int group_id, int need_admin,
+                              char *group_name, size_t size)
+{
+    int is_admin;
+
+    if (group_id < 0)
+    {
+        job_reply(j, STATUS_BAD_REQUEST, "Invalid group");
+        return 0;
+    }
+
+    int res = db_get_group(group_id, group_name, size);
+    if (res == DB_OK)
+        res = db_get_group_role(group_id, j->user_id, &is_admin);
+    else if (res == DB_NOT_FOUND)
+    {
+        job_reply(j, STATUS_NOT_FOUND, "Group not found");
+        return 0;
+    }
+
+    if (res == DB_NOT_FOUND)
+        job_reply(j, STATUS_FORBIDDEN, "Not a member");
+    else if (res != DB_OK)
+        job_reply(j, STATUS_SERVER_ERROR, "Database error");
+    else if (need_admin && !is_admin)
+        job_reply(j, STATUS_FORBIDDEN, "Not admin");
+    else
+        return 1;
+    return 0;
+}
+
+/*
+@brief Submit a membership request "group_id[|user_id]" to run on a storage worker
+
+@param with_member: the payload names a member after the group
+*/
+static void submit_group_job(struct connection *conn, const struct frame *frame, int with_member,
+                             void (*run)(struct db_job *job))
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+
+    struct group_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->group_id = field_id(field_next(&p, &left));
+    j->member_id = with_member ? field_id(field_next(&p, &left)) : -1;
+    db_submit(conn, &j->reply.job, run, reply_done);
+}
+
+static void add_to_group_run(struct db_job *job)
+{
+    struct group_job *j = (struct group_job *)job;
+    char group_name[USERNAME_SIZE];
+
+    if (!check_group_access(&j->reply, j->group_id, 1, group_name, sizeof(group_name)))
+        return;
+
+    int res = j->member_id < 0 ? DB_NOT_FOUND : db_get_username(j->member_id, j->name, sizeof(j->name));
+    if (res == DB_OK)
+        res = db_add_group_member(j->group_id, j->member_id);
+
+    if (res == DB_OK)
+        job_reply(&j->reply, STATUS_SUCCESS, "User added");
+    else if (res == DB_NOT_FOUND)
+        job_reply(&j->reply, STATUS_NOT_FOUND, "User not found");
+    else if (res == DB_CONFLICT)
+        job_reply(&j->reply, STATUS_CONFLICT, "Already a member");
+    else
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+}
+
+static void remove_from_group_run(struct db_job *job)
+{
+    struct group_job *j = (struct group_job *)job;
+    char group_name[USERNAME_SIZE];
+
+    if (!check_group_access(&j->reply, j->group_id, 1, group_name, sizeof(group_name)))
+        return;
+
+    int res = j->member_id < 0 ? DB_NOT_FOUND : db_remove_group_member(j->group_id, j->member_id);
+    if (res == DB_OK)
+        job_reply(&j->reply, STATUS_SUCCESS, "User removed");
+    else if (res == DB_NOT_FOUND)
+        job_reply(&j->reply, STATUS_NOT_FOUND, "User not found");
+    else
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+}
+
+static void leave_group_run(struct db_job *job)
+{
+    struct group_job *j = (struct group_job *)job;
+    char group_name[USERNAME_SIZE];
+
+    if (!check_group_access(&j->reply, j->group_id, 0, group_name, sizeof(group_name)))
+        return;
+
+    if (db_remove_group_member(j->group_id, j->reply.user_id) == DB_ERROR)
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+    else
+        job_reply(&j->reply, STATUS_SUCCESS, "Left group");
+}
+
+/*
+Group messages take two storage steps around the fan-out, which runs on the
+home shards of the members:
+    worker: check access, load the members
+    reactors: deliver to the members online
+    worker: store the message for the others
+*/
+struct group_message_job
+{
+    struct reply_job reply;
+    int group_id;
+    int proceed; /* Access granted, members loaded */
+    char group_name[USERNAME_SIZE];
+    int *members; /* Then only those left offline */
+    size_t n_members;
+    size_t cap;
+    struct shard_delivery delivery;
+    uint32_t len;
+    char content[FRAME_MAX_PAYLOAD];
+};
+
+static int collect_member(void *arg, int user_id)
+{
+    struct group_message_job *j = arg;
+
+    if (user_id == j->reply.user_id)
+        return 0;
+    if (j->n_members == j->cap)
+    {
+        size_t cap = j->cap ? j->cap * 2 : 64;
+        int *grown = realloc(j->members, cap * sizeof(int));
+        if (grown == NULL)
+            return 1;
+        j->members = grown;
+        j->cap = cap;
+    }
+    j->members[j->n_members++] = user_id;
+    return 0;
+}
+
+static void release_group_message(struct db_job *job)
+{
+    free(((struct group_message_job *)job)->members);
+}
+
+static void group_message_run(struct db_job *job)
+{
+    struct group_message_job *j = (struct group_message_job *)job;
+
+    if (!check_group_access(&j->reply, j->group_id, 0, j->group_name, sizeof(j->group_name)))
+        return;
+    if (j->len == 0)
+    {
+        job_reply(&j->reply, STATUS_BAD_REQUEST, "Invalid message");
+        return;
+    }
+    if (db_get_group_members(j->group_id, collect_member, j) < 0)
+    {
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+        return;
+    }
+    j->proceed = 1;
+}
+
+static void group_message_store_run(struct db_job *job)
+{
+    struct group_message_job *j = (struct group_message_job *)job;
+
+    if (db_store_group_message(j->reply.user_id, j->group_id, j->members, j->n_members, j->content, j->len) == DB_OK)
+        job_reply(&j->reply, STATUS_SUCCESS, "Message sent");
+    else
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Database error");
+}
+
+static void group_message_delivered(struct db_job *job, struct connection *conn)
+{
+    struct group_message_job *j = (struct group_message_job *)job;
+
+    /* Stored whoever was online; rows for offline delivery only for those left */
+    j->n_members = j->delivery.n_users;
+    db_submit(conn, job, group_message_store_run, reply_done);
+}
+
+/*
+@brief Deliver a message to every other member of a group that is online
+
+The GROUP_MESSAGE_RECEIVED frame is serialised once into a shared buffer and
+each online member's write queue takes a reference to it. The message is
+then stored once as the group's history, and as an offline message for each
+member with no connection
+*/
+static void group_message_fanout(struct db_job *job, struct connection *conn)
+{
+    struct group_message_job *j = (struct group_message_job *)job;
+    char payload[FRAME_MAX_PAYLOAD];
+
+    if (!j->proceed)
+    {
+        reply_done(job, conn);
+        return;
+    }
+
+    int len = snprintf(payload, sizeof(payload), "%d|%s|%d|%s|%.*s|%lld", j->group_id, j->group_name,
+                       conn->user_id, conn->username, (int)j->len, j->content, (long long)time(NULL));
+    if (len < 0 || len >= (int)sizeof(payload))
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Message too long");
+        return;
+    }
+
+    struct msg_buf *mb = mb_frame(MSG_GROUP_MESSAGE_RECEIVED, payload, len);
+    if (mb == NULL)
+    {
+        send_response(conn, STATUS_SERVER_ERROR, "Out of memory");
+        return;
+    }
+    deliver_message(job, conn, &j->delivery, mb, j->members, j->n_members, 0, group_message_delivered);
+}
+
+static void handle_send_group_message(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+
+    struct group_message_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->reply.job.release = release_group_message;
+    j->group_id = field_id(field_next(&p, &left));
+    j->proceed = 0;
+    j->members = NULL;
+    j->n_members = 0;
+    j->cap = 0;
+    j->len = left;
+    memcpy(j->content, p, left);
+    db_submit(conn, &j->reply.job, group_message_run, group_message_fanout);
+}
+
+struct offline_job
+{
+    struct reply_job reply;
+    int count;
+    size_t len;
+    size_t cap; /* Room for entries in the client's max_frame */
+    struct db_stream stream; /* Chunked message being replayed, message_id 0 = none */
+    unsigned seq;            /* Chunk the next piece is read from */
+    size_t offset;           /* Where in it */
+    size_t piece;            /* Most bytes per piece, in the client's max_frame */
+    char entries[FRAME_MAX_PAYLOAD - 16]; /* Or the piece read */
+};
+
+/* An entry past its content and sender name: 4 '|', sender_id, timestamp and the '\0' */
+#define OFFLINE_ENTRY_OVERHEAD (4 + 11 + 20 + 1)
+
+static int append_offline_message(void *arg, int sender_id, const char *sender_name,
+                                  const char *content, long long timestamp)
+{
+    struct offline_job *j = arg;
+    size_t cap = j->cap;
+    int n = snprintf(j->entries + j->len, cap - j->len, "|%d|%s|%s|%lld",
+                     sender_id, sender_name, content, timestamp);
+    if (n < 0 || (size_t)n >= cap - j->len)
+    {
+        /* Does not fit in this frame: leave it for the next request */
+        j->entries[j->len] = '\0';
+        return 1;
+    }
+    j->len += n;
+    return 0;
+}
+
+static void offline_messages_run(struct db_job *job)
+{
+    struct offline_job *j = (struct offline_job *)job;
+
+    j->len = 0;
+    j->entries[0] = '\0';
+    j->count = db_take_offline_messages(j->reply.user_id, j->cap - OFFLINE_ENTRY_OVERHEAD, append_offline_message, j);
+}
+
+/*
+@brief Reply with OFFLINE_MESSAGES_DATA: count|sender_id|sender_name|content|timestamp|...
+
+As many messages as fit in one frame are returned and marked delivered
+*/
+static void offline_messages_done(struct db_job *job, struct connection *conn)
+{
+    struct offline_job *j = (struct offline_job *)job;
+    char count_text[16];
+
+    if (j->count < 0)
+    {
+        end_bulk_reply(conn);
+        send_response(conn, STATUS_SERVER_ERROR, "Database error");
+        return;
+    }
+
+    /* The count goes in front of entries that are only counted once written */
+    struct iovec iov[2];
+    iov[0].iov_base = count_text;
+    iov[0].iov_len = snprintf(count_text, sizeof(count_text), "%d", j->count);
+    iov[1].iov_base = j->entries;
+    iov[1].iov_len = j->len;
+    send_bulk_framev(conn, MSG_OFFLINE_MESSAGES_DATA, iov, 2);
+    end_bulk_reply(conn);
+}
+
+/*
+@brief Read the next piece of the oldest chunked message waiting, or once there are none left, the others
+
+A message too long for an OFFLINE_MESSAGES_DATA entry on its own is replayed
+the same way, as one chunk, so the batch always has room for the next entry
+A message is marked delivered when the request for the piece after its last
+one comes in, so one cut short is replayed in full next time
+*/
+static void offline_stream_run(struct db_job *job)
+{
+    struct offline_job *j = (struct offline_job *)job;
+    size_t chunk_len;
+
+    if (j->stream.message_id != 0 && j->seq == j->stream.n_chunks)
+    {
+        db_mark_delivered(j->stream.message_id);
+        j->stream.message_id = 0;
+    }
+    if (j->stream.message_id == 0)
+    {
+        int res = db_next_offline_stream(j->reply.user_id, j->cap - OFFLINE_ENTRY_OVERHEAD, &j->stream);
+        if (res != DB_OK)
+        {
+            j->stream.message_id = 0;
+            if (res == DB_NOT_FOUND)
+                offline_messages_run(job);
+            else
+                j->count = DB_ERROR;
+            return;
+        }
+        j->seq = 0;
+        j->offset = 0;
+    }
+
+    if (db_read_message_chunk(j->stream.message_id, j->seq, j->offset, j->entries, j->piece, &j->len,
+                              &chunk_len) != DB_OK)
+    {
+        j->stream.message_id = 0;
+        j->count = DB_ERROR;
+        return;
+    }
+    j->offset += j->len;
+    if (j->offset >= chunk_len)
+    {
+        j->seq++;
+        j->offset = 0;
+    }
+}
+
+static void offline_stream_done(struct db_job *job, struct connection *conn);
+
+/* Read the next piece once the client took the ones queued */
+static void offline_stream_next(struct db_job *job, struct connection *conn)
+{
+    db_submit(conn, job, offline_stream_run, offline_stream_done);
+}
+
+/*
+@brief Send a piece as MESSAGE_CHUNK_RECEIVED and read the next, or reply with the other offline messages
+
+The next piece waits for the output to drain, so a long message goes out at
+the pace the client reads it rather than piling up past the -q limit
+*/
+static void offline_stream_done(struct db_job *job, struct connection *conn)
+{
+    struct offline_job *j = (struct offline_job *)job;
+    char prefix[128];
+
+    if (j->stream.message_id == 0)
+    {
+        offline_messages_done(job, conn);
+        return;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = snprintf(prefix, sizeof(prefix), "%lld|%d|%s|%lld|%d|", j->stream.message_id,
+                              j->stream.sender_id, j->stream.sender_name, j->stream.timestamp,
+                              j->seq < j->stream.n_chunks);
+    iov[1].iov_base = j->entries;
+    iov[1].iov_len = j->len;
+    send_bulk_framev(conn, MSG_MESSAGE_CHUNK_RECEIVED, iov, 2);
+    if (conn->out.bytes >= XFER_AHEAD)
+        db_job_wait_drain(job, offline_stream_next);
+    else
+        offline_stream_next(job, conn);
+}
+
+/*
+@brief Messages sent in chunks (or too long for the frame) come first, in MESSAGE_CHUNK_RECEIVED pieces, then OFFLINE_MESSAGES_DATA with the rest
+*/
+static void handle_get_offline_messages(struct connection *conn, const struct frame *frame)
+{
+    (void)frame;
+    struct offline_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->cap = conn->caps.max_frame - 16 < sizeof(j->entries) ? conn->caps.max_frame - 16 : sizeof(j->entries);
+    j->piece = conn->caps.max_frame - 128 < sizeof(j->entries) ? conn->caps.max_frame - 128 : sizeof(j->entries);
+    j->stream.message_id = 0;
+    db_submit(conn, &j->reply.job, offline_stream_run, offline_stream_done);
+}
+
+static void handle_add_to_group(struct connection *conn, const struct frame *frame)
+{
+    submit_group_job(conn, frame, 1, add_to_group_run);
+}
+
+static void handle_remove_from_group(struct connection *conn, const struct frame *frame)
+{
+    submit_group_job(conn, frame, 1, remove_from_group_run);
+}
+
+static void handle_leave_group(struct connection *conn, const struct frame *frame)
+{
+    submit_group_job(conn, frame, 0, leave_group_run);
+}
+
+static void handle_pong(struct connection *conn, const struct frame *frame)
+{
+    /* Receiving it already reset the heartbeat */
+    (void)conn;
+    (void)frame;
+}
+
+/*
+@brief Agree on the options of this connection from what the client asks for
+
+Payload "version|max_frame|codecs|compress|heartbeat", see frame.h; what
+the client leaves out keeps its current value. The new options apply from
+the next frame on, both ways
+*/
+static void handle_hello(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct proto_caps caps = conn->caps;
+    struct field f;
+    char text[128];
+
+    int version = field_id(field_next(&p, &left));
+    if (version < 1)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid version");
+        return;
+    }
+    caps.version = version < PROTO_VERSION ? version : PROTO_VERSION;
+
+    if ((f = field_next(&p, &left)).len > 0)
+    {
+        int max_frame = field_id(f);
+        if (max_frame < FRAME_MIN_PAYLOAD)
+        {
+            send_response(conn, STATUS_BAD_REQUEST, "Invalid max_frame");
+            return;
+        }
+        caps.max_frame = max_frame < FRAME_MAX_PAYLOAD ? max_frame : FRAME_MAX_PAYLOAD;
+    }
+
+    int codec = caps.codec, compress = caps.compress;
+    if ((f = field_next(&p, &left)).len > 0 && (codec = caps_pick(f, codec_names, N_CODECS)) < 0)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "No common codec");
+        return;
+    }
+    if ((f = field_next(&p, &left)).len > 0 &&
+        (compress = caps_pick(f, compress_names, N_COMPRESS)) < 0)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "No common compression");
+        return;
+    }
+    caps.codec = codec;
+    caps.compress = compress;
+
+    /* A shorter heartbeat than the server's is fine, a longer one only if it has none */
+    if ((f = field_next(&p, &left)).len > 0)
+    {
+        int seconds = field_id(f);
+        unsigned idle_ms = conn->owner->timeouts.idle_ms;
+        if (f.len == 1 && f.data[0] == '0')
+            caps.heartbeat_ms = 0;
+        else if (seconds < HEARTBEAT_MIN || seconds > 86400)
+        {
+            send_response(conn, STATUS_BAD_REQUEST, "Invalid heartbeat");
+            return;
+        }
+        else
+        {
+            caps.heartbeat_ms = (unsigned)seconds * 1000;
+            if (idle_ms != 0 && caps.heartbeat_ms > idle_ms)
+                caps.heartbeat_ms = idle_ms;
+        }
+    }
+
+    conn->caps = caps;
+    conn->dec.max_payload = caps.max_frame;
+    if (caps.compress != COMPRESS_DEFLATE)
+    {
+        deflater_free(conn->deflater);
+        conn->deflater = NULL;
+    }
+    /* Wait out the new heartbeat rather than the old one (a session not logged
+     * in is on its login timeout, which must not restart) */
+    if (conn->is_logined)
+        conn_set_logged_in(conn, 1);
+    unsigned heartbeat_ms = caps.heartbeat_ms ? caps.heartbeat_ms : conn->owner->timeouts.idle_ms;
+    snprintf(text, sizeof(text), "%u|%u|%s|%s|%u", caps.version, caps.max_frame, codec_names[caps.codec],
+             compress_names[caps.compress], heartbeat_ms / 1000);
+    send_response(conn, STATUS_SUCCESS, text);
+}
+
+/*
+@brief Check a file name: letters, digits, '.', '-' and '_', not starting with '.'
+
+So it can never leave its directory, nor clash with a partial upload
+*/
+static int file_name_ok(struct field name)
+{
+    if (name.len == 0 || name.len >= FILE_NAME_SIZE || name.data[0] == '.')
+        return 0;
+    for (size_t i = 0; i < name.len; i++)
+    {
+        char ch = name.data[i];
+        if (!(ch >= 'a' && ch <= 'z') && !(ch >= 'A' && ch <= 'Z') && !(ch >= '0' && ch <= '9') &&
+            ch != '.' && ch != '-' && ch != '_')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+@brief Path of a user's partial upload under the storage directory: "user_id/.name.part"
+*/
+static void partial_path(char *path, size_t size, int user_id, const char *name)
+{
+    snprintf(path, size, "%d/.%s.part", user_id, name);
+}
+
+/*
+@brief Path of stored content: "objects/xx/<SHA-256 in hex>", xx being the
+first two digits, so no directory grows too large to search
+*/
+static void object_path(char *path, size_t size, const unsigned char strong[HASH_STRONG_SIZE])
+{
+    char hex[HASH_STRONG_HEX];
+
+    hash_strong_to_hex(strong, hex);
+    snprintf(path, size, "objects/%.2s/%s", hex, hex);
+}
+
+/* Give up the upload going on, keeping what was stored for a later resume */
+static void close_upload(struct connection *conn)
+{
+    if (conn->upload.fd == -1)
+        return;
+    close(conn->upload.fd);
+    conn->upload.fd = -1;
+}
+
+/* Leaving the session: no more transfers on its behalf */
+static void stop_transfers(struct connection *conn)
+{
+    close_upload(conn);
+    conn_stop_file(conn);
+}
+
+/* Bytes of a partial file read back at a time to hash them */
+#define HASH_READ_SIZE (64 << 10)
+
+/*
+An upload being started, or a piece of it hashed, on a worker. The partial
+file is the job's meanwhile and goes back to the connection in done()
+*/
+struct upload_job
+{
+    struct reply_job reply;
+    int fd; /* Partial file, -1 once stored or given up */
+    char name[FILE_NAME_SIZE];
+    uint64_t size;
+    uint64_t off; /* Bytes hashed */
+    uint64_t end; /* Bytes stored, hashed up to by the job */
+    struct content_hash hash;
+    int has_hashes; /* UPLOAD_FILE gave the content's hashes: maybe no body is needed, and the body must match */
+    uint64_t fast;
+    unsigned char strong[HASH_STRONG_SIZE];
+};
+
+/*
+@brief Worker side: hash the stored bytes from j->off to j->end
+
+They were spliced into the file without passing through user space, so they
+are read back, from the page cache they were just written to
+
+@return: 0 on success, -1 on error
+*/
+static int hash_stored(struct upload_job *j)
+{
+    char buf[HASH_READ_SIZE];
+
+    while (j->off < j->end)
+    {
+        size_t n = j->end - j->off < sizeof(buf) ? j->end - j->off : sizeof(buf);
+        ssize_t got = pread(j->fd, buf, n, j->off);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            perror("pread() error");
+            return -1;
+        }
+        content_hash_update(&j->hash, buf, got);
+        j->off += got;
+    }
+    return 0;
+}
+
+/*
+@brief Worker side: remove the object of content whose last name is gone, committed
+
+Under the write lock again, and only if the same content was not stored
+anew in between, the object then being the new blob's. Should this fail, the
+object is left over, unused
+*/
+static void remove_object(uint64_t fast, const unsigned char strong[HASH_STRONG_SIZE], uint64_t size)
+{
+    char path[FILE_NAME_SIZE + 32];
+    long long blob_id;
+
+    if (db_begin() != DB_OK)
+        return;
+    if (db_find_blob(0, fast, strong, size, &blob_id) == DB_NOT_FOUND)
+    {
+        object_path(path, sizeof(path), strong);
+        if (unlinkat(storage_fd, path, 0) == -1 && errno != ENOENT)
+            perror("unlinkat() error");
+    }
+    /* Nothing was written */
+    db_rollback();
+}
+
+/*
+@brief Worker side, ending the transaction: point a file name at stored
+content and commit, then remove the object of what it named before if
+nothing else does
+
+@return: DB_OK, DB_ERROR (rolled back)
+*/
+static int link_content(int owner_id, const char *name, long long blob_id)
+{
+    unsigned char strong[HASH_STRONG_SIZE];
+    uint64_t fast, size;
+    int freed;
+
+    if (db_link_file(owner_id, name, blob_id, &freed, &fast, strong, &size) != DB_OK || db_commit() != DB_OK)
+    {
+        db_rollback();
+        return DB_ERROR;
+    }
+    if (freed)
+        remove_object(fast, strong, size);
+    return DB_OK;
+}
+
+/*
+@brief Worker side, in the transaction adding its blob: move a partial file
+to the path of its content, before the blob can be seen
+
+@return: 0 on success, -1 on error
+*/
+static int store_object(const char *from, const unsigned char strong[HASH_STRONG_SIZE])
+{
+    char dir[16], path[FILE_NAME_SIZE + 32];
+
+    object_path(path, sizeof(path), strong);
+    snprintf(dir, sizeof(dir), "%.10s", path);
+    if ((mkdirat(storage_fd, "objects", 0755) == -1 && errno != EEXIST) ||
+        (mkdirat(storage_fd, dir, 0755) == -1 && errno != EEXIST) ||
+        renameat(storage_fd, from, storage_fd, path) == -1)
+    {
+        perror("Storing a file");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+@brief Worker side: file a complete upload under its content and set the reply
+
+Content stored before only gains a reference, and the partial file goes;
+new content becomes the object as it is. A body that does not match the
+hashes UPLOAD_FILE announced is deleted, to be uploaded again from the start
+*/
+static void store_upload(struct upload_job *j)
+{
+    char partial[FILE_NAME_SIZE + 32];
+    unsigned char strong[HASH_STRONG_SIZE];
+    uint64_t fast;
+    long long blob_id;
+    char text[32];
+
+    content_hash_final(&j->hash, &fast, strong);
+    close(j->fd);
+    j->fd = -1;
+    partial_path(partial, sizeof(partial), j->reply.user_id, j->name);
+    if (j->has_hashes && (fast != j->fast || memcmp(strong, j->strong, sizeof(strong)) != 0))
+    {
+        if (unlinkat(storage_fd, partial, 0) == -1)
+            perror("unlinkat() error");
+        printf("User %d uploaded %s, not matching its hashes\n", j->reply.user_id, j->name);
+        job_reply(&j->reply, STATUS_BAD_REQUEST, "Content does not match its hashes");
+        return;
+    }
+
+    int rc = db_begin();
+    if (rc == DB_OK)
+        rc = db_find_blob(0, fast, strong, j->size, &blob_id);
+    int known = rc == DB_OK, moved = 0;
+    if (rc == DB_NOT_FOUND)
+    {
+        rc = db_add_blob(fast, strong, j->size, &blob_id);
+        if (rc == DB_OK)
+            rc = (moved = store_object(partial, strong) == 0) ? DB_OK : DB_ERROR;
+    }
+    if (rc == DB_OK)
+        rc = link_content(j->reply.user_id, j->name, blob_id);
+    else
+        db_rollback();
+    if (rc != DB_OK)
+    {
+        /* Not stored after all: the partial file is put back for a retry */
+        char path[FILE_NAME_SIZE + 32];
+        object_path(path, sizeof(path), strong);
+        if (moved && renameat(storage_fd, path, storage_fd, partial) == -1)
+            perror("renameat() error");
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Could not store the file");
+        return;
+    }
+
+    if (known && unlinkat(storage_fd, partial, 0) == -1)
+        perror("unlinkat() error");
+    printf("User %d uploaded %s (%llu bytes%s)\n", j->reply.user_id, j->name, (unsigned long long)j->size,
+           known ? ", stored already" : "");
+    snprintf(text, sizeof(text), "%llu", (unsigned long long)j->size);
+    job_reply(&j->reply, STATUS_CREATED, text);
+}
+
+/* Worker side: reply with where the upload stands, 200|offset, storing it once complete */
+static void upload_progress(struct upload_job *j)
+{
+    char text[32];
+
+    if (j->off == j->size)
+    {
+        store_upload(j);
+        return;
+    }
+    snprintf(text, sizeof(text), "%llu", (unsigned long long)j->off);
+    job_reply(&j->reply, STATUS_SUCCESS, text);
+}
+
+static void upload_start_run(struct db_job *job)
+{
+    struct upload_job *j = (struct upload_job *)job;
+    char dir[16], path[FILE_NAME_SIZE + 32];
+    long long blob_id;
+    struct stat st;
+
+    /* Content the user has stored already only needs the name, acknowledged
+     * without the body. Anyone else's is uploaded in full: hashes alone do
+     * not prove the client has the bytes, and would tell it what is stored */
+    if (j->has_hashes)
+    {
+        int rc = db_begin();
+        if (rc == DB_OK)
+            rc = db_find_blob(j->reply.user_id, j->fast, j->strong, j->size, &blob_id);
+        if (rc == DB_OK)
+            rc = link_content(j->reply.user_id, j->name, blob_id);
+        else
+            db_rollback();
+        if (rc == DB_OK)
+        {
+            /* Whatever an earlier attempt left is not needed any more */
+            partial_path(path, sizeof(path), j->reply.user_id, j->name);
+            unlinkat(storage_fd, path, 0);
+            printf("User %d uploaded %s (%llu bytes, stored already)\n", j->reply.user_id, j->name,
+                   (unsigned long long)j->size);
+            snprintf(path, sizeof(path), "%llu", (unsigned long long)j->size);
+            job_reply(&j->reply, STATUS_CREATED, path);
+            return;
+        }
+        if (rc == DB_ERROR)
+        {
+            job_reply(&j->reply, STATUS_SERVER_ERROR, "Could not store the file");
+            return;
+        }
+    }
+
+    snprintf(dir, sizeof(dir), "%d", j->reply.user_id);
+    partial_path(path, sizeof(path), j->reply.user_id, j->name);
+    if ((mkdirat(storage_fd, dir, 0755) == -1 && errno != EEXIST) ||
+        (j->fd = openat(storage_fd, path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1 || fstat(j->fd, &st) == -1)
+    {
+        perror("Opening an upload");
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Could not store the file");
+        return;
+    }
+
+    /* What an earlier attempt stored is kept, unless it was another file;
+     * it is hashed again to go on from there */
+    j->off = 0;
+    j->end = (uint64_t)st.st_size;
+    if (j->end > j->size)
+    {
+        j->end = 0;
+        if (ftruncate(j->fd, 0) == -1)
+            perror("ftruncate() error");
+    }
+    lseek(j->fd, j->end, SEEK_SET);
+    content_hash_init(&j->hash);
+    if (hash_stored(j) == -1)
+    {
+        close(j->fd);
+        j->fd = -1;
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Could not store the file");
+        return;
+    }
+    upload_progress(j);
+}
+
+static void upload_piece_run(struct db_job *job)
+{
+    struct upload_job *j = (struct upload_job *)job;
+
+    if (hash_stored(j) == -1)
+    {
+        close(j->fd);
+        j->fd = -1;
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Could not store the file");
+        return;
+    }
+    upload_progress(j);
+}
+
+static void upload_done(struct db_job *job, struct connection *conn)
+{
+    struct upload_job *j = (struct upload_job *)job;
+
+    if (j->fd != -1)
+    {
+        /* More to come: the connection takes the file back */
+        conn->upload.fd = j->fd;
+        j->fd = -1;
+        memcpy(conn->upload.name, j->name, sizeof(j->name));
+        conn->upload.size = j->size;
+        conn->upload.off = j->off;
+        conn->upload.incoming = 0;
+        conn->upload.hash = j->hash;
+        conn->upload.has_hashes = j->has_hashes;
+        conn->upload.fast = j->fast;
+        memcpy(conn->upload.strong, j->strong, sizeof(j->strong));
+    }
+    reply_done(job, conn);
+}
+
+/* The client went away first: what was stored stays for a resume */
+static void upload_release(struct db_job *job)
+{
+    struct upload_job *j = (struct upload_job *)job;
+    if (j->fd != -1)
+        close(j->fd);
+}
+
+static struct upload_job *upload_job_alloc(struct connection *conn)
+{
+    struct upload_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return NULL;
+    j->reply.job.release = upload_release;
+    j->fd = -1;
+    j->has_hashes = 0;
+    return j;
+}
+
+/*
+@brief Start or resume an upload: name|size[|xxh64|sha256], the hashes in hex
+
+Files are stored once per content. Given the hashes of content the user
+stored already, the reply is 201|size straight away and no body is sent; otherwise
+the bytes go to a partial file that survives the connection, and the reply
+is the offset it holds, where the client goes on with FILE_DATA
+*/
+static void handle_upload_file(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct field name = field_next(&p, &left);
+    uint64_t size, fast = 0;
+    unsigned char strong[HASH_STRONG_SIZE];
+
+    if (storage_fd == -1)
+    {
+        send_response(conn, STATUS_SERVER_ERROR, "No file storage");
+        return;
+    }
+    int bad = !file_name_ok(name) || field_size(field_next(&p, &left), &size) == -1;
+    struct field fast_hex = field_next(&p, &left);
+    struct field strong_hex = field_next(&p, &left);
+    int has_hashes = fast_hex.len > 0 || strong_hex.len > 0;
+    if (bad || (has_hashes && (hash_fast_from_hex(fast_hex.data, fast_hex.len, &fast) == -1 ||
+                               hash_strong_from_hex(strong_hex.data, strong_hex.len, strong) == -1)))
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid file");
+        return;
+    }
+
+    close_upload(conn);
+    struct upload_job *j = upload_job_alloc(conn);
+    if (j == NULL)
+        return;
+    field_copy(name, j->name, sizeof(j->name));
+    j->size = size;
+    j->has_hashes = has_hashes;
+    j->fast = fast;
+    memcpy(j->strong, strong, sizeof(strong));
+    db_submit(conn, &j->reply.job, upload_start_run, upload_done);
+}
+
+/*
+@brief Receive a piece of the upload: offset|length, followed by length raw bytes
+
+The bytes are not part of the frame, so they are taken off the connection
+whatever happens to the request; they go into the file without passing
+through the input buffer, and file_received() has them hashed before replying
+*/
+static void handle_file_data(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    uint64_t off, len;
+    char text[32];
+
+    if (field_size(field_next(&p, &left), &off) == -1 || field_size(field_next(&p, &left), &len) == -1)
+    {
+        /* The next frame cannot be found without the length */
+        fprintf(stderr, "Invalid FILE_DATA from %s\n", conn->addr);
+        conn->is_dead = 1;
+        return;
+    }
+
+    if (!conn->is_logined || conn->upload.fd == -1)
+    {
+        conn_receive_file(conn, -1, len);
+        send_response(conn, conn->is_logined ? STATUS_CONFLICT : STATUS_UNAUTHORIZED, "No upload started");
+        return;
+    }
+    if (off != conn->upload.off || len > conn->upload.size - off)
+    {
+        /* Tell the client where to go on from */
+        conn_receive_file(conn, -1, len);
+        snprintf(text, sizeof(text), "%llu", (unsigned long long)conn->upload.off);
+        send_response(conn, STATUS_CONFLICT, text);
+        return;
+    }
+
+    conn->upload.incoming = len;
+    conn_receive_file(conn, conn->upload.fd, len);
+}
+
+void file_received(struct connection *conn, int err)
+{
+    if (err != 0)
+    {
+        fprintf(stderr, "Upload of %s by user %d failed: %s\n", conn->upload.name, conn->user_id, strerror(err));
+        close_upload(conn);
+        send_response(conn, STATUS_SERVER_ERROR, "Could not store the file");
+        return;
+    }
+
+    /* The piece is hashed on a worker, the last one completing the upload */
+    struct upload_job *j = upload_job_alloc(conn);
+    if (j == NULL)
+    {
+        close_upload(conn);
+        return;
+    }
+    j->fd = conn->upload.fd;
+    conn->upload.fd = -1;
+    memcpy(j->name, conn->upload.name, sizeof(j->name));
+    j->size = conn->upload.size;
+    j->off = conn->upload.off;
+    j->end = conn->upload.off + conn->upload.incoming;
+    j->hash = conn->upload.hash;
+    j->has_hashes = conn->upload.has_hashes;
+    j->fast = conn->upload.fast;
+    memcpy(j->strong, conn->upload.strong, sizeof(j->strong));
+    conn->upload.incoming = 0;
+    db_submit(conn, &j->reply.job, upload_piece_run, upload_done);
+}
+
+struct download_job
+{
+    struct reply_job reply;
+    int fd; /* The object, -1 if there is none to send */
+    int owner_id;
+    char name[FILE_NAME_SIZE];
+    uint64_t off;
+    uint64_t size;
+};
+
+static void download_run(struct db_job *job)
+{
+    struct download_job *j = (struct download_job *)job;
+    unsigned char strong[HASH_STRONG_SIZE];
+    char path[FILE_NAME_SIZE + 32];
+
+    int rc = db_find_file(j->owner_id, j->name, strong, &j->size);
+    if (rc != DB_OK)
+    {
+        job_reply(&j->reply, rc == DB_NOT_FOUND ? STATUS_NOT_FOUND : STATUS_SERVER_ERROR,
+                  rc == DB_NOT_FOUND ? "No such file" : "Could not read the file");
+        return;
+    }
+    if (j->off > j->size)
+    {
+        job_reply(&j->reply, STATUS_BAD_REQUEST, "Invalid offset");
+        return;
+    }
+    object_path(path, sizeof(path), strong);
+    if ((j->fd = openat(storage_fd, path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        perror("Opening a stored file");
+        job_reply(&j->reply, STATUS_SERVER_ERROR, "Could not read the file");
+        return;
+    }
+    snprintf(path, sizeof(path), "%llu", (unsigned long long)j->size);
+    job_reply(&j->reply, STATUS_SUCCESS, path);
+}
+
+static void download_done(struct db_job *job, struct connection *conn)
+{
+    struct download_job *j = (struct download_job *)job;
+
+    reply_done(job, conn);
+    if (j->fd != -1)
+    {
+        conn_send_file(conn, MSG_FILE_DATA, j->fd, j->off, j->size - j->off);
+        j->fd = -1;
+    }
+}
+
+static void download_release(struct db_job *job)
+{
+    struct download_job *j = (struct download_job *)job;
+    if (j->fd != -1)
+        close(j->fd);
+}
+
+/*
+@brief Download a file: owner_id|name|offset
+
+The reply is 200|size; the bytes from offset on follow as FILE_DATA frames,
+paced by the connection's transfer cap, with other replies in between. Files
+are not shared: only their owner may fetch them
+*/
+static void handle_download_file(struct connection *conn, const struct frame *frame)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    int owner_id = field_id(field_next(&p, &left));
+    struct field name = field_next(&p, &left);
+    uint64_t off;
+
+    if (storage_fd == -1)
+    {
+        send_response(conn, STATUS_SERVER_ERROR, "No file storage");
+        return;
+    }
+    if (owner_id < 0 || !file_name_ok(name) || field_size(field_next(&p, &left), &off) == -1)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Invalid file");
+        return;
+    }
+    if (owner_id != conn->user_id)
+    {
+        send_response(conn, STATUS_FORBIDDEN, "Not your file");
+        return;
+    }
+
+    struct download_job *j = reply_job_alloc(conn, sizeof(*j));
+    if (j == NULL)
+        return;
+    j->reply.job.release = download_release;
+    j->fd = -1;
+    j->owner_id = owner_id;
+    field_copy(name, j->name, sizeof(j->name));
+    j->off = off;
+    db_submit(conn, &j->reply.job, download_run, download_done);
+}
+
+/* Session state a command is accepted in */
+#define AUTH_ANY 0
+#define AUTH_LOGGED_IN 1
+#define AUTH_LOGGED_OUT 2
+
+struct command
+{
+    const char *name;
+    void (*handle)(struct connection *conn, const struct frame *frame);
+    unsigned char fields; /* '|'-separated fields the payload has at least */
+    unsigned char auth;
+};
+
+/* Client commands by type code; a NULL handler is not implemented yet */
+static const struct command commands[N_COMMANDS] = {
+    [CMD_REGISTER - CMD_FIRST] = {"REGISTER", handle_register, 2, AUTH_ANY},
+    [CMD_LOGIN - CMD_FIRST] = {"LOGIN", handle_login, 1, AUTH_LOGGED_OUT},
+    [CMD_LOGOUT - CMD_FIRST] = {"LOGOUT", handle_logout, 0, AUTH_LOGGED_IN},
+    [CMD_SEND_MESSAGE - CMD_FIRST] = {"SEND_MESSAGE", handle_send_message, 2, AUTH_LOGGED_IN},
+    [CMD_SEND_GROUP_MESSAGE - CMD_FIRST] = {"SEND_GROUP_MESSAGE", handle_send_group_message, 2, AUTH_LOGGED_IN},
+    [CMD_SEND_FRIEND_REQUEST - CMD_FIRST] = {"SEND_FRIEND_REQUEST", NULL, 0, AUTH_LOGGED_IN},
+    [CMD_ACCEPT_FRIEND_REQUEST - CMD_FIRST] = {"ACCEPT_FRIEND_REQUEST", NULL, 0, AUTH_LOGGED_IN},
+    [CMD_REJECT_FRIEND_REQUEST - CMD_FIRST] = {"REJECT_FRIEND_REQUEST", NULL, 0, AUTH_LOGGED_IN},
+    [CMD_UNFRIEND - CMD_FIRST] = {"UNFRIEND", NULL, 0, AUTH_LOGGED_IN},
+    [CMD_GET_FRIEND_LIST - CMD_FIRST] = {"GET_FRIEND_LIST", NULL, 0, AUTH_LOGGED_IN},
+    [CMD_CREATE_GROUP - CMD_FIRST] = {"CREATE_GROUP", handle_create_group, 1, AUTH_LOGGED_IN},
+    [CMD_ADD_TO_GROUP - CMD_FIRST] = {"ADD_TO_GROUP", handle_add_to_group, 2, AUTH_LOGGED_IN},
+    [CMD_REMOVE_FROM_GROUP - CMD_FIRST] = {"REMOVE_FROM_GROUP", handle_remove_from_group, 2, AUTH_LOGGED_IN},
+    [CMD_LEAVE_GROUP - CMD_FIRST] = {"LEAVE_GROUP", handle_leave_group, 1, AUTH_LOGGED_IN},
+    [CMD_GET_OFFLINE_MESSAGES - CMD_FIRST] = {"GET_OFFLINE_MESSAGES", handle_get_offline_messages, 0, AUTH_LOGGED_IN},
+    [CMD_PONG - CMD_FIRST] = {"PONG", handle_pong, 0, AUTH_ANY},
+    [CMD_HELLO - CMD_FIRST] = {"HELLO", handle_hello, 1, AUTH_ANY},
+    [CMD_SEND_MESSAGE_CHUNK - CMD_FIRST] = {"SEND_MESSAGE_CHUNK", handle_send_message_chunk, 2, AUTH_LOGGED_IN},
+    [CMD_UPLOAD_FILE - CMD_FIRST] = {"UPLOAD_FILE", handle_upload_file, 2, AUTH_LOGGED_IN},
+    /* Checked by the handler: its body must be taken off the wire even when refused */
+    [CMD_FILE_DATA - CMD_FIRST] = {"FILE_DATA", handle_file_data, 0, AUTH_ANY},
+    [CMD_DOWNLOAD_FILE - CMD_FIRST] = {"DOWNLOAD_FILE", handle_download_file, 3, AUTH_LOGGED_IN},
+};
+
+/* Per-command counters, one row per reactor so each is written by one thread */
+struct command_stats
+{
+    uint64_t count;
+    uint64_t ns;     /* Time spent in the handler, on the reactor */
+    uint64_t max_ns;
+};
+
+static struct
+{
+    struct command_stats cmd[N_COMMANDS];
+} __attribute__((aligned(64))) command_stats[MAX_REACTORS];
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+@brief Count whether a payload has at least n '|'-separated fields
+
+An empty payload has none, any other at least one
+*/
+static int has_fields(const struct frame *frame, unsigned n)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+
+    if (n == 0)
+        return 1;
+    if (left == 0)
+        return 0;
+    while (--n > 0)
+    {
+        const char *sep = memchr(p, '|', left);
+        if (sep == NULL)
+            return 0;
+        left -= sep + 1 - p;
+        p = sep + 1;
+    }
+    return 1;
+}
+
+void process_frame(struct connection *conn, const struct frame *frame)
+{
+    unsigned idx = (unsigned)frame->type - CMD_FIRST;
+
+    if (idx >= N_COMMANDS || commands[idx].handle == NULL)
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Unsupported command");
+        return;
+    }
+
+    const struct command *cmd = &commands[idx];
+    if (cmd->auth == AUTH_LOGGED_IN && !conn->is_logined)
+    {
+        send_response(conn, STATUS_UNAUTHORIZED, "Not logged in");
+        return;
+    }
+    if (cmd->auth == AUTH_LOGGED_OUT && conn->is_logined)
+    {
+        send_response(conn, STATUS_CONFLICT, "Already logged in");
+        return;
+    }
+    if (!has_fields(frame, cmd->fields))
+    {
+        send_response(conn, STATUS_BAD_REQUEST, "Missing fields");
+        return;
+    }
+
+    if (stats_interval == 0)
+    {
+        cmd->handle(conn, frame);
+        return;
+    }
+
+    struct command_stats *st = &command_stats[conn->owner->id].cmd[idx];
+    uint64_t start = monotonic_ns();
+    cmd->handle(conn, frame);
+    uint64_t ns = monotonic_ns() - start;
+
+    __atomic_store_n(&st->count, st->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->ns, st->ns + ns, __ATOMIC_RELAXED);
+    if (ns > st->max_ns)
+        __atomic_store_n(&st->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+/*
+@brief Thread entry point printing the per-command counters every -m seconds
+
+Totals since start over all reactors; the time is what the reactor spent in
+the handler, storage work on the workers is not included. Then what deflate
+saved on the connections that chose it, and the CPU time it took
+*/
+void *stats_thread(void *arg)
+{
+    int n_reactors = *(int *)arg;
+
+    while (1)
+    {
+        sleep(stats_interval);
+        printf("%-22s %10s %10s %10s\n", "command", "count", "avg_us", "max_us");
+        for (int i = 0; i < N_COMMANDS; i++)
+        {
+            uint64_t count = 0, ns = 0, max_ns = 0;
+            for (int r = 0; r < n_reactors; r++)
+            {
+                struct command_stats *st = &command_stats[r].cmd[i];
+                uint64_t m = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+                count += __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+                ns += __atomic_load_n(&st->ns, __ATOMIC_RELAXED);
+                max_ns = m > max_ns ? m : max_ns;
+            }
+            if (count > 0)
+                printf("%-22s %10lu %10.1f %10.1f\n", commands[i].name, (unsigned long)count,
+                       ns / 1000.0 / count, max_ns / 1000.0);
+        }
+
+        struct compress_stats total = {0};
+        for (int r = 0; r < n_reactors; r++)
+        {
+            total.frames += __atomic_load_n(&compress_stats[r].frames, __ATOMIC_RELAXED);
+            total.skipped += __atomic_load_n(&compress_stats[r].skipped, __ATOMIC_RELAXED);
+            total.bytes_in += __atomic_load_n(&compress_stats[r].bytes_in, __ATOMIC_RELAXED);
+            total.bytes_out += __atomic_load_n(&compress_stats[r].bytes_out, __ATOMIC_RELAXED);
+            total.cpu_ns += __atomic_load_n(&compress_stats[r].cpu_ns, __ATOMIC_RELAXED);
+        }
+        if (total.bytes_in > 0)
+            printf("deflate: %lu frame(s) compressed, %lu not, %lu -> %lu bytes (ratio %.2f), %.1f ms CPU\n",
+                   (unsigned long)total.frames, (unsigned long)total.skipped, (unsigned long)total.bytes_in,
+                   (unsigned long)total.bytes_out, (double)total.bytes_in / total.bytes_out, total.cpu_ns / 1e6);
+        fflush(stdout);
+    }
+    return NULL;
+}
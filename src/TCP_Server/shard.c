@@ -0,0 +1,247 @@
+#include "shard.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHARD_MASK (SHARD_QUEUE_SIZE - 1)
+
+int shard_link(struct reactor *reactors, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        struct reactor *r = &reactors[i];
+        r->shards = reactors;
+        r->n_shards = n;
+        r->inbox = calloc(n, sizeof(*r->inbox));
+        r->outbox = calloc(n, sizeof(*r->outbox));
+        if (r->inbox == NULL || r->outbox == NULL)
+            return -1;
+    }
+
+    for (int from = 0; from < n; from++)
+    {
+        for (int to = 0; to < n; to++)
+        {
+            if (from == to)
+                continue;
+            struct shard_queue *q = aligned_alloc(64, sizeof(*q));
+            if (q == NULL)
+                return -1;
+            memset(q, 0, sizeof(*q));
+            q->backlog_tail = &q->backlog;
+            reactors[from].outbox[to] = q;
+            reactors[to].inbox[from] = q;
+        }
+    }
+    return 0;
+}
+
+struct reactor *shard_home(struct reactor *r, int user_id)
+{
+    return &r->shards[(unsigned)user_id % r->n_shards];
+}
+
+/**
+ * @return: 1 if the call was put in the ring, 0 if it is full
+ */
+static int shard_push(struct shard_queue *q, struct reactor_call *call)
+{
+    unsigned tail = q->tail;
+
+    if (tail - q->head_cache == SHARD_QUEUE_SIZE)
+    {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache == SHARD_QUEUE_SIZE)
+            return 0;
+    }
+    q->slots[tail & SHARD_MASK] = call;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void shard_send(struct reactor *from, struct reactor *to, struct reactor_call *call)
+{
+    struct shard_queue *q = from->outbox[to->id];
+
+    /* Behind a backlog, a call must wait its turn to keep the order */
+    if (q->backlog != NULL || !shard_push(q, call))
+    {
+        call->next = NULL;
+        *q->backlog_tail = call;
+        q->backlog_tail = &call->next;
+    }
+    q->signal = 1;
+    from->outbox_pending = 1;
+}
+
+void shard_flush(struct reactor *r)
+{
+    uint64_t one = 1;
+
+    if (!r->outbox_pending)
+        return;
+    r->outbox_pending = 0;
+
+    for (int to = 0; to < r->n_shards; to++)
+    {
+        struct shard_queue *q = r->outbox[to];
+        if (q == NULL || !q->signal)
+            continue;
+
+        while (q->backlog != NULL && shard_push(q, q->backlog))
+        {
+            if ((q->backlog = q->backlog->next) == NULL)
+                q->backlog_tail = &q->backlog;
+        }
+        /* Still full: the consumer is woken below, try again shortly */
+        if (q->backlog != NULL)
+            r->outbox_pending = 1;
+        else
+            q->signal = 0;
+
+        if (write(r->shards[to].wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("eventfd write error");
+    }
+}
+
+int shard_drain(struct reactor *r)
+{
+    int n = 0;
+
+    if (r->inbox == NULL)
+        return 0;
+    for (int from = 0; from < r->n_shards; from++)
+    {
+        struct shard_queue *q = r->inbox[from];
+        if (q == NULL)
+            continue;
+
+        unsigned head = q->head;
+        unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct reactor_call *call = q->slots[head & SHARD_MASK];
+            /* Free the slot first: the call may be sent straight back */
+            __atomic_store_n(&q->head, ++head, __ATOMIC_RELEASE);
+            call->fn(call);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void shard_visit(struct reactor *r, struct shard_delivery *d);
+static void shard_move_on(struct reactor *r, struct shard_delivery *d);
+
+static void shard_arrive(struct reactor_call *call)
+{
+    struct shard_delivery *d = (struct shard_delivery *)call;
+    shard_visit(d->at, d);
+}
+
+static void shard_return(struct reactor_call *call)
+{
+    struct shard_delivery *d = (struct shard_delivery *)call;
+    d->done(d);
+}
+
+/* A paced delivery, once the connection it waited for drained or went away */
+static void shard_drained(struct reactor_call *call)
+{
+    struct shard_delivery *d = (struct shard_delivery *)call;
+    shard_move_on(d->at, d);
+}
+
+/**
+ * Deliver to the users whose home is r, then go on to the next shard home to
+ * one of the others
+ * A paced delivery waits for the connection it left the most output queued
+ * on, when that is over XFER_AHEAD; the others cannot have much more
+ */
+static void shard_visit(struct reactor *r, struct shard_delivery *d)
+{
+    int n = r->n_shards;
+    int here = (r->id - d->origin->id + n) % n;
+    struct connection *slowest = NULL;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < d->n_users; i++)
+    {
+        int user_id = d->users[i];
+        int hop = ((int)((unsigned)user_id % n) - d->origin->id + n) % n;
+        int delivered = 0;
+
+        if (hop == here)
+        {
+            for (struct connection *c = reactor_find_user(r, user_id, NULL); c != NULL;
+                 c = reactor_find_user(r, user_id, c))
+            {
+                if (conn_send_shared(c, d->mb) < 0)
+                    continue;
+                delivered = 1;
+                if (slowest == NULL || c->out.bytes > slowest->out.bytes)
+                    slowest = c;
+            }
+        }
+        if (!delivered)
+            d->users[kept++] = user_id;
+    }
+    d->n_users = kept;
+
+    if (d->paced && slowest != NULL && slowest->out.bytes >= XFER_AHEAD)
+    {
+        d->waited = 1;
+        d->call.fn = shard_drained;
+        conn_wait_drain(slowest, &d->call);
+        return;
+    }
+    shard_move_on(r, d);
+}
+
+/**
+ * Pass the delivery on from r to the next shard home to one of the users left
+ * Shards are visited in id order starting from the origin, so the users still
+ * to visit are those whose home lies further along than r
+ */
+static void shard_move_on(struct reactor *r, struct shard_delivery *d)
+{
+    int n = r->n_shards;
+    int here = (r->id - d->origin->id + n) % n;
+    int next = n;
+
+    for (size_t i = 0; i < d->n_users; i++)
+    {
+        int hop = ((int)((unsigned)d->users[i] % n) - d->origin->id + n) % n;
+        if (hop > here && hop < next)
+            next = hop;
+    }
+
+    if (next < n)
+    {
+        d->at = &r->shards[(d->origin->id + next) % n];
+        d->call.fn = shard_arrive;
+        shard_send(r, d->at, &d->call);
+    }
+    else if (r != d->origin)
+    {
+        d->at = d->origin;
+        d->call.fn = shard_return;
+        shard_send(r, d->origin, &d->call);
+    }
+    else if (d->waited)
+    {
+        d->done(d);
+    }
+}
+
+int shard_deliver(struct reactor *r, struct shard_delivery *d)
+{
+    d->origin = r;
+    d->at = r;
+    d->waited = 0;
+    shard_visit(r, d);
+    return d->at == r && !d->waited;
+}
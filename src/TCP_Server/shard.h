@@ -0,0 +1,102 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#include "reactor.h"
+#include "msg_buf.h"
+
+/**
+ * User-sharded reactors
+ * Every user has a home shard, the reactor its logged-in sessions live on
+ * (a session accepted elsewhere moves there on login, see conn_migrate()),
+ * so a message for a user is delivered by exactly one reactor, found without
+ * any shared session map.
+ *
+ * Reactors pass work to each other over one single-producer single-consumer
+ * ring per ordered pair, with no lock. Calls sent during a loop iteration are
+ * announced to each destination with a single write to its wake_fd at the
+ * end of the iteration, and run there in the order they were sent.
+ */
+
+#define SHARD_QUEUE_SIZE 256 /* Calls in flight from one reactor to another, power of two */
+
+/**
+ * Ring from one reactor (producer) to another (consumer)
+ * Each side owns a cache line; the producer keeps a copy of the consumer's
+ * index and only reads the shared one when the ring looks full
+ */
+struct shard_queue
+{
+    /* Producer */
+    unsigned tail __attribute__((aligned(64)));
+    unsigned head_cache;
+    struct reactor_call *backlog; /* Calls that found the ring full, oldest first */
+    struct reactor_call **backlog_tail;
+    int signal; /* Calls sent since the consumer was last woken */
+
+    /* Consumer */
+    unsigned head __attribute__((aligned(64)));
+
+    struct reactor_call *slots[SHARD_QUEUE_SIZE] __attribute__((aligned(64)));
+};
+
+/**
+ * Connect n reactors (already initialised, ids 0..n-1) to each other
+ * Returns: 0 on success, -1 on error
+ */
+int shard_link(struct reactor *reactors, int n);
+
+/**
+ * Home reactor of user_id's sessions
+ */
+struct reactor *shard_home(struct reactor *r, int user_id);
+
+/**
+ * Run call->fn on reactor to, after the calls from sends to it so far; on
+ * from's thread. It is picked up once from ends its loop iteration
+ */
+void shard_send(struct reactor *from, struct reactor *to, struct reactor_call *call);
+
+/**
+ * Producer side, end of a loop iteration: move backlogged calls into the
+ * rings and wake the reactors that were sent something
+ */
+void shard_flush(struct reactor *r);
+
+/**
+ * Consumer side: run the calls the other reactors sent to r
+ * Returns: number of calls run
+ */
+int shard_drain(struct reactor *r);
+
+/**
+ * A message making the rounds of the shards: each one that is home to some
+ * of the users hands it to their connections, then passes it on
+ * A paced delivery first waits there for the output of the connections it
+ * was queued to to drain (conn_wait_drain()), so the sender of a long
+ * message in many deliveries goes no faster than its receiver reads
+ */
+struct shard_delivery
+{
+    struct reactor_call call;
+    struct reactor *origin;
+    struct reactor *at; /* Shard it is on or headed to */
+    struct msg_buf *mb; /* Queued by reference to each connection */
+    int *users;         /* Recipients; left holding those with no connection */
+    size_t n_users;
+    void (*done)(struct shard_delivery *d); /* On origin, once every shard was visited */
+    void *arg;
+    int paced;
+    int waited; /* Paused on some shard: done() is due even if every recipient lives on origin */
+};
+
+/**
+ * Deliver d->mb to the connections of d->users, starting on r; set paced first
+ * Returns: 1 if every recipient lives on r and none had to be waited for
+ * (done is not called, d->users is final already), 0 if the delivery went on
+ * to other shards or waits and d->done will run on r later
+ */
+int shard_deliver(struct reactor *r, struct shard_delivery *d);
+
+#endif // SHARD_H
@@ -1,5 +1,10 @@
 #include "tcp_utils.h"
+#include "frame.h"
 #include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -32,6 +37,211 @@ int send_all(int sock, const void *data, size_t len)
     return total_sent;
 }
 
+/**
+ * Wait for the kernel to report that the zero-copy sends numbered below
+ * `pending` are complete, so their pages may be written again
+ * @param sock: Socket file descriptor
+ * @param pending: Number of MSG_ZEROCOPY sends issued on the socket
+ * @param done: Completed sends so far, updated
+ * @return: 0 on success, -1 on error
+ */
+static int wait_zerocopy(int sock, uint32_t pending, uint32_t *done)
+{
+    while (*done < pending)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                /* Completions arrive on the error queue, reported as POLLERR */
+                struct pollfd pfd = {sock, 0, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            perror("recvmsg() error");
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                *done += serr->ee_data - serr->ee_info + 1; /* Inclusive range of send numbers */
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send an iovec list through socket with sendmsg(), handling partial sends
+ * After each partial send the iovecs already sent are skipped and the first
+ * unsent one is trimmed, so no bytes are copied together
+ * @param sock: Socket file descriptor
+ * @param iov: Buffers to send, modified as they are sent
+ * @param iovcnt: Number of iovecs
+ * @param zc: Zero-copy state of this socket, NULL to always copy
+ * @return: Total bytes sent on success, -1 on error
+ */
+int send_all_iov(int sock, struct iovec *iov, int iovcnt, struct zerocopy *zc)
+{
+    size_t len = 0;
+    size_t total_sent = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    int flags = MSG_NOSIGNAL;
+    if (zc != NULL && len >= zc->min_len)
+        flags |= MSG_ZEROCOPY;
+
+    while (total_sent < len)
+    {
+        while (iov->iov_len == 0)
+        {
+            iov++;
+            iovcnt--;
+        }
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t n = sendmsg(sock, &msg, flags);
+        if (n == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+        {
+            /* Out of pinned-page budget: this one goes out copied */
+            flags &= ~MSG_ZEROCOPY;
+            continue;
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("sendmsg() error");
+            return -1;
+        }
+        if (flags & MSG_ZEROCOPY)
+            zc->sent++;
+        total_sent += n;
+
+        for (size_t left = n; left > 0;)
+        {
+            size_t step = left < iov->iov_len ? left : iov->iov_len;
+            iov->iov_base = (char *)iov->iov_base + step;
+            iov->iov_len -= step;
+            left -= step;
+            if (iov->iov_len == 0 && left > 0)
+            {
+                iov++;
+                iovcnt--;
+            }
+        }
+    }
+
+    if (zc != NULL && zc->done < zc->sent && wait_zerocopy(sock, zc->sent, &zc->done) == -1)
+        return -1;
+    return total_sent;
+}
+
+/**
+ * Enable MSG_ZEROCOPY on a socket
+ * Below a few KiB the page pinning and completion round trip cost more than
+ * the copy they save, hence the threshold
+ * @param sock: Socket file descriptor
+ * @param zc: State to pass to send_all_iov() for this socket
+ * @param min_len: Smallest send worth doing without a copy
+ * @return: 0 on success, -1 on error
+ */
+int enable_zerocopy(int sock, struct zerocopy *zc, size_t min_len)
+{
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+        return -1;
+    zc->min_len = min_len;
+    zc->sent = 0;
+    zc->done = 0;
+    return 0;
+}
+
+/**
+ * Send a frame as two iovecs: the 6-byte header and the caller's payload
+ * @param sock: Socket file descriptor
+ * @param type: Command type
+ * @param payload: Payload bytes (may be NULL when len is 0)
+ * @param len: Payload length
+ * @return: Total bytes sent on success, -1 on error
+ */
+int send_frame(int sock, uint16_t type, const void *payload, uint32_t len)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+
+    if (len > FRAME_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Frame too large\n");
+        return -1;
+    }
+    frame_encode_header(header, type, len);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    return send_all_iov(sock, iov, 2, NULL);
+}
+
+/**
+ * Receive data from socket until a whole frame is available
+ * Uses the incremental decoder on the caller's ring, so bytes of the next
+ * frame stay buffered for the next call
+ * @param sock: Socket file descriptor
+ * @param rb: Receive ring of this socket
+ * @param frame: Receives type and length; payload points to buffer
+ * @param buffer: Buffer to store the payload (null-terminated)
+ * @param max_len: Maximum buffer size
+ * @return: 1 on success, 0 if connection closed, -1 on error
+ */
+int recv_frame(int sock, struct ring_buffer *rb, struct frame *frame, char *buffer, size_t max_len)
+{
+    struct frame_decoder dec;
+    int ret;
+
+    frame_decoder_init(&dec, max_len - 1);
+    while ((ret = frame_decode(&dec, rb, frame)) == FRAME_NEED_MORE)
+    {
+        size_t space;
+        char *dst = rb_write_ptr(rb, &space);
+
+        int bytes_recv = recv(sock, dst, space, 0);
+        if (bytes_recv < 0)
+        {
+            perror("recv() error");
+            return -1;
+        }
+        if (bytes_recv == 0)
+        {
+            // Connection closed
+            return 0;
+        }
+        rb_commit(rb, bytes_recv);
+    }
+
+    if (ret == FRAME_ERROR)
+    {
+        fprintf(stderr, "Buffer overflow: frame too long\n");
+        rb_consume(rb, rb_used(rb));
+        return -1;
+    }
+
+    memcpy(buffer, frame->payload, frame->length);
+    buffer[frame->length] = '\0';
+    rb_consume(rb, frame->length);
+    frame->payload = buffer;
+    return 1;
+}
+
 /**
  * Receive exact number of bytes from socket, handling partial receives
  * Loops until all bytes received, connection closed, or error
@@ -67,81 +277,71 @@ int recv_all(int sock, void *data, size_t len)
 
 /**
  * Receive data from socket until \r\n delimiter is found
- * Uses static buffer to store leftover data between calls
+ * Data is received into the caller's ring buffer; bytes after the delimiter
+ * stay there for the next call, so each socket needs its own ring
  * Automatically null-terminates the message (delimiter excluded)
  * @param sock: Socket file descriptor
+ * @param rb: Receive ring of this socket
  * @param buffer: Buffer to store message (without \r\n)
  * @param max_len: Maximum buffer size
  * @return: Message length (excluding \r\n), 0 if connection closed, -1 on error
  */
-int recv_until_delimiter(int sock, char *buffer, size_t max_len)
+int recv_until_delimiter(int sock, struct ring_buffer *rb, char *buffer, size_t max_len)
 {
-    static char leftover[BUFF_SIZE] = {0}; // Store leftover data between calls
-    static int leftover_len = 0;
-
-    int total_len = leftover_len;
-    char *delimiter_pos = NULL;
-
-    // Copy leftover data to buffer
-    if (leftover_len > 0)
-    {
-        memcpy(buffer, leftover, leftover_len);
-    }
+    size_t msg_len;
+    size_t scanned = 0; /* Only newly received bytes are searched */
 
-    while (1)
+    while (rb_scan_crlf(rb, &scanned, &msg_len, 1) == 0)
     {
-        // Check if we already have \r\n in buffer
-        delimiter_pos = strstr(buffer, "\r\n");
-        if (delimiter_pos != NULL)
-        {
-            // Found delimiter!
-            int msg_len = delimiter_pos - buffer;
-
-            // Calculate leftover data after \r\n
-            int after_delimiter = total_len - msg_len - 2; // -2 for \r\n
-            if (after_delimiter > 0)
-            {
-                // Save leftover for next call
-                memmove(leftover, delimiter_pos + 2, after_delimiter);
-                leftover_len = after_delimiter;
-            }
-            else
-            {
-                leftover_len = 0;
-            }
-
-            buffer[msg_len] = '\0'; // Null-terminate message
-            return msg_len;
-        }
-
-        // Need more data, check buffer space
-        if (total_len >= max_len - 1)
+        size_t space;
+        char *dst = rb_write_ptr(rb, &space);
+        if (space == 0 || rb_used(rb) >= max_len - 1)
         {
             fprintf(stderr, "Buffer overflow: message too long\n");
-            leftover_len = 0;
+            rb_consume(rb, rb_used(rb));
             return -1;
         }
 
-        // Receive more data
-        int bytes_recv = recv(sock, buffer + total_len, max_len - total_len - 1, 0);
-
+        int bytes_recv = recv(sock, dst, space, 0);
         if (bytes_recv < 0)
         {
             perror("recv() error");
-            leftover_len = 0;
+            rb_consume(rb, rb_used(rb));
             return -1;
         }
-
         if (bytes_recv == 0)
         {
             // Connection closed
-            leftover_len = 0;
+            rb_consume(rb, rb_used(rb));
             return 0;
         }
+        rb_commit(rb, bytes_recv);
+    }
 
-        total_len += bytes_recv;
-        buffer[total_len] = '\0';
+    if (msg_len >= max_len)
+    {
+        fprintf(stderr, "Buffer overflow: message too long\n");
+        rb_consume(rb, msg_len + 2);
+        return -1;
     }
+
+    memcpy(buffer, rb_peek(rb, msg_len), msg_len);
+    buffer[msg_len] = '\0'; // Null-terminate message
+    rb_consume(rb, msg_len + 2);
+    return msg_len;
+}
+
+/**
+ * Set O_NONBLOCK on a socket so recv/send/accept return EAGAIN instead of waiting
+ * @param sock: Socket file descriptor
+ * @return: 0 on success, -1 on error
+ */
+int set_nonblocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 }
 
 /**
@@ -3,19 +3,65 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+#include "ring_buffer.h"
 
 #define BUFF_SIZE (1 << 14)
+
+struct frame;
+
 /**
  * Send all data, handling partial sends
  * Returns: total bytes sent on success, -1 on error
  */
 int send_all(int sock, const void *data, size_t len);
 
+/**
+ * MSG_ZEROCOPY state of one socket, set up by enable_zerocopy()
+ */
+struct zerocopy
+{
+    size_t min_len; /* Sends of at least this many bytes skip the kernel copy */
+    uint32_t sent;  /* Zero-copy sends issued */
+    uint32_t done;  /* Of those, completions reported by the kernel */
+};
+
+/**
+ * Send every byte described by an iovec list, handling partial sends that end
+ * inside or between iovecs; the iov array is advanced in place
+ * With zc (NULL = always copy), large sends use MSG_ZEROCOPY and wait for the
+ * kernel to release the pages, so callers may reuse the buffers afterwards
+ * Returns: total bytes sent on success, -1 on error
+ */
+int send_all_iov(int sock, struct iovec *iov, int iovcnt, struct zerocopy *zc);
+
+/**
+ * Allow MSG_ZEROCOPY sends of at least min_len bytes on a socket
+ * Returns: 0 on success, -1 if the kernel or socket does not support it
+ */
+int enable_zerocopy(int sock, struct zerocopy *zc, size_t min_len);
+
 /**
  * Receive messages until \r\n delimiter is found
+ * rb holds bytes received past the delimiter for the next call (one ring per socket)
  * Returns: number of bytes in message (excluding \r\n), -1 on error, 0 on connection close
  */
-int recv_until_delimiter(int sock, char *buffer, size_t max_len);
+int recv_until_delimiter(int sock, struct ring_buffer *rb, char *buffer, size_t max_len);
+
+/**
+ * Send one [TYPE][LENGTH][PAYLOAD] frame; header and payload are gathered
+ * into the same write without being copied together
+ * Returns: total bytes sent on success, -1 on error
+ */
+int send_frame(int sock, uint16_t type, const void *payload, uint32_t len);
+
+/**
+ * Receive one frame; the payload is copied into buffer and null-terminated
+ * rb holds bytes received past the frame for the next call (one ring per socket)
+ * Returns: 1 on success (frame->payload = buffer), 0 on connection close, -1 on error
+ */
+int recv_frame(int sock, struct ring_buffer *rb, struct frame *frame, char *buffer, size_t max_len);
 
 /**
  * Receive exact number of bytes (handles partial receives)
@@ -23,6 +69,12 @@ int recv_until_delimiter(int sock, char *buffer, size_t max_len);
  */
 int recv_all(int sock, void *data, size_t len);
 
+/**
+ * Put a socket into non-blocking mode
+ * Returns: 0 on success, -1 on error
+ */
+int set_nonblocking(int sock);
+
 /**
  * Write log entry to log file
  * Format: [dd/mm/yyyy hh:mm:ss]$client_addr$request$response
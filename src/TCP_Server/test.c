@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "delim_scan.h"
+#include "frame.h"
+#include "test.h"
+
+/**
+ * Test runner, and the tests of the frame codec
+ */
+
+int failures;
+int checks;
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+unsigned rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 16);
+}
+
+void rb_put(struct ring_buffer *rb, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t space;
+        char *dst = rb_write_ptr(rb, &space);
+        size_t n = len < space ? len : space;
+        memcpy(dst, data, n);
+        rb_commit(rb, n);
+        data += n;
+        len -= n;
+        if (n == 0)
+            break;
+    }
+}
+
+static void test_frame_codec(void)
+{
+    char buf[64];
+    const unsigned char expect[] = {0x03, 0xE9, 0x00, 0x00, 0x00, 0x05, 'h', 'e', 'l', 'l', 'o'};
+
+    CHECK(frame_encode(buf, sizeof(buf), CMD_LOGIN, "hello", 5) == 11);
+    CHECK(memcmp(buf, expect, sizeof(expect)) == 0);
+    CHECK(frame_encode(buf, 10, CMD_LOGIN, "hello", 5) == -1);
+    CHECK(frame_encode(buf, FRAME_HEADER_SIZE, CMD_LOGOUT, NULL, 0) == FRAME_HEADER_SIZE);
+
+    const char *p = "12|alice||99999999999|-3";
+    uint32_t left = strlen(p);
+    struct field f = field_next(&p, &left);
+    CHECK(field_id(f) == 12);
+    f = field_next(&p, &left);
+    char name[8];
+    CHECK(field_copy(f, name, sizeof(name)) == 5 && strcmp(name, "alice") == 0);
+    CHECK(field_copy(f, name, 5) == -1);
+    f = field_next(&p, &left);
+    CHECK(f.len == 0 && field_id(f) == -1);
+    f = field_next(&p, &left);
+    uint64_t size;
+    CHECK(field_id(f) == -1);
+    CHECK(field_size(f, &size) == 0 && size == 99999999999ULL);
+    f = field_next(&p, &left);
+    CHECK(field_id(f) == -1 && field_size(f, &size) == -1);
+    f = field_next(&p, &left);
+    CHECK(f.len == 0 && left == 0);
+}
+
+/* Frames fed one byte at a time come out whole, in order, across ring wraps */
+static void test_frame_decoder(void)
+{
+    struct ring_buffer rb;
+    struct frame_decoder dec;
+    struct frame frame;
+    char stream[8192];
+    size_t len = 0;
+
+    CHECK(rb_init(&rb, 256) == 0);
+    frame_decoder_init(&dec, 200);
+
+    for (int i = 0; i < 40; i++)
+    {
+        char payload[200];
+        uint32_t n = (uint32_t)(i * 37 % 200);
+        memset(payload, 'a' + i % 26, n);
+        len += frame_encode(stream + len, sizeof(stream) - len, (uint16_t)(CMD_FIRST + i % N_COMMANDS), payload,
+                            n);
+    }
+
+    int seen = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        rb_put(&rb, stream + i, 1);
+        int rc;
+        while ((rc = frame_decode(&dec, &rb, &frame)) == FRAME_READY)
+        {
+            uint32_t n = (uint32_t)(seen * 37 % 200);
+            int ok = frame.type == CMD_FIRST + seen % N_COMMANDS && frame.length == n;
+            for (uint32_t k = 0; ok && k < n; k++)
+                ok = frame.payload[k] == 'a' + seen % 26;
+            CHECK(ok);
+            rb_consume(&rb, frame.length);
+            seen++;
+        }
+        CHECK(rc == FRAME_NEED_MORE);
+    }
+    CHECK(seen == 40 && rb_used(&rb) == 0);
+
+    /* A length over the limit is an error before any payload arrives */
+    unsigned char header[FRAME_HEADER_SIZE];
+    frame_encode_header(header, CMD_SEND_MESSAGE, 201);
+    rb_put(&rb, (const char *)header, sizeof(header));
+    CHECK(frame_decode(&dec, &rb, &frame) == FRAME_ERROR);
+    rb_free(&rb);
+}
+
+int main(void)
+{
+    test_frame_codec();
+    test_frame_decoder();
+    test_ring_buffer();
+    test_scan_impls();
+    test_crlf_scanner();
+    test_timer_wheel();
+    test_write_queue();
+    test_hashes();
+    test_deflate();
+    test_server();
+
+    printf("%d check(s), %d failure(s) (newline scan: %s)\n", checks, failures, scan_newlines_impl());
+    return failures != 0;
+}
@@ -0,0 +1,57 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+#include "ring_buffer.h"
+
+/**
+ * Behaviour tests of the server's building blocks, run by `make test`
+ * Each module's tests live in test_<module>.c and are run from test.c; each
+ * failed check prints its line, and the exit status is non-zero if any failed
+ */
+
+extern int failures;
+extern int checks;
+
+#define CHECK(cond)                                                             \
+    do                                                                          \
+    {                                                                           \
+        checks++;                                                               \
+        if (!(cond))                                                            \
+        {                                                                       \
+            failures++;                                                         \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, \
+                    __func__, #cond);                                           \
+        }                                                                       \
+    } while (0)
+
+/* Deterministic filler, so a failure can be replayed */
+unsigned rng(void);
+
+/* Write len bytes into the ring, as recv() would */
+void rb_put(struct ring_buffer *rb, const char *data, size_t len);
+
+/* test_ring_buffer.c */
+void test_ring_buffer(void);
+
+/* test_delim_scan.c */
+void test_scan_impls(void);
+void test_crlf_scanner(void);
+
+/* test_write_queue.c */
+void test_write_queue(void);
+
+/* test_timer_wheel.c */
+void test_timer_wheel(void);
+
+/* test_hash.c */
+void test_hashes(void);
+
+/* test_compress.c */
+void test_deflate(void);
+
+/* test_server.c, against the ./server binary */
+void test_server(void);
+
+#endif // TEST_H
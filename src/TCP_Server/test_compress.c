@@ -0,0 +1,53 @@
+#include <string.h>
+#include <sys/uio.h>
+
+#include "compress.h"
+#include "frame.h"
+#include "test.h"
+
+/**
+ * Tests of the per-frame deflate streams
+ */
+
+/* Frames deflated on one stream come back identical, and a frame sent as it
+ * is makes the next one start a new stream */
+void test_deflate(void)
+{
+    static char payload[FRAME_MAX_PAYLOAD], out[FRAME_MAX_PAYLOAD], back[FRAME_MAX_PAYLOAD];
+    struct frame_deflater *d = deflater_new();
+    struct frame_inflater *inf = inflater_new();
+    uint16_t type;
+
+    CHECK(d != NULL && inf != NULL);
+    for (int i = 0; i < 20; i++)
+    {
+        int noise = i % 5 == 3;
+        size_t len = 1000 + rng() % 4000;
+        for (size_t k = 0; k < len; k++)
+            payload[k] = noise ? (char)rng() : "0123|alice|hello there|1700000000|"[(k + i) % 34];
+
+        /* Two pieces, as the offline replay gathers them */
+        struct iovec iov[2] = {{payload, 7}, {payload + 7, len - 7}};
+        size_t n = deflater_frame(d, MSG_OFFLINE_MESSAGES_DATA, iov, 2, len, out, sizeof(out));
+        if (noise)
+        {
+            CHECK(n == 0);
+            continue;
+        }
+        CHECK(n > 0 && n < len / 4);
+        CHECK((out[2] & COMPRESS_RESET) == (i == 0 || i % 5 == 4 ? COMPRESS_RESET : 0));
+        int got = inflater_frame(inf, out, n, &type, back, sizeof(back));
+        CHECK(got == (int)len && type == MSG_OFFLINE_MESSAGES_DATA && memcmp(back, payload, len) == 0);
+    }
+
+    /* Corrupt data and a frame that would not fit are refused */
+    memset(payload, 'x', 2000);
+    struct iovec iov = {payload, 2000};
+    size_t n = deflater_frame(d, MSG_RESPONSE, &iov, 1, 2000, out, sizeof(out));
+    CHECK(n > 0);
+    CHECK(inflater_frame(inf, out, n, &type, back, 1000) == -1);
+    CHECK(inflater_frame(inf, "\x07\xd0", 2, &type, back, sizeof(back)) == -1);
+
+    deflater_free(d);
+    inflater_free(inf);
+}
@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "delim_scan.h"
+#include "ring_buffer.h"
+#include "test.h"
+
+/**
+ * Tests of the newline scanners and the CRLF search over the ring
+ */
+
+/* Every implementation finds what a byte loop finds, whatever max is */
+void test_scan_impls(void)
+{
+    static const char *const impls[] = {"memchr", "sse2", "avx2"};
+    const char *initial = scan_newlines_impl();
+    char buf[1000];
+    size_t expect[1000], got[1000];
+
+    for (int round = 0; round < 300; round++)
+    {
+        size_t len = rng() % sizeof(buf);
+        unsigned density = 1 + rng() % 40;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = rng() % density == 0 ? '\n' : (char)('a' + rng() % 26);
+        size_t max = 1 + rng() % 64;
+
+        size_t n_expect = 0, end = len;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (buf[i] != '\n')
+                continue;
+            if (n_expect == max)
+                break;
+            expect[n_expect++] = i;
+            if (n_expect == max)
+                end = i + 1;
+        }
+
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+        {
+            if (scan_newlines_use(impls[k]) == -1)
+                continue;
+            size_t scanned;
+            size_t n = scan_newlines(buf, len, got, max, &scanned);
+            CHECK(n == n_expect && memcmp(got, expect, n * sizeof(size_t)) == 0);
+            /* Stopping early never scans past a newline it did not report */
+            CHECK(n < max ? scanned == len : scanned >= end && memchr(buf + end, '\n', scanned - end) == NULL);
+        }
+    }
+    CHECK(scan_newlines_use("nope") == -1);
+    scan_newlines_use(initial);
+}
+
+/* Resumed scans report each CRLF once, including one split by a read or the ring's end */
+void test_crlf_scanner(void)
+{
+    static const char *const impls[] = {"memchr", "sse2", "avx2"};
+    const char *initial = scan_newlines_impl();
+    const char text[] = "LOGIN a b\r\nPING\r\n\r\nx\ny\r\nSEND 1 hello\r";
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+    {
+        if (scan_newlines_use(impls[k]) == -1)
+            continue;
+        for (size_t start = 0; start < 64; start += 7)
+        {
+            struct ring_buffer rb;
+            CHECK(rb_init(&rb, 64) == 0);
+            /* Start the empty ring elsewhere, so the text wraps at a different place */
+            rb.head = rb.tail = start;
+
+            size_t from = 0, offs[8], found[8], n_found = 0;
+            for (size_t i = 0; i < sizeof(text) - 1; i += 3)
+            {
+                size_t n = sizeof(text) - 1 - i < 3 ? sizeof(text) - 1 - i : 3;
+                rb_put(&rb, text + i, n);
+                size_t got = rb_scan_crlf(&rb, &from, offs, 8);
+                for (size_t j = 0; j < got && n_found < 8; j++)
+                    found[n_found++] = offs[j];
+                CHECK(from == rb_used(&rb));
+            }
+            CHECK(n_found == 4 && found[0] == 9 && found[1] == 15 && found[2] == 17 && found[3] == 22);
+            CHECK(rb_find_crlf(&rb, 24) == -1);
+            CHECK(rb_find_crlf(&rb, 11) == 15);
+            rb_free(&rb);
+        }
+    }
+    scan_newlines_use(initial);
+}
@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+#include "test.h"
+
+/**
+ * Tests of the content hashes, XXH64 and SHA-256
+ */
+
+static void hex64(uint64_t v, char out[17])
+{
+    snprintf(out, 17, "%016llx", (unsigned long long)v);
+}
+
+void test_hashes(void)
+{
+    static const struct
+    {
+        const char *input;
+        const char *xxh64;
+        const char *sha256;
+    } vectors[] = {
+        {"", "ef46db3751d8e999", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", "44bc2cf5ad770999", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"Nobody inspects the spammish repetition", "fbcea83c8a378bf1",
+         "031edd7d41651593c5fe5c006fa5752b37fddff7bc4e843aa6af0c950f4b9406"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", NULL,
+         "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    };
+    char hex[HASH_STRONG_HEX];
+    char fast_hex[17];
+
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+    {
+        struct content_hash h;
+        uint64_t fast;
+        unsigned char strong[HASH_STRONG_SIZE], parsed[HASH_STRONG_SIZE];
+
+        content_hash_init(&h);
+        content_hash_update(&h, vectors[i].input, strlen(vectors[i].input));
+        content_hash_final(&h, &fast, strong);
+        hex64(fast, fast_hex);
+        hash_strong_to_hex(strong, hex);
+        CHECK(vectors[i].xxh64 == NULL || strcmp(fast_hex, vectors[i].xxh64) == 0);
+        CHECK(strcmp(hex, vectors[i].sha256) == 0);
+        CHECK(hash_strong_from_hex(hex, strlen(hex), parsed) == 0 && memcmp(parsed, strong, sizeof(strong)) == 0);
+    }
+
+    /* Fed in pieces of any size, as uploads stream in, the result is the same */
+    static unsigned char data[100000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)rng();
+    struct content_hash whole, pieces;
+    uint64_t fast_whole, fast_pieces;
+    unsigned char strong_whole[HASH_STRONG_SIZE], strong_pieces[HASH_STRONG_SIZE];
+    content_hash_init(&whole);
+    content_hash_update(&whole, data, sizeof(data));
+    content_hash_final(&whole, &fast_whole, strong_whole);
+    content_hash_init(&pieces);
+    for (size_t off = 0; off < sizeof(data);)
+    {
+        size_t n = 1 + rng() % 200;
+        if (n > sizeof(data) - off)
+            n = sizeof(data) - off;
+        content_hash_update(&pieces, data + off, n);
+        off += n;
+    }
+    content_hash_final(&pieces, &fast_pieces, strong_pieces);
+    CHECK(fast_whole == fast_pieces && memcmp(strong_whole, strong_pieces, HASH_STRONG_SIZE) == 0);
+
+    uint64_t fast;
+    CHECK(hash_fast_from_hex("fbcea83c8a378bf1", 16, &fast) == 0 && fast == 0xfbcea83c8a378bf1ULL);
+    CHECK(hash_fast_from_hex("", 0, &fast) == -1 && hash_fast_from_hex("12345678901234567", 17, &fast) == -1);
+    CHECK(hash_strong_from_hex("abc", 3, strong_whole) == -1);
+}
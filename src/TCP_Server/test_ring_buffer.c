@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "ring_buffer.h"
+#include "test.h"
+
+/**
+ * Tests of the input ring buffer
+ */
+
+/* rb_peek() gives a contiguous view of bytes that wrap around the ring */
+void test_ring_buffer(void)
+{
+    struct ring_buffer rb;
+    char data[100];
+
+    CHECK(rb_init(&rb, 100) == 0 && rb.cap == 128);
+    for (int i = 0; i < 100; i++)
+        data[i] = (char)i;
+    rb_put(&rb, data, 100);
+    rb_consume(&rb, 90);
+    rb_put(&rb, data, 60); /* 10 left + 60 wrap past the end */
+    CHECK(rb_used(&rb) == 70);
+    char *view = rb_peek(&rb, 70);
+    CHECK(memcmp(view, data + 90, 10) == 0 && memcmp(view + 10, data, 60) == 0);
+    rb_consume(&rb, 70);
+    CHECK(rb_used(&rb) == 0 && rb.head == 0);
+    rb_free(&rb);
+}
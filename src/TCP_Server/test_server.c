@@ -0,0 +1,460 @@
+#define _GNU_SOURCE /* nftw() flags */
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "frame.h"
+#include "hash.h"
+#include "tcp_utils.h"
+#include "test.h"
+
+/**
+ * Loopback tests of the server's request paths: the ./server that make test
+ * builds runs in a temporary directory on a free port, with a storage
+ * directory, and clients speak the binary protocol to it over TCP
+ */
+
+#define CLIENT_TIMEOUT_S 10
+
+static char server_dir[] = "/tmp/chat-test-XXXXXX";
+static pid_t server_pid = -1;
+static int server_port;
+
+/* One connection to the server */
+struct client
+{
+    int fd;
+    int user_id;
+    struct ring_buffer rb; /* Received past the last frame */
+};
+
+static char payload[FRAME_MAX_PAYLOAD];
+static char reply[BUFF_SIZE]; /* Payload of the last frame received, null-terminated */
+
+/* A port nothing listens on at the moment */
+static int free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int port = -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd != -1 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    if (fd != -1)
+        close(fd);
+    return port;
+}
+
+static void client_close(struct client *c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    rb_free(&c->rb);
+}
+
+/**
+ * Connect and read past the greeting line
+ * @return: 0 on success, -1 if the server is not up
+ */
+static int client_connect(struct client *c)
+{
+    struct sockaddr_in addr;
+    struct timeval timeout = {CLIENT_TIMEOUT_S, 0};
+
+    c->user_id = 0;
+    if (rb_init(&c->rb, BUFF_SIZE) == -1)
+    {
+        c->fd = -1;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(server_port);
+    if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        recv_until_delimiter(c->fd, &c->rb, reply, sizeof(reply)) <= 0)
+    {
+        client_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Next frame from the server, its payload in reply
+ * @return: its type, -1 on error
+ */
+static int next_frame(struct client *c, struct frame *frame)
+{
+    if (recv_frame(c->fd, &c->rb, frame, reply, sizeof(reply)) != 1)
+        return -1;
+    return frame->type;
+}
+
+/**
+ * Skip frames up to the next RESPONSE, "status|text" left in reply
+ * @return: the status, -1 on error
+ */
+static int response(struct client *c)
+{
+    struct frame frame;
+    int rc;
+
+    while ((rc = next_frame(c, &frame)) != -1 && rc != MSG_RESPONSE)
+        ;
+    return rc == -1 ? -1 : atoi(reply);
+}
+
+/**
+ * Send a request and wait for its RESPONSE
+ * @return: the status, -1 on error
+ */
+static int request(struct client *c, uint16_t type, const void *data, uint32_t len)
+{
+    if (send_frame(c->fd, type, data, len) == -1)
+        return -1;
+    return response(c);
+}
+
+/**
+ * Register a user (or find it registered) and log it in on a new connection
+ * @return: 0 on success, -1 on error
+ */
+static int client_login(struct client *c, const char *name)
+{
+    char account[2 * USERNAME_SIZE];
+    int len = snprintf(account, sizeof(account), "%s|secret", name);
+
+    if (client_connect(c) == -1)
+        return -1;
+    if (request(c, CMD_REGISTER, account, len) == -1 || request(c, CMD_LOGIN, account, len) != 200)
+    {
+        client_close(c);
+        return -1;
+    }
+    c->user_id = atoi(strchr(reply, '|') + 1);
+    return 0;
+}
+
+static int server_start(void)
+{
+    char bin[PATH_MAX], path[PATH_MAX], port[16];
+    struct client probe;
+
+    if (realpath("server", bin) == NULL || mkdtemp(server_dir) == NULL)
+        return -1;
+    snprintf(path, sizeof(path), "%s/database", server_dir);
+    if (mkdir(path, 0755) == -1 || (server_port = free_port()) == -1)
+        return -1;
+    snprintf(port, sizeof(port), "%d", server_port);
+
+    server_pid = fork();
+    if (server_pid == 0)
+    {
+        /* Its log goes next to its database, out of the test output */
+        int log;
+        if (chdir(server_dir) == -1 || (log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+            _exit(127);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execl(bin, bin, "-w", "2", port, "storage", (char *)NULL);
+        _exit(127);
+    }
+    if (server_pid == -1)
+        return -1;
+
+    for (int i = 0; i < 100; i++)
+    {
+        if (client_connect(&probe) == 0)
+        {
+            client_close(&probe);
+            return 0;
+        }
+        usleep(50000);
+    }
+    return -1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void server_stop(void)
+{
+    if (server_pid > 0)
+    {
+        kill(server_pid, SIGKILL);
+        waitpid(server_pid, NULL, 0);
+    }
+    nftw(server_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Send msg to a user in chunks of at most chunk bytes
+ * @return: 0 if every chunk was acknowledged, the last with "Message sent"
+ */
+static int send_chunked(struct client *c, int to, const char *msg, size_t len, size_t chunk)
+{
+    for (size_t off = 0; off < len; off += chunk)
+    {
+        size_t n = len - off < chunk ? len - off : chunk;
+        int more = off + n < len;
+        int head = snprintf(payload, sizeof(payload), "%d|%d|", to, more);
+        memcpy(payload + head, msg + off, n);
+        if (request(c, CMD_SEND_MESSAGE_CHUNK, payload, head + n) != 200 ||
+            strcmp(reply, more ? "200|Chunk stored" : "200|Message sent") != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append the data of a MESSAGE_CHUNK_RECEIVED to msg at *len
+ * message_id|sender_id|sender_username|timestamp|more|data
+ * @return: its more flag, -1 if it does not parse or fit
+ */
+static int take_chunk(const struct frame *frame, char *msg, size_t cap, size_t *len)
+{
+    const char *p = frame->payload;
+    uint32_t left = frame->length;
+    struct field more;
+
+    for (int i = 0; i < 4; i++)
+        field_next(&p, &left);
+    more = field_next(&p, &left);
+    if (more.len != 1 || *len + left > cap)
+        return -1;
+    memcpy(msg + *len, p, left);
+    *len += left;
+    return more.data[0] == '1';
+}
+
+/* A message in chunks reaches an online receiver live, one relayed chunk per
+ * chunk sent, and an offline one through GET_OFFLINE_MESSAGES, whole */
+static void test_chunk_relay(void)
+{
+    static char msg[5 * MESSAGE_CHUNK_MAX], got[sizeof(msg)];
+    struct client a, b;
+    struct frame frame;
+    size_t got_len = 0;
+    int type, relayed = 0, more = 1;
+
+    CHECK(client_login(&a, "relay_a") == 0);
+    CHECK(client_login(&b, "relay_b") == 0);
+    if (a.fd == -1 || b.fd == -1)
+        return;
+    for (size_t i = 0; i < sizeof(msg); i++)
+        msg[i] = (char)rng();
+
+    CHECK(send_chunked(&a, b.user_id, msg, sizeof(msg), MESSAGE_CHUNK_MAX) == 0);
+    while (more == 1 && (type = next_frame(&b, &frame)) != -1)
+    {
+        if (type == MSG_MESSAGE_CHUNK_RECEIVED)
+        {
+            more = take_chunk(&frame, got, sizeof(got), &got_len);
+            relayed++;
+        }
+    }
+    CHECK(more == 0 && relayed == 5);
+    CHECK(got_len == sizeof(msg) && memcmp(got, msg, sizeof(msg)) == 0);
+
+    /* Sent while the receiver is logged out, it is replayed whole */
+    CHECK(request(&b, CMD_LOGOUT, NULL, 0) == 200);
+    CHECK(send_chunked(&a, b.user_id, msg, sizeof(msg), 5000) == 0);
+    CHECK(request(&b, CMD_LOGIN, "relay_b|secret", 14) == 200);
+    CHECK(send_frame(b.fd, CMD_GET_OFFLINE_MESSAGES, NULL, 0) != -1);
+    got_len = 0;
+    while ((type = next_frame(&b, &frame)) == MSG_MESSAGE_CHUNK_RECEIVED)
+        take_chunk(&frame, got, sizeof(got), &got_len);
+    CHECK(type == MSG_OFFLINE_MESSAGES_DATA);
+    CHECK(got_len == sizeof(msg) && memcmp(got, msg, sizeof(msg)) == 0);
+
+    /* Delivered now, so not replayed again */
+    CHECK(send_frame(b.fd, CMD_GET_OFFLINE_MESSAGES, NULL, 0) != -1);
+    CHECK(next_frame(&b, &frame) == MSG_OFFLINE_MESSAGES_DATA && strcmp(reply, "0") == 0);
+    client_close(&a);
+    client_close(&b);
+}
+
+/**
+ * Send the file bytes from off up to len, one FILE_DATA piece at a time
+ * @return: the status of the last reply, 201 once the upload is complete
+ */
+static int upload_body(struct client *c, const char *data, size_t off, size_t len)
+{
+    int status = -1;
+
+    while (off < len)
+    {
+        size_t n = len - off < FILE_PIECE_SIZE ? len - off : FILE_PIECE_SIZE;
+        int head = snprintf(payload, sizeof(payload), "%zu|%zu", off, n);
+        if (send_frame(c->fd, CMD_FILE_DATA, payload, head) == -1 || send_all(c->fd, data + off, n) == -1)
+            return -1;
+        status = response(c);
+        if (status != 200)
+            return status;
+        off = strtoull(strchr(reply, '|') + 1, NULL, 10);
+    }
+    return status;
+}
+
+/**
+ * Download a file from off into buf
+ * @return: the status of the reply, the bytes received in *got
+ */
+static int download(struct client *c, int owner_id, const char *name, size_t off, char *buf, size_t cap,
+                    size_t *got)
+{
+    struct frame frame;
+    size_t size;
+    int status, len = snprintf(payload, sizeof(payload), "%d|%s|%zu", owner_id, name, off);
+
+    *got = 0;
+    if ((status = request(c, CMD_DOWNLOAD_FILE, payload, len)) != 200)
+        return status;
+    size = strtoull(strchr(reply, '|') + 1, NULL, 10);
+    while (off + *got < size && next_frame(c, &frame) != -1)
+    {
+        if (frame.type != MSG_FILE_DATA || *got + frame.length > cap)
+            return -1;
+        memcpy(buf + *got, frame.payload, frame.length);
+        *got += frame.length;
+    }
+    return status;
+}
+
+/* A file uploaded in pieces, across a reconnect, comes back the same, to its
+ * owner only */
+static void test_upload_download(void)
+{
+    static char file[2 * FILE_PIECE_SIZE + 12345], got[sizeof(file)];
+    struct client a, b;
+    size_t got_len;
+    char offer[64];
+    int len = snprintf(offer, sizeof(offer), "notes.bin|%zu", sizeof(file));
+
+    CHECK(client_login(&a, "files_a") == 0);
+    CHECK(client_login(&b, "files_b") == 0);
+    if (a.fd == -1 || b.fd == -1)
+        return;
+    for (size_t i = 0; i < sizeof(file); i++)
+        file[i] = (char)rng();
+
+    /* The first piece survives the connection, and the upload goes on from it */
+    CHECK(request(&a, CMD_UPLOAD_FILE, offer, len) == 200 && strcmp(reply, "200|0") == 0);
+    CHECK(upload_body(&a, file, 0, FILE_PIECE_SIZE) == 200);
+    client_close(&a);
+    CHECK(client_login(&a, "files_a") == 0);
+    if (a.fd == -1)
+        return;
+    CHECK(request(&a, CMD_UPLOAD_FILE, offer, len) == 200 && strtoull(reply + 4, NULL, 10) == FILE_PIECE_SIZE);
+    CHECK(upload_body(&a, file, FILE_PIECE_SIZE, sizeof(file)) == 201);
+
+    CHECK(download(&a, a.user_id, "notes.bin", 0, got, sizeof(got), &got_len) == 200);
+    CHECK(got_len == sizeof(file) && memcmp(got, file, sizeof(file)) == 0);
+    CHECK(download(&a, a.user_id, "notes.bin", 1000, got, sizeof(got), &got_len) == 200);
+    CHECK(got_len == sizeof(file) - 1000 && memcmp(got, file + 1000, got_len) == 0);
+    CHECK(download(&a, a.user_id, "missing.bin", 0, got, sizeof(got), &got_len) == 404);
+    CHECK(download(&b, a.user_id, "notes.bin", 0, got, sizeof(got), &got_len) == 403);
+    client_close(&a);
+    client_close(&b);
+}
+
+/* An offer of a file with its hashes: name|size|xxh64|sha256 */
+static int offer_hashed(char *offer, size_t cap, const char *name, const char *data, size_t len)
+{
+    struct content_hash h;
+    uint64_t fast;
+    unsigned char strong[HASH_STRONG_SIZE];
+    char hex[HASH_STRONG_HEX];
+
+    content_hash_init(&h);
+    content_hash_update(&h, data, len);
+    content_hash_final(&h, &fast, strong);
+    hash_strong_to_hex(strong, hex);
+    return snprintf(offer, cap, "%s|%zu|%016llx|%s", name, len, (unsigned long long)fast, hex);
+}
+
+/* Content is stored once, but only its owner skips the upload by its hashes;
+ * a body that does not match the hashes announced is refused and dropped */
+static void test_dedup(void)
+{
+    static char file[FILE_PIECE_SIZE + 999], got[sizeof(file)];
+    struct client a, b;
+    size_t got_len;
+    char offer[FILE_NAME_SIZE + 128];
+    int len;
+
+    CHECK(client_login(&a, "dedup_a") == 0);
+    CHECK(client_login(&b, "dedup_b") == 0);
+    if (a.fd == -1 || b.fd == -1)
+        return;
+    for (size_t i = 0; i < sizeof(file); i++)
+        file[i] = (char)rng();
+
+    len = offer_hashed(offer, sizeof(offer), "first.bin", file, sizeof(file));
+    CHECK(request(&a, CMD_UPLOAD_FILE, offer, len) == 200 && strcmp(reply, "200|0") == 0);
+    CHECK(upload_body(&a, file, 0, sizeof(file)) == 201);
+
+    /* The same content under another name of the owner's needs no body */
+    len = offer_hashed(offer, sizeof(offer), "second.bin", file, sizeof(file));
+    CHECK(request(&a, CMD_UPLOAD_FILE, offer, len) == 201);
+    CHECK(download(&a, a.user_id, "second.bin", 0, got, sizeof(got), &got_len) == 200);
+    CHECK(got_len == sizeof(file) && memcmp(got, file, sizeof(file)) == 0);
+
+    /* Another user's hashes prove nothing: the body is asked for in full */
+    CHECK(request(&b, CMD_UPLOAD_FILE, offer, len) == 200 && strcmp(reply, "200|0") == 0);
+    CHECK(upload_body(&b, file, 0, sizeof(file)) == 201);
+    CHECK(download(&b, b.user_id, "second.bin", 0, got, sizeof(got), &got_len) == 200);
+    CHECK(got_len == sizeof(file) && memcmp(got, file, sizeof(file)) == 0);
+
+    /* Other bytes than the hashes announce: refused, and not kept to resume */
+    for (size_t i = 0; i < sizeof(file); i++)
+        file[i] = (char)rng();
+    len = offer_hashed(offer, sizeof(offer), "third.bin", file, sizeof(file));
+    memcpy(got, file, sizeof(file));
+    got[sizeof(got) - 1] ^= 1;
+    CHECK(request(&a, CMD_UPLOAD_FILE, offer, len) == 200);
+    CHECK(upload_body(&a, got, 0, sizeof(got)) == 400);
+    CHECK(download(&a, a.user_id, "third.bin", 0, got, sizeof(got), &got_len) == 404);
+    CHECK(request(&a, CMD_UPLOAD_FILE, offer, len) == 200 && strcmp(reply, "200|0") == 0);
+    CHECK(upload_body(&a, file, 0, sizeof(file)) == 201);
+    client_close(&a);
+    client_close(&b);
+}
+
+void test_server(void)
+{
+    int started = server_start() == 0;
+
+    CHECK(started);
+    if (started)
+    {
+        test_chunk_relay();
+        test_upload_download();
+        test_dedup();
+    }
+    server_stop();
+}
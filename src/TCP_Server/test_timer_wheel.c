@@ -0,0 +1,70 @@
+#include <stdint.h>
+
+#include "timer_wheel.h"
+#include "test.h"
+
+/**
+ * Tests of the hierarchical timer wheel
+ */
+
+static uint64_t fired_at[8];
+static struct timer_wheel *fired_wheel;
+
+static void on_timer(void *arg)
+{
+    fired_at[(size_t)arg] = fired_wheel->now - 1;
+}
+
+/* A timer runs on the first tick at or after its delay, across every level */
+void test_timer_wheel(void)
+{
+    /* Up to each level's reach, one past it, and beyond the wheel's range */
+    static const uint64_t delays_ms[] = {0, 50, 6300, 6500, 409700, 26214500, 2000000000, 3000};
+    struct timer_wheel tw;
+    struct timer timers[8];
+    uint64_t now = 1000000;
+
+    tw_init(&tw, now, 100);
+    fired_wheel = &tw;
+    CHECK(tw_timeout(&tw, now) == -1);
+    for (size_t i = 0; i < 8; i++)
+    {
+        timer_init(&timers[i], on_timer, (void *)i);
+        fired_at[i] = 0;
+        tw_arm(&tw, &timers[i], delays_ms[i]);
+    }
+    tw_cancel(&tw, &timers[7]);
+    CHECK(!timer_armed(&timers[7]) && tw.armed == 7);
+
+    /* Clock readings far apart, as after a long sleep: every tick still runs */
+    for (uint64_t step = 0; step < 10000000; step++)
+    {
+        now += step < 100 ? 100 : 100000;
+        tw_advance(&tw, now);
+        if (tw.armed == 0)
+            break;
+    }
+    CHECK(tw.armed == 0);
+    for (size_t i = 0; i < 7; i++)
+    {
+        uint64_t due = 1 + (delays_ms[i] + 99) / 100;
+        if (due >= (uint64_t)1 << (TW_BITS * TW_LEVELS))
+            due = ((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1;
+        CHECK(fired_at[i] == due);
+    }
+    CHECK(fired_at[7] == 0);
+
+    /* Exact ticks through the level 1 and 2 cascades */
+    tw_init(&tw, 0, 100);
+    for (size_t i = 0; i < 3; i++)
+    {
+        timer_init(&timers[i], on_timer, (void *)i);
+        fired_at[i] = 0;
+    }
+    tw_arm(&tw, &timers[0], 6300);
+    tw_arm(&tw, &timers[1], 409500);
+    tw_arm(&tw, &timers[2], 12345600);
+    for (uint64_t ms = 100; tw.armed > 0 && ms < 20000000; ms += 100)
+        tw_advance(&tw, ms);
+    CHECK(fired_at[0] == 64 && fired_at[1] == 4096 && fired_at[2] == 123457);
+}
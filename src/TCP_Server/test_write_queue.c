@@ -0,0 +1,91 @@
+#include <string.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "msg_buf.h"
+#include "write_queue.h"
+#include "test.h"
+
+/**
+ * Tests of the segmented output queue
+ */
+
+/* Gather the unsent bytes of the queue */
+static size_t wq_collect(const struct write_queue *wq, char *out, size_t cap)
+{
+    struct iovec iov[WQ_IOV_MAX];
+    size_t segments, len = 0;
+    int n = wq_fill_iov(wq, iov, WQ_IOV_MAX, &segments);
+
+    for (int i = 0; i < n && len + iov[i].iov_len <= cap; i++)
+    {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+void test_write_queue(void)
+{
+    struct write_queue wq;
+    char big[WQ_SEGMENT_SIZE - 6], out[3 * WQ_SEGMENT_SIZE];
+    char header[6] = "HEADER";
+    char payload[100];
+    struct iovec iov = {payload, sizeof(payload)};
+
+    memset(big, 'n', sizeof(big));
+    memset(payload, 'p', sizeof(payload));
+    wq_init(&wq);
+
+    /* Normal bytes share segments */
+    CHECK(wq_append(&wq, big, 10, WQ_NORMAL) == 0);
+    CHECK(wq_append(&wq, big, 20, WQ_NORMAL) == 0);
+    CHECK(wq.head == wq.tail && wq.bytes == 30);
+    wq_consume(&wq, 30);
+    CHECK(wq.head == NULL && wq.bytes == 0);
+
+    /* A droppable frame behind a segment that started sending gets its own
+     * segment and goes whole, leaving the normal bytes around it intact */
+    CHECK(wq_append(&wq, big, sizeof(big), WQ_NORMAL) == 0);
+    wq_consume(&wq, 10);
+    CHECK(wq_appendv(&wq, header, sizeof(header), &iov, 1, WQ_DROPPABLE) == 0);
+    CHECK(wq_appendv(&wq, header, sizeof(header), &iov, 1, WQ_DROPPABLE) == 0);
+    CHECK(wq_append(&wq, "tail", 4, WQ_NORMAL) == 0);
+    CHECK(wq.bytes == sizeof(big) - 10 + 2 * 106 + 4);
+    CHECK(wq_drop(&wq) == 2 * 106);
+    CHECK(wq.bytes == sizeof(big) - 10 + 4);
+    size_t len = wq_collect(&wq, out, sizeof(out));
+    CHECK(len == wq.bytes && memcmp(out + len - 4, "tail", 4) == 0 && out[0] == 'n' && out[len - 5] == 'n');
+
+    /* Partly sent or pinned droppable frames stay */
+    wq_consume(&wq, wq.bytes);
+    CHECK(wq_appendv(&wq, header, sizeof(header), &iov, 1, WQ_DROPPABLE) == 0);
+    CHECK(wq_appendv(&wq, header, sizeof(header), &iov, 1, WQ_DROPPABLE) == 0);
+    wq_consume(&wq, 3);
+    wq.pinned = 2;
+    CHECK(wq_drop(&wq) == 0 && wq.bytes == 2 * 106 - 3);
+    wq.pinned = 1;
+    CHECK(wq_drop(&wq) == 106 && wq.bytes == 103);
+    wq.pinned = 0;
+    len = wq_collect(&wq, out, sizeof(out));
+    CHECK(len == 103 && memcmp(out, "DER", 3) == 0 && out[3] == 'p');
+
+    /* Consuming across segments of every kind, shared ones keep their buffer alive */
+    wq_consume(&wq, wq.bytes);
+    struct msg_buf *mb = mb_frame(MSG_RESPONSE, "200|ok", 6);
+    CHECK(mb != NULL);
+    CHECK(wq_append(&wq, "ab", 2, WQ_NORMAL) == 0);
+    CHECK(wq_append_shared(&wq, mb, WQ_NORMAL) == 0);
+    CHECK(wq_append(&wq, "cd", 2, WQ_NORMAL) == 0);
+    CHECK(mb->refs == 2);
+    mb_unref(mb);
+    len = wq_collect(&wq, out, sizeof(out));
+    CHECK(len == 16 && memcmp(out, "ab", 2) == 0 && memcmp(out + 8, "200|ok", 6) == 0 &&
+          memcmp(out + 14, "cd", 2) == 0);
+    wq_consume(&wq, 5);
+    len = wq_collect(&wq, out, sizeof(out));
+    CHECK(len == 11 && memcmp(out + 3, "200|okcd", 8) == 0);
+    wq_consume(&wq, 11);
+    CHECK(wq.head == NULL && wq.tail == NULL && wq.bytes == 0);
+    wq_clear(&wq);
+}
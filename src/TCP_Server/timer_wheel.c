@@ -0,0 +1,140 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+void tw_init(struct timer_wheel *tw, uint64_t now_ms, unsigned tick_ms)
+{
+    memset(tw, 0, sizeof(*tw));
+    tw->base_ms = now_ms;
+    tw->tick_ms = tick_ms;
+}
+
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+static void slot_push(struct timer **slot, struct timer *t)
+{
+    t->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * Put a timer in the slot for its distance from the current tick
+ * Level n holds timers due within 64^(n+1) ticks, indexed by bits
+ * [6n, 6n + 6) of their expiry
+ */
+static void tw_link(struct timer_wheel *tw, struct timer *t)
+{
+    uint64_t delta = t->expires - tw->now;
+    int level = 0;
+
+    if (t->expires < tw->now)
+    {
+        /* Already due: the next tick runs it */
+        t->expires = tw->now;
+        delta = 0;
+    }
+    while (level < TW_LEVELS - 1 && delta >= (uint64_t)1 << (TW_BITS * (level + 1)))
+        level++;
+    if (delta >= (uint64_t)1 << (TW_BITS * TW_LEVELS))
+        t->expires = tw->now + ((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1;
+
+    slot_push(&tw->slots[level][(t->expires >> (TW_BITS * level)) & (TW_SLOTS - 1)], t);
+}
+
+void tw_arm(struct timer_wheel *tw, struct timer *t, uint64_t delay_ms)
+{
+    if (timer_armed(t))
+        timer_unlink(t);
+    else
+        tw->armed++;
+
+    /* Counted from the end of the current tick and rounded up, so a timer never runs early */
+    t->expires = tw->current + 1 + (delay_ms + tw->tick_ms - 1) / tw->tick_ms;
+    tw_link(tw, t);
+}
+
+void tw_cancel(struct timer_wheel *tw, struct timer *t)
+{
+    if (!timer_armed(t))
+        return;
+    timer_unlink(t);
+    tw->armed--;
+}
+
+/**
+ * Re-sort one slot of a higher level into the levels below
+ * @return: the slot index, 0 when this level wrapped too
+ */
+static int tw_cascade(struct timer_wheel *tw, int level)
+{
+    int index = (tw->now >> (TW_BITS * level)) & (TW_SLOTS - 1);
+    struct timer *t = tw->slots[level][index];
+
+    tw->slots[level][index] = NULL;
+    while (t != NULL)
+    {
+        struct timer *next = t->next;
+        tw_link(tw, t);
+        t = next;
+    }
+    return index;
+}
+
+void tw_advance(struct timer_wheel *tw, uint64_t now_ms)
+{
+    uint64_t target = (now_ms - tw->base_ms) / tw->tick_ms;
+
+    if (target > tw->current)
+        tw->current = target;
+    while (tw->now <= target)
+    {
+        int index = tw->now & (TW_SLOTS - 1);
+        for (int level = 1; index == 0 && level < TW_LEVELS; level++)
+        {
+            if (tw_cascade(tw, level) != 0)
+                break;
+        }
+
+        /* Detach the slot first: a callback re-arming for 64 ticks lands in it again */
+        struct timer *due = tw->slots[0][index];
+        tw->slots[0][index] = NULL;
+        if (due)
+            due->pprev = &due;
+        tw->now++;
+
+        while (due != NULL)
+        {
+            struct timer *t = due;
+            timer_unlink(t);
+            tw->armed--;
+            t->fn(t->arg);
+        }
+    }
+}
+
+int tw_timeout(const struct timer_wheel *tw, uint64_t now_ms)
+{
+    if (tw->armed == 0)
+        return -1;
+
+    uint64_t next_ms = tw->base_ms + tw->now * tw->tick_ms;
+    return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+}
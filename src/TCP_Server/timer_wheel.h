@@ -0,0 +1,78 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TW_BITS 6 /* 64 slots per level */
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4 /* 64^4 ticks: about 19 days at 100 ms per tick */
+
+/**
+ * One timer, embedded in the object it times
+ * Arming links it into a slot list and cancelling unlinks it, both O(1) and
+ * neither allocates
+ */
+struct timer
+{
+    struct timer *next;
+    struct timer **pprev; /* NULL when not armed */
+    uint64_t expires;     /* Tick */
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+/**
+ * Hierarchical timing wheel
+ * Level 0 has one slot per tick; each slot of level n covers 64^n ticks and
+ * is re-sorted into the levels below when level 0 wraps around to it, so a
+ * tick costs one slot walk however many timers are armed
+ */
+struct timer_wheel
+{
+    uint64_t now;     /* Next tick to run */
+    uint64_t current; /* Tick of the latest clock reading (ahead of now while catching up) */
+    uint64_t base_ms; /* Clock reading at tick 0 */
+    unsigned tick_ms;
+    size_t armed;
+    struct timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+/**
+ * Start an empty wheel at clock reading now_ms
+ */
+void tw_init(struct timer_wheel *tw, uint64_t now_ms, unsigned tick_ms);
+
+/**
+ * Set the callback of an unarmed timer
+ */
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg);
+
+static inline int timer_armed(const struct timer *t)
+{
+    return t->pprev != NULL;
+}
+
+/**
+ * (Re)arm a timer to run no earlier than delay_ms from now
+ */
+void tw_arm(struct timer_wheel *tw, struct timer *t, uint64_t delay_ms);
+
+/**
+ * Disarm a timer; safe if it is not armed
+ */
+void tw_cancel(struct timer_wheel *tw, struct timer *t);
+
+/**
+ * Run every timer due by clock reading now_ms
+ * Callbacks may arm and cancel timers, including their own
+ */
+void tw_advance(struct timer_wheel *tw, uint64_t now_ms);
+
+/**
+ * How long the event loop may sleep before the next tick is due
+ * Returns: milliseconds, -1 when nothing is armed
+ */
+int tw_timeout(const struct timer_wheel *tw, uint64_t now_ms);
+
+#endif // TIMER_WHEEL_H
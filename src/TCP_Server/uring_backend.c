@@ -0,0 +1,647 @@
+#include "reactor.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * io_uring transport, driven through the raw syscalls (no liburing)
+ * - one multishot ACCEPT on the listener
+ * - one multishot RECV per connection, filling buffers from a provided-buffer ring
+ * - one SEND per connection per loop iteration, covering every reply queued
+ *   in it; every SQE prepared during an iteration goes to the kernel in the
+ *   single io_uring_enter() that also waits
+ * - one TIMEOUT while timers are armed, so the wait ends by the next tick
+ * - one READ on the mailbox eventfd, re-armed after each wakeup
+ * File transfers are copied: multishot RECV has already put an upload body
+ * in user space, and downloads are read into the output queue (there is no
+ * sendfile operation; IORING_OP_SPLICE would need a pipe per transfer)
+ */
+
+#define URING_ENTRIES 256
+#define PBUF_GROUP 0
+#define PBUF_COUNT 256 /* Power of two */
+#define PBUF_SIZE 4096
+
+/* user_data = connection pointer | operation; connections are malloc-aligned
+ * (16 bytes). An ACCEPT carries its listening socket in place of the pointer */
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_TIMEOUT 3 /* No connection */
+#define OP_WAKE 4    /* No connection */
+#define OP_CANCEL 5  /* No connection */
+#define OP_SHIFT 3
+#define OP_MASK 7
+
+struct uring
+{
+    int fd;
+    unsigned pending; /* SQEs queued since the last io_uring_enter() */
+    int timeout_armed;
+    struct __kernel_timespec timeout; /* Read by the kernel while the TIMEOUT is pending */
+    uint64_t wake_count;              /* Written by the kernel when the mailbox READ completes */
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br; /* Provided buffers for RECV */
+    unsigned short br_tail;
+    char *bufs;
+};
+
+static int uring_enter(struct uring *u, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Hand all queued SQEs to the kernel without waiting
+ */
+static void uring_submit(struct uring *u)
+{
+    while (u->pending > 0)
+    {
+        int ret = uring_enter(u, u->pending, 0, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter() error");
+            return;
+        }
+        u->pending -= ret;
+    }
+}
+
+/**
+ * Reserve the next SQE, submitting first if the ring is full
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+    unsigned tail = *u->sq_tail;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    {
+        uring_submit(u);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return NULL;
+    }
+
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    return sqe;
+}
+
+/**
+ * Give a provided buffer back to the kernel
+ */
+static void uring_recycle(struct uring *u, unsigned short bid)
+{
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (PBUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * PBUF_SIZE);
+    buf->len = PBUF_SIZE;
+    buf->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_accept(struct reactor *r, int listen_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r->io_state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uint64_t)listen_fd << OP_SHIFT | OP_ACCEPT;
+    return 0;
+}
+
+static int uring_arm_wake(struct reactor *r)
+{
+    struct uring *u = r->io_state;
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->wake_count;
+    sqe->len = sizeof(u->wake_count);
+    sqe->user_data = OP_WAKE;
+    return 0;
+}
+
+/**
+ * Per-connection state: the msghdr and iovecs must stay put until the
+ * SENDMSG completes
+ * While the input ring is full of requests waiting their turn, or the
+ * connection is moving to another reactor, the multishot RECV is cancelled
+ * and what it delivered meanwhile is kept in the stash
+ */
+struct uring_conn
+{
+    struct msghdr msg;
+    struct iovec iov[WQ_IOV_MAX];
+
+    int recv_paused;     /* RECV cancelled until uring_resume() */
+    int recv_cancelling; /* Its last completion is still to come */
+    char *stash;         /* Received bytes that did not fit in the input ring */
+    size_t stash_off;
+    size_t stash_len;
+    size_t stash_cap;
+};
+
+static struct uring_conn *uring_ctx(struct connection *c)
+{
+    if (c->io_ctx == NULL && (c->io_ctx = calloc(1, sizeof(struct uring_conn))) == NULL)
+    {
+        perror("calloc() error");
+        c->is_dead = 1;
+    }
+    return c->io_ctx;
+}
+
+static int uring_watch(struct reactor *r, struct connection *c)
+{
+    struct uring_conn *uc = c->io_ctx;
+    if (uc != NULL && uc->recv_paused)
+    {
+        /* Moved from another reactor: uring_resume() receives again */
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(r->io_state);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = PBUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_RECV;
+    c->io_inflight++;
+    return 0;
+}
+
+/**
+ * Make the next wait return by the next timer tick, unless a TIMEOUT is
+ * already pending (it is never later than one tick)
+ */
+static void uring_arm_timeout(struct reactor *r, struct uring *u)
+{
+    int ms = reactor_timeout(r);
+    if (u->timeout_armed || ms < 0)
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL)
+        return;
+    u->timeout.tv_sec = ms / 1000;
+    u->timeout.tv_nsec = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&u->timeout;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMEOUT;
+    u->timeout_armed = 1;
+}
+
+/**
+ * Queue a SENDMSG over the leading output segments, unless one is already running
+ * The segments it covers are pinned so a slow-consumer drop leaves them alone;
+ * the SQE goes out with the next io_uring_enter(), batched with everything else
+ */
+static void uring_flush(struct reactor *r, struct connection *c)
+{
+    if (c->out.pinned > 0 || c->out.bytes == 0 || c->is_dead)
+        return;
+
+    struct uring_conn *uc = uring_ctx(c);
+    if (uc == NULL)
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(r->io_state);
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "Submission queue full, dropping %s\n", c->addr);
+        c->is_dead = 1;
+        return;
+    }
+
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = wq_fill_iov(&c->out, uc->iov, WQ_IOV_MAX, &c->out.pinned);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_SEND;
+    c->io_inflight++;
+}
+
+/**
+ * Release what the kernel took and send whatever is queued behind it
+ */
+static void uring_on_sent(struct reactor *r, struct connection *c, int res)
+{
+    c->out.pinned = 0;
+    if (res < 0)
+    {
+        if (!c->is_dead)
+            fprintf(stderr, "sendmsg() error: %s\n", strerror(-res));
+        c->is_dead = 1;
+        return;
+    }
+
+    conn_sent(c, res);
+    uring_flush(r, c);
+}
+
+/**
+ * Cancel the multishot RECV until uring_resume(); what it still delivers
+ * goes to the stash
+ */
+static void uring_pause(struct reactor *r, struct connection *c, struct uring_conn *uc)
+{
+    if (uc->recv_paused)
+        return;
+    struct io_uring_sqe *sqe = uring_get_sqe(r->io_state);
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "Submission queue full, dropping %s\n", c->addr);
+        c->is_dead = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)c | OP_RECV;
+    sqe->user_data = OP_CANCEL;
+    uc->recv_paused = 1;
+    uc->recv_cancelling = 1;
+}
+
+/**
+ * Keep bytes the input ring cannot take now, and stop receiving more
+ */
+static void uring_stash(struct reactor *r, struct connection *c, const char *data, size_t len)
+{
+    struct uring_conn *uc = uring_ctx(c);
+    if (uc == NULL)
+        return;
+
+    if (uc->stash_off + uc->stash_len + len > uc->stash_cap)
+    {
+        if (uc->stash_len > 0)
+            memmove(uc->stash, uc->stash + uc->stash_off, uc->stash_len);
+        uc->stash_off = 0;
+        if (uc->stash_len + len > uc->stash_cap)
+        {
+            size_t cap = uc->stash_cap ? uc->stash_cap : PBUF_SIZE;
+            while (cap < uc->stash_len + len)
+                cap *= 2;
+            char *grown = realloc(uc->stash, cap);
+            if (grown == NULL)
+            {
+                perror("realloc() error");
+                c->is_dead = 1;
+                return;
+            }
+            uc->stash = grown;
+            uc->stash_cap = cap;
+        }
+    }
+    memcpy(uc->stash + uc->stash_off + uc->stash_len, data, len);
+    uc->stash_len += len;
+    uring_pause(r, c, uc);
+}
+
+/**
+ * Move stashed bytes into the input ring and receive again once it is empty
+ */
+static void uring_resume(struct reactor *r, struct connection *c)
+{
+    struct uring_conn *uc = c->io_ctx;
+    if (uc == NULL || !uc->recv_paused)
+        return;
+
+    while (uc->stash_len > 0 && !c->is_dead && !c->is_ready && c->holds == 0)
+    {
+        size_t space;
+        char *dst = conn_recv_space(c, &space);
+        if (dst == NULL)
+            return;
+        size_t n = uc->stash_len < space ? uc->stash_len : space;
+        memcpy(dst, uc->stash + uc->stash_off, n);
+        uc->stash_off += n;
+        uc->stash_len -= n;
+        conn_received(r, c, n);
+    }
+    if (uc->stash_len > 0 || c->is_dead)
+        return;
+
+    /* Pauses are rare: an idle connection keeps no stash */
+    free(uc->stash);
+    uc->stash = NULL;
+    uc->stash_off = 0;
+    uc->stash_cap = 0;
+
+    /* A RECV still being cancelled is re-armed by its last completion */
+    uc->recv_paused = 0;
+    if (!uc->recv_cancelling)
+        uring_watch(r, c);
+}
+
+/**
+ * Pause receiving and wait out the SEND in flight; the stash travels with the
+ * connection and uring_resume() on the new reactor receives again
+ */
+static int uring_detach(struct reactor *r, struct connection *c)
+{
+    struct uring_conn *uc = uring_ctx(c);
+    if (uc == NULL)
+        return 0;
+    uring_pause(r, c, uc);
+    return !c->is_dead && c->io_inflight == 0;
+}
+
+static void uring_on_recv(struct reactor *r, struct uring *u, struct connection *c,
+                          int res, unsigned flags)
+{
+    struct uring_conn *uc = c->io_ctx;
+
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = u->bufs + (size_t)bid * PBUF_SIZE;
+        size_t left = res > 0 ? (size_t)res : 0;
+
+        while (left > 0 && !c->is_dead)
+        {
+            size_t space;
+            char *dst = uc != NULL && uc->recv_paused ? NULL : conn_recv_space(c, &space);
+            if (dst == NULL && !c->is_dead)
+            {
+                /* Arrived behind the bytes already stashed, or does not fit */
+                uring_stash(r, c, data, left);
+                uc = c->io_ctx;
+                break;
+            }
+            if (dst == NULL)
+                break;
+            size_t n = left < space ? left : space;
+            memcpy(dst, data, n);
+            conn_received(r, c, n);
+            data += n;
+            left -= n;
+        }
+        uring_recycle(u, bid);
+    }
+
+    if (res == 0)
+    {
+        if (!c->is_dead)
+            printf("Client %s disconnected\n", c->addr);
+        c->is_dead = 1;
+    }
+    else if (res < 0 && res != -ENOBUFS && res != -ECANCELED)
+    {
+        if (!c->is_dead)
+            fprintf(stderr, "recv() error: %s\n", strerror(-res));
+        c->is_dead = 1;
+    }
+
+    /* Multishot ended (error, EOF, ran out of buffers or cancelled): re-arm
+     * if still alive, unless paused */
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        c->io_inflight--;
+        if (uc != NULL)
+            uc->recv_cancelling = 0;
+        if (!c->is_dead && (uc == NULL || !uc->recv_paused))
+            uring_watch(r, c);
+    }
+}
+
+static void uring_on_accept(struct reactor *r, int listen_fd, int res, unsigned flags)
+{
+    if (res >= 0)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t sin_size = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));
+        getpeername(res, (struct sockaddr *)&client_addr, &sin_size);
+
+        reactor_admit(r, res, (struct sockaddr *)&client_addr);
+    }
+    else
+    {
+        reactor_accept_failed(r, listen_fd, -res);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        uring_arm_accept(r, listen_fd);
+}
+
+/**
+ * Kick pending operations out with shutdown(), free once they have all completed
+ */
+static void uring_close(struct reactor *r, struct connection *c)
+{
+    if (c->io_inflight > 0)
+    {
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+
+    struct uring_conn *uc = c->io_ctx;
+    if (uc != NULL)
+        free(uc->stash);
+    conn_destroy(r, c);
+}
+
+static void uring_complete(struct reactor *r, struct uring *u, struct io_uring_cqe *cqe)
+{
+    int op = cqe->user_data & OP_MASK;
+    struct connection *c = (struct connection *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+    if (op == OP_ACCEPT)
+    {
+        uring_on_accept(r, (int)(cqe->user_data >> OP_SHIFT), cqe->res, cqe->flags);
+        return;
+    }
+    if (op == OP_CANCEL)
+        return;
+    if (op == OP_WAKE)
+    {
+        /* The READ already reset the eventfd */
+        reactor_run_mailbox(r);
+        uring_arm_wake(r);
+        return;
+    }
+    if (op == OP_TIMEOUT)
+    {
+        u->timeout_armed = 0;
+        return;
+    }
+
+    if (op == OP_RECV)
+    {
+        uring_on_recv(r, u, c, cqe->res, cqe->flags);
+    }
+    else
+    {
+        c->io_inflight--;
+        uring_on_sent(r, c, cqe->res);
+    }
+
+    if (c->is_dead)
+        uring_close(r, c);
+}
+
+static void uring_run(struct reactor *r)
+{
+    struct uring *u = r->io_state;
+
+    while (1)
+    {
+        /* Connections waiting on the ready list: collect completions, do not wait */
+        int wait = r->ready == NULL;
+        if (wait)
+            uring_arm_timeout(r, u);
+        int ret = uring_enter(u, u->pending, wait, IORING_ENTER_GETEVENTS);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter() error");
+            return;
+        }
+        u->pending -= ret;
+        reactor_tick(r);
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            uring_complete(r, u, &u->cqes[head & *u->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+        reactor_flush_pending(r);
+    }
+}
+
+static int uring_init(struct reactor *r)
+{
+    struct io_uring_params p;
+    struct uring *u = calloc(1, sizeof(*u));
+    if (u == NULL)
+        return -1;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0)
+    {
+        free(u);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        goto fail;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+        goto fail;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    /* Provided buffers: the kernel picks one per RECV completion */
+    u->br = mmap(NULL, PBUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    u->bufs = malloc((size_t)PBUF_COUNT * PBUF_SIZE);
+    if (u->br == MAP_FAILED || u->bufs == NULL)
+        goto fail;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = PBUF_COUNT;
+    reg.bgid = PBUF_GROUP;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (unsigned short bid = 0; bid < PBUF_COUNT; bid++)
+        uring_recycle(u, bid);
+
+    /* A blocking listener lets the kernel park the multishot accept instead of returning EAGAIN */
+    fcntl(r->listen_fd, F_SETFL, fcntl(r->listen_fd, F_GETFL, 0) & ~O_NONBLOCK);
+    if (r->unix_fd != -1)
+        fcntl(r->unix_fd, F_SETFL, fcntl(r->unix_fd, F_GETFL, 0) & ~O_NONBLOCK);
+    /* Likewise for the mailbox READ; posting never blocks on an eventfd */
+    fcntl(r->wake_fd, F_SETFL, fcntl(r->wake_fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    r->io_state = u;
+    if (uring_arm_wake(r) == -1)
+        return -1;
+    if (r->unix_fd != -1 && uring_arm_accept(r, r->unix_fd) == -1)
+        return -1;
+    return uring_arm_accept(r, r->listen_fd);
+
+fail:
+    close(u->fd);
+    free(u->bufs);
+    free(u);
+    return -1;
+}
+
+const struct io_backend uring_backend = {
+    .name = "io_uring",
+    .zero_copy = 0,
+    .init = uring_init,
+    .run = uring_run,
+    .watch = uring_watch,
+    .flush = uring_flush,
+    .close = uring_close,
+    .resume = uring_resume,
+    .detach = uring_detach,
+};
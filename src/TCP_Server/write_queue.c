@@ -0,0 +1,282 @@
+#include "write_queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void wq_init(struct write_queue *wq)
+{
+    wq->head = NULL;
+    wq->tail = NULL;
+    wq->bytes = 0;
+    wq->pinned = 0;
+}
+
+/* Emptied segments of the default size, kept for the next replies of any
+ * connection on this thread, so an idle connection holds none */
+static __thread struct out_segment *seg_pool;
+static __thread unsigned seg_pooled;
+
+static struct out_segment *seg_alloc(size_t cap)
+{
+    struct out_segment *seg = seg_pool;
+    if (cap == WQ_SEGMENT_SIZE && seg != NULL)
+    {
+        seg_pool = seg->next;
+        seg_pooled--;
+        return seg;
+    }
+    return malloc(sizeof(*seg) + cap);
+}
+
+static void seg_free(struct out_segment *seg)
+{
+    if (seg->shared)
+        mb_unref(seg->shared);
+    if (seg->file_owned)
+        close(seg->file_fd);
+    if (seg->cap != WQ_SEGMENT_SIZE || seg_pooled >= WQ_POOL_MAX)
+    {
+        free(seg);
+        return;
+    }
+    seg->next = seg_pool;
+    seg_pool = seg;
+    seg_pooled++;
+}
+
+static void seg_link(struct write_queue *wq, struct out_segment *seg)
+{
+    if (wq->tail)
+        wq->tail->next = seg;
+    else
+        wq->head = seg;
+    wq->tail = seg;
+    wq->bytes += seg->len;
+}
+
+void wq_clear(struct write_queue *wq)
+{
+    struct out_segment *seg = wq->head;
+    while (seg != NULL)
+    {
+        struct out_segment *next = seg->next;
+        seg_free(seg);
+        seg = next;
+    }
+    wq_init(wq);
+}
+
+/**
+ * Append to the queue
+ * @param wq: Write queue
+ * @param data: Bytes to append
+ * @param len: Number of bytes
+ * @param cls: WQ_NORMAL or WQ_DROPPABLE; a droppable message never shares a
+ *             segment, so it can be removed whole
+ * @return: 0 on success, -1 on allocation failure
+ */
+int wq_append(struct write_queue *wq, const void *data, size_t len, int cls)
+{
+    return wq_appendv(wq, data, len, NULL, 0, cls);
+}
+
+static struct out_segment *seg_new(size_t len, int cls)
+{
+    size_t cap = len > WQ_SEGMENT_SIZE ? len : WQ_SEGMENT_SIZE;
+    struct out_segment *seg = seg_alloc(cap);
+    if (seg == NULL)
+        return NULL;
+    seg->next = NULL;
+    seg->len = 0;
+    seg->off = 0;
+    seg->cap = cap;
+    seg->cls = cls;
+    seg->base = seg->data;
+    seg->shared = NULL;
+    seg->file_fd = -1;
+    seg->file_owned = 0;
+    return seg;
+}
+
+/* Copy into the tail segment, or a new one when it has no room or another class */
+static int wq_copy(struct write_queue *wq, const void *data, size_t len, int cls)
+{
+    struct out_segment *seg = wq->tail;
+
+    if (len == 0)
+        return 0;
+    if (seg != NULL && seg->cap > 0 && seg->cls == cls && seg->cap - seg->len >= len)
+    {
+        memcpy(seg->data + seg->len, data, len);
+        seg->len += len;
+        wq->bytes += len;
+        return 0;
+    }
+    seg = seg_new(len, cls);
+    if (seg == NULL)
+        return -1;
+    memcpy(seg->data, data, len);
+    seg->len = len;
+    seg_link(wq, seg);
+    return 0;
+}
+
+int wq_appendv(struct write_queue *wq, const void *head, size_t head_len, const struct iovec *iov, int iovcnt,
+               int cls)
+{
+    if (cls != WQ_DROPPABLE)
+    {
+        int ret = wq_copy(wq, head, head_len, cls);
+        for (int i = 0; i < iovcnt && ret == 0; i++)
+            ret = wq_copy(wq, iov[i].iov_base, iov[i].iov_len, cls);
+        return ret;
+    }
+
+    size_t len = head_len;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len == 0)
+        return 0;
+
+    /* Never shared with the message before or after it */
+    struct out_segment *seg = seg_new(len, cls);
+    if (seg == NULL)
+        return -1;
+    memcpy(seg->data, head, head_len);
+    seg->len = head_len;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(seg->data + seg->len, iov[i].iov_base, iov[i].iov_len);
+        seg->len += iov[i].iov_len;
+    }
+    seg_link(wq, seg);
+    return 0;
+}
+
+int wq_append_shared(struct write_queue *wq, struct msg_buf *mb, int cls)
+{
+    struct out_segment *seg = malloc(sizeof(*seg));
+    if (seg == NULL)
+        return -1;
+    mb_ref(mb);
+    seg->next = NULL;
+    seg->len = mb->len;
+    seg->off = 0;
+    seg->cap = 0;
+    seg->cls = cls;
+    seg->base = mb->data;
+    seg->shared = mb;
+    seg->file_fd = -1;
+    seg->file_owned = 0;
+    seg_link(wq, seg);
+    return 0;
+}
+
+int wq_append_file(struct write_queue *wq, int fd, off_t off, size_t len, int owned)
+{
+    struct out_segment *seg = malloc(sizeof(*seg));
+    if (seg == NULL)
+        return -1;
+    seg->next = NULL;
+    seg->len = len;
+    seg->off = 0;
+    seg->cap = 0;
+    seg->cls = WQ_NORMAL;
+    seg->base = NULL;
+    seg->shared = NULL;
+    seg->file_fd = fd;
+    seg->file_owned = owned;
+    seg->file_off = off;
+    seg_link(wq, seg);
+    return 0;
+}
+
+void wq_release_file(struct write_queue *wq, int fd)
+{
+    struct out_segment *last = NULL;
+
+    for (struct out_segment *seg = wq->head; seg != NULL; seg = seg->next)
+    {
+        if (seg->file_fd == fd)
+            last = seg;
+    }
+    if (last != NULL)
+        last->file_owned = 1;
+    else
+        close(fd);
+}
+
+int wq_fill_iov(const struct write_queue *wq, struct iovec *iov, int max, size_t *segments)
+{
+    int n = 0;
+    size_t walked = 0;
+
+    for (struct out_segment *seg = wq->head; seg != NULL && n < max; seg = seg->next)
+    {
+        if (seg->file_fd != -1)
+            break;
+        walked++;
+        if (seg->len == seg->off)
+            continue;
+        iov[n].iov_base = seg->base + seg->off;
+        iov[n].iov_len = seg->len - seg->off;
+        n++;
+    }
+    *segments = walked;
+    return n;
+}
+
+/**
+ * Advance past n sent bytes, freeing finished segments (a drained queue holds
+ * none; the segment pool makes the next reply cheap)
+ * @param wq: Write queue
+ * @param n: Bytes the kernel accepted
+ */
+void wq_consume(struct write_queue *wq, size_t n)
+{
+    wq->bytes -= n;
+
+    while (wq->head != NULL && (n > 0 || wq->head->off == wq->head->len))
+    {
+        struct out_segment *seg = wq->head;
+        size_t left = seg->len - seg->off;
+
+        if (n < left)
+        {
+            seg->off += n;
+            return;
+        }
+        n -= left;
+        wq->head = seg->next;
+        if (wq->head == NULL)
+            wq->tail = NULL;
+        seg_free(seg);
+    }
+}
+
+size_t wq_drop(struct write_queue *wq)
+{
+    struct out_segment **pp = &wq->head;
+    struct out_segment *prev = NULL;
+    size_t dropped = 0;
+    size_t index = 0;
+
+    while (*pp != NULL)
+    {
+        struct out_segment *seg = *pp;
+        if (index >= wq->pinned && seg->cls == WQ_DROPPABLE && seg->off == 0)
+        {
+            *pp = seg->next;
+            if (wq->tail == seg)
+                wq->tail = prev;
+            dropped += seg->len;
+            seg_free(seg);
+            continue;
+        }
+        prev = seg;
+        pp = &seg->next;
+        index++;
+    }
+    wq->bytes -= dropped;
+    return dropped;
+}
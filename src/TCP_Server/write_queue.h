@@ -0,0 +1,115 @@
+#ifndef WRITE_QUEUE_H
+#define WRITE_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "msg_buf.h"
+
+#define WQ_SEGMENT_SIZE 4096 /* Minimum segment allocation */
+#define WQ_IOV_MAX 16        /* Segments handed to one writev()/sendmsg() */
+#define WQ_POOL_MAX 64       /* Free segments of WQ_SEGMENT_SIZE kept per thread */
+
+/* Segment classes */
+#define WQ_NORMAL 0
+#define WQ_DROPPABLE 1 /* May be discarded for a slow reader (meant for presence updates, none sent yet) */
+
+/**
+ * One chunk of pending output
+ * Segments never move once allocated, so a backend may hand their bytes to
+ * the kernel while more data is appended behind them. A shared segment points
+ * into a struct msg_buf it holds a reference to and is never appended to. A
+ * file segment has no bytes in memory: they are read from file_fd at file_off
+ * by sendfile(), and iovecs stop in front of it.
+ */
+struct out_segment
+{
+    struct out_segment *next;
+    size_t len; /* Bytes stored */
+    size_t off; /* Bytes already sent */
+    size_t cap; /* 0 for a shared segment */
+    int cls;
+    char *base;             /* data, or the shared buffer's bytes */
+    struct msg_buf *shared; /* NULL for an owned segment */
+    int file_fd;            /* -1 for bytes in memory */
+    int file_owned;         /* file_fd is closed with the segment */
+    off_t file_off;         /* Where the segment's bytes start in the file */
+    char data[];
+};
+
+/**
+ * Per-connection FIFO of output segments
+ */
+struct write_queue
+{
+    struct out_segment *head;
+    struct out_segment *tail;
+    size_t bytes;  /* Unsent bytes */
+    size_t pinned; /* Leading segments referenced by an in-flight send */
+};
+
+void wq_init(struct write_queue *wq);
+
+/**
+ * Free every segment
+ */
+void wq_clear(struct write_queue *wq);
+
+/**
+ * Append bytes, filling the tail segment when it has room and the same class
+ * (droppable bytes always get a segment of their own)
+ * Returns: 0 on success, -1 on allocation failure
+ */
+int wq_append(struct write_queue *wq, const void *data, size_t len, int cls);
+
+/**
+ * Append one message: head_len bytes of head, then the iovcnt pieces of iov
+ * A droppable message is gathered into a single segment, so it is either
+ * dropped whole or sent whole
+ * Returns: 0 on success, -1 on allocation failure
+ */
+int wq_appendv(struct write_queue *wq, const void *head, size_t head_len, const struct iovec *iov, int iovcnt,
+               int cls);
+
+/**
+ * Append a reference to a shared buffer; the queue takes its own reference
+ * Returns: 0 on success, -1 on allocation failure
+ */
+int wq_append_shared(struct write_queue *wq, struct msg_buf *mb, int cls);
+
+/**
+ * Append len bytes of a file from offset off, left in the file until sent
+ * With owned set the segment closes fd once it is freed; otherwise fd must
+ * stay open while the segment is queued, see wq_release_file()
+ * Returns: 0 on success, -1 on allocation failure
+ */
+int wq_append_file(struct write_queue *wq, int fd, off_t off, size_t len, int owned);
+
+/**
+ * Give up fd: the last queued segment still reading from it takes ownership
+ * and closes it once sent, or fd is closed now if none does
+ */
+void wq_release_file(struct write_queue *wq, int fd);
+
+/**
+ * Describe the unsent bytes as at most max iovecs, up to the first file segment
+ * *segments receives how many leading segments the iovecs reach into (the
+ * value to pin while they are in flight)
+ * Returns: number of iovecs filled
+ */
+int wq_fill_iov(const struct write_queue *wq, struct iovec *iov, int max, size_t *segments);
+
+/**
+ * Release n sent bytes from the front of the queue
+ */
+void wq_consume(struct write_queue *wq, size_t n);
+
+/**
+ * Discard droppable segments that have not started to go out and are not
+ * pinned; each holds exactly one message
+ * Returns: number of bytes discarded
+ */
+size_t wq_drop(struct write_queue *wq);
+
+#endif // WRITE_QUEUE_H